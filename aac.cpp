@@ -39,137 +39,1357 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <thread>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
 
-int getADTSframe(unsigned char* buffer, int buf_size, unsigned char* data ,int* data_size){
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#define AAC_FSEEK   _fseeki64
+// Windows 没有 writev，用 _write 逐段写出
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+#define IOV_MAX 1024
+static long writev(int fd, const struct iovec *iov, int iovcnt) {
+    long total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        int n = _write(fd, iov[i].iov_base, (unsigned) iov[i].iov_len);
+        if (n < 0) {
+            return total > 0 ? total : -1;
+        }
+        total += n;
+        if ((size_t) n < iov[i].iov_len) {
+            break;
+        }
+    }
+    return total;
+}
+#else
+#define AAC_FSEEK   fseeko
+#endif
+
+// x86 平台上使用 SSE2/AVX2 加速同步字的查找
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define AAC_X86_SIMD 1
+#endif
+
+#define ADTS_LOOKAHEAD_FRAMES   2       // 找到同步字以后，再检查后面几个帧头是否连续
+
+/*
+ * 同步字是12比特的 0xFFF，后面紧跟 ID(1比特)、layer(2比特，固定为00)、protection_absent(1比特)，
+ * 所以第一个字节为 0xFF，第二个字节满足 (b & 0xF6) == 0xF0。
+ */
+static int IsADTSSync(const unsigned char *p) {
+    return p[0] == 0xff && (p[1] & 0xf6) == 0xf0;
+}
+
+// 标量版本：用 memchr 跳到下一个 0xFF（libc 的 memchr 本身是向量化的），再检查下一个字节
+static const unsigned char *FindADTSSyncScalar(const unsigned char *p, const unsigned char *end) {
+    while (end - p >= 2) {
+        p = (const unsigned char *) memchr(p, 0xff, end - p - 1);
+        if (p == NULL) {
+            return end;
+        }
+        if ((p[1] & 0xf6) == 0xf0) {
+            return p;
+        }
+        p++;
+    }
+    return end;
+}
+
+#ifdef AAC_X86_SIMD
+// SSE2 版本：一次检查16个位置，分别加载 p 和 p+1 两个向量
+static const unsigned char *FindADTSSyncSSE2(const unsigned char *p, const unsigned char *end) {
+    const __m128i ff = _mm_set1_epi8((char) 0xff);
+    const __m128i f6 = _mm_set1_epi8((char) 0xf6);
+    const __m128i f0 = _mm_set1_epi8((char) 0xf0);
+    while (end - p >= 16 + 1) {
+        __m128i a = _mm_loadu_si128((const __m128i *) p);
+        __m128i b = _mm_loadu_si128((const __m128i *) (p + 1));
+        __m128i m = _mm_and_si128(_mm_cmpeq_epi8(a, ff), _mm_cmpeq_epi8(_mm_and_si128(b, f6), f0));
+        int mask = _mm_movemask_epi8(m);
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+    return FindADTSSyncScalar(p, end);
+}
+
+// AVX2 版本：与 SSE2 相同，一次检查32个位置
+__attribute__((target("avx2")))
+static const unsigned char *FindADTSSyncAVX2(const unsigned char *p, const unsigned char *end) {
+    const __m256i ff = _mm256_set1_epi8((char) 0xff);
+    const __m256i f6 = _mm256_set1_epi8((char) 0xf6);
+    const __m256i f0 = _mm256_set1_epi8((char) 0xf0);
+    while (end - p >= 32 + 1) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) p);
+        __m256i b = _mm256_loadu_si256((const __m256i *) (p + 1));
+        __m256i m = _mm256_and_si256(_mm256_cmpeq_epi8(a, ff), _mm256_cmpeq_epi8(_mm256_and_si256(b, f6), f0));
+        unsigned mask = (unsigned) _mm256_movemask_epi8(m);
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+    return FindADTSSyncSSE2(p, end);
+}
+#endif
+
+typedef const unsigned char *(*FindADTSSyncFunc)(const unsigned char *p, const unsigned char *end);
+
+// 运行时根据 CPU 选择实现。可以用环境变量 AAC_SIMD=scalar/sse2/avx2 强制指定（用于对比测试）
+static FindADTSSyncFunc SelectFindADTSSync() {
+    const char *force = getenv("AAC_SIMD");
+#ifdef AAC_X86_SIMD
+    if (force == NULL || strcmp(force, "avx2") == 0) {
+        if (__builtin_cpu_supports("avx2")) {
+            return FindADTSSyncAVX2;
+        }
+    }
+    if (force == NULL || strcmp(force, "scalar") != 0) {
+        return FindADTSSyncSSE2;
+    }
+#endif
+    (void) force;
+    return FindADTSSyncScalar;
+}
+
+/**
+ * Find the first ADTS sync word in [p, end), p[i + 1] must also be inside the range.
+ * @return Pointer to the 0xFF byte, or end if not found.
+ */
+const unsigned char *FindADTSSync(const unsigned char *p, const unsigned char *end) {
+    static FindADTSSyncFunc func = SelectFindADTSSync();
+    return func(p, end);
+}
+
+/**
+ * 检查 p 处的7个字节是否为合法的 ADTS 帧头
+ * @return 帧长度（包括帧头），不合法时返回0
+ */
+static int ParseADTSHeader(const unsigned char *p) {
+    if (!IsADTSSync(p)) {
+        return 0;
+    }
+    // sampling_frequency_index：13、14 保留，15 在 ADTS 中不允许
+    if (((p[2] & 0x3c) >> 2) > 12) {
+        return 0;
+    }
+    int size = ((p[3] & 0x03) << 11) | (p[4] << 3) | ((p[5] & 0xe0) >> 5);
+    // protection_absent 为0时帧头后面还有2字节的 CRC
+    int header_size = (p[1] & 0x01) ? 7 : 9;
+    return size >= header_size ? size : 0;
+}
+
+// 同一个码流中 adts_fixed_header 的字段（ID、layer、protection_absent、profile、采样率、声道配置）不会改变
+static int SameADTSStream(const unsigned char *a, const unsigned char *b) {
+    return a[1] == b[1] && (a[2] & 0xfd) == (b[2] & 0xfd) && (a[3] & 0xc0) == (b[3] & 0xc0);
+}
+
+
+/**
+ * Find the next ADTS frame in place, without copying it. A frame header at the start of the buffer
+ * only needs to be valid when in_sync is set. Otherwise (after garbage has been skipped) a candidate
+ * is accepted only if the following ADTS_LOOKAHEAD_FRAMES headers line up with it.
+ * @param buffer      Input data.
+ * @param buf_size    Size of input data.
+ * @param in_sync     The previous frame ended at buffer[0].
+ * @param at_end      No data follows the buffer. Otherwise a candidate whose lookahead frames are not
+ *                    all inside the buffer is reported as incomplete instead of being accepted.
+ * @param offset      Output offset of the frame header in buffer (bytes of garbage skipped).
+ * @param data_size   Output frame size.
+ * @return 0 on success, 1 if the frame is incomplete, -1 if no frame header is found.
+ */
+int FindADTSFrame(const unsigned char* buffer, size_t buf_size, int in_sync, int at_end, size_t* offset, int* data_size){
     int size = 0;
 
-    if(!buffer || !data || !data_size ){
+    if(!buffer || !offset || !data_size ){
         return -1;
     }
 
+    const unsigned char *p = buffer;
+    const unsigned char *end = buffer + buf_size;
     while(1){
         // ADTS header占56bit，也就是7个byte
-        if(buf_size  < 7 ){
+        if(end - p < 7 ){
             return -1;
         }
         //Sync words
         // 可查看：https://www.cnblogs.com/daner1257/p/10709233.html#:~:text=ID%EF%BC%9A%E8%A1%A8%E7%A4%BA%E4%BD%BF%E7%94%A8%E7%9A%84MPEG%E7%9A%84%E7%89%88%E6%9C%AC%EF%BC%8C0%E8%A1%A8%E7%A4%BAMPEG-4%EF%BC%8C1%E8%A1%A8%E7%A4%BAMPEG-2,layer%EF%BC%9A%E5%90%8Csyncword%EF%BC%8C%E5%80%BC%E5%9B%BA%E5%AE%9A%EF%BC%8C%E9%83%BD%E6%98%AF00%20protection_absent%EF%BC%9A%E6%98%AF%E5%90%A6%E6%9C%89%E5%90%8C%E6%AD%A5%E6%A0%A1%E9%AA%8C%EF%BC%8C%E5%A6%82%E6%9E%9C%E6%9C%89%E5%80%BC%E6%98%AF0%EF%BC%8C%E6%B2%A1%E6%9C%89%E6%98%AF1
         // 在AAC编码中，同步字节是用来标识帧头在比特流中的位置的。
         // 在AAC的ADTS（Audio Data Transport Stream）格式中，同步字为12比特的“1111 1111 1111”   0xFFF
-        // buffer[0] == 0xff  : 判断第一个字节是不是为FF
-        // (buffer[1] & 0xf0) == 0xf0 ： 将第二个字节的前四位取出来，后四位置为0 ， 与0xf0比较，可以判断是前四位是否为0xF
-        // 因此此判断条件可以判断出 同步字节
-        if((buffer[0] == 0xff) && ((buffer[1] & 0xf0) == 0xf0) ){
-            size |= ((buffer[3] & 0x03) <<11);     //high 2 bit
-            size |= buffer[4]<<3;                //middle 8 bit
-            size |= ((buffer[5] & 0xe0)>>5);        //low 3bit
+        // 用 SIMD 一次检查16/32个位置，只在帧头完整（7个字节）的范围内查找
+        p = FindADTSSync(p, end - 5);
+        if(end - p < 7){
+            return -1;
+        }
+        size = ParseADTSHeader(p);
+        if(size == 0){
+            ++p;
+            continue;
+        }
+        // 上一帧刚好在 buffer 开头结束时（码流是同步的），只检查帧头本身；
+        // 跳过了数据（重新同步）时再向后检查几个帧头：伪同步字后面不会恰好跟着同一个码流的帧头。
+        // 这样损坏数据前面的最后一个好帧也不会因为后面是垃圾数据而被丢掉
+        const unsigned char *q = p;
+        int q_size = size;
+        int valid = 1;
+        int lookahead = (in_sync && p == buffer) ? 0 : ADTS_LOOKAHEAD_FRAMES;
+        for(int i = 0; i < lookahead; i++){
+            if(end - q - q_size < 7){
+                if(!at_end){
+                    // 后面的帧头还没有读进来，等数据够了再判断
+                    *offset = (size_t) (p - buffer);
+                    *data_size = size;
+                    return 1;
+                }
+                break;
+            }
+            const unsigned char *next = q + q_size;
+            int next_size = ParseADTSHeader(next);
+            if(next_size == 0 || !SameADTSStream(p, next)){
+                valid = 0;
+                break;
+            }
+            q = next;
+            q_size = next_size;
+        }
+        if(valid){
             break;
         }
-        --buf_size;
-        ++buffer;
+        // 伪同步：从下一个字节继续找
+        ++p;
+    }
+    *offset = (size_t) (p - buffer);
+    *data_size = size;
+    if(end - p < size){
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Find the next ADTS frame and copy it to data.
+ * @param buffer      Input data.
+ * @param buf_size    Size of input data.
+ * @param data        Output frame data.
+ * @param data_size   Output frame size.
+ * @param skipped     Optional, bytes of garbage skipped before the frame.
+ * @return 0 on success, 1 if the frame is incomplete, -1 if no frame header is found.
+ */
+int getADTSframe(unsigned char* buffer, int buf_size, unsigned char* data ,int* data_size, int* skipped = NULL){
+    size_t offset = 0;
+    int size = 0;
+
+    if(!buffer || !data || !data_size || buf_size < 0){
+        return -1;
     }
-    if(buf_size < size){
+    int ret = FindADTSFrame(buffer, (size_t) buf_size, 1, 1, &offset, &size);
+    if(ret == -1){
+        return -1;
+    }
+    if(skipped){
+        *skipped = (int) offset;
+    }
+    if(ret == 1){
         return 1;
     }
 
-    memcpy(data, buffer, size);
+    memcpy(data, buffer + offset, size);
     *data_size = size;
 
     return 0;
 }
 
-int simplest_aac_parser(char *url)
-{
-    int data_size = 0;
-    int size = 0;
-    int cnt=0;
-    int offset=0;
+/* ====================== 流式读取（环形缓冲区） ======================
+ * 原来的 simplest_aac_parser 每次 fread 1MB，帧不完整时把剩下的数据 memcpy 到最前面，
+ * 并且把每一帧都复制到 aacframe 里，虽然只用到了帧头。
+ * ADTS_RING 使用一块固定大小的环形缓冲区，帧直接在缓冲区里解析，不需要复制，也不需要 seek，
+ * 所以可以读管道/标准输入，内存占用与文件大小无关。
+ * 缓冲区末尾多分配 ADTS_RING_OVERHANG 字节，写入缓冲区开头的数据同时复制一份到末尾，
+ * 这样从任意位置开始的帧（以及重新同步时向后检查的几个帧）在内存中都是连续的。
+ */
 
-    //FILE *myout=fopen("output_log.txt","wb+");
-    FILE *myout=stdout;
+#define ADTS_MAX_FRAME_SIZE     8191    // frame_length 只有13比特
+#define ADTS_RING_OVERHANG      ((ADTS_MAX_FRAME_SIZE + 1) * (ADTS_LOOKAHEAD_FRAMES + 1))
+
+#ifndef ADTS_RING_SIZE
+#define ADTS_RING_SIZE          (64 * 1024)     // 必须是2的幂，并且不小于 ADTS_RING_OVERHANG
+#endif
+
+typedef struct {
+    unsigned char *buf;             //! capacity + ADTS_RING_OVERHANG 字节
+    size_t capacity;
+    unsigned long long rpos;        //! 下一次解析的位置（在整个码流中的位置）
+    unsigned long long wpos;        //! 已经读入的数据的结束位置
+    FILE *fp;
+    int eof;
+    int in_sync;                    //! 上一帧刚好在 rpos 结束
+    unsigned long long skipped;     //! 还没有报告的垃圾数据字节数
+} ADTS_RING;
+
+typedef struct {
+    const unsigned char *data;      //! 整个帧（包括帧头），在下一次 ADTSRingNext 之前有效
+    int size;
+    unsigned long long offset;      //! 帧在码流中的位置
+    unsigned long long skipped;     //! 帧前面跳过的垃圾数据字节数
+} ADTS_FRAME_VIEW;
+
+/**
+ * Init the ring buffer reader.
+ * @param fp          Input file, may be a pipe.
+ * @param capacity    Ring size (power of 2), 0 means ADTS_RING_SIZE.
+ * @return 0 on success, -1 on failure.
+ */
+int ADTSRingInit(ADTS_RING *ring, FILE *fp, size_t capacity) {
+    memset(ring, 0, sizeof(ADTS_RING));
+    if (capacity == 0) {
+        capacity = ADTS_RING_SIZE;
+    }
+    if ((capacity & (capacity - 1)) != 0 || capacity < ADTS_RING_OVERHANG) {
+        return -1;
+    }
+    ring->capacity = capacity;
+    ring->buf = (unsigned char *) malloc(capacity + ADTS_RING_OVERHANG);
+    ring->fp = fp;
+    ring->in_sync = 1;
+    return ring->buf ? 0 : -1;
+}
+
+void ADTSRingClose(ADTS_RING *ring) {
+    free(ring->buf);
+    memset(ring, 0, sizeof(ADTS_RING));
+}
+
+// 把环形缓冲区读满（或者读到文件结束）
+static void ADTSRingFill(ADTS_RING *ring) {
+    size_t mask = ring->capacity - 1;
+    while (!ring->eof && ring->wpos - ring->rpos < ring->capacity) {
+        size_t w = (size_t) (ring->wpos & mask);
+        size_t n = ring->capacity - w;
+        size_t free_size = ring->capacity - (size_t) (ring->wpos - ring->rpos);
+        if (n > free_size) {
+            n = free_size;
+        }
+        size_t r = fread(ring->buf + w, 1, n, ring->fp);
+        if (r == 0) {
+            ring->eof = 1;
+            break;
+        }
+        // 缓冲区开头的数据在末尾也保留一份
+        if (w < ADTS_RING_OVERHANG) {
+            size_t m = ADTS_RING_OVERHANG - w;
+            memcpy(ring->buf + ring->capacity + w, ring->buf + w, r < m ? r : m);
+        }
+        ring->wpos += r;
+    }
+}
 
-    // aacframe是用来存储单个AAC帧的数据。一般来说，一个AAC帧的数据量不会超过1024*5字节。所以，这里分配了1024*5字节的内存给aacframe。
-    unsigned char *aacframe=(unsigned char *)malloc(1024*5);
-    /*
-     * aacbuffer是用来存储从文件中读取的所有AAC数据。由于一个AAC文件可能会包含很多帧，所以需要更大的内存来存储。
-     * 这里分配了1024*1024字节（即1MB）的内存给aacbuffer，以确保有足够的空间来存储从文件中读取的数据。
-     */
-    unsigned char *aacbuffer=(unsigned char *)malloc(1024*1024);
+/**
+ * Read the next ADTS frame. The frame is not copied, view->data points into the ring buffer.
+ * @return 1 if view was filled, 0 at the end of the stream.
+ */
+int ADTSRingNext(ADTS_RING *ring, ADTS_FRAME_VIEW *view) {
+    size_t mask = ring->capacity - 1;
+    while (1) {
+        // 保证重新同步时能向后检查几个完整的帧
+        if (ring->wpos - ring->rpos < ADTS_RING_OVERHANG) {
+            ADTSRingFill(ring);
+        }
+        size_t avail = (size_t) (ring->wpos - ring->rpos);
+        size_t r = (size_t) (ring->rpos & mask);
+        size_t contiguous = ring->capacity + ADTS_RING_OVERHANG - r;
+        if (contiguous > avail) {
+            contiguous = avail;
+        }
+        const unsigned char *p = ring->buf + r;
+        size_t offset = 0;
+        int size = 0;
+        // 缓冲区里的数据一直到文件末尾时，才允许在数据不够的情况下直接接受帧头
+        int at_end = ring->eof && contiguous == avail;
+        int ret = FindADTSFrame(p, contiguous, ring->in_sync, at_end, &offset, &size);
+        if (ret == 0) {
+            view->data = p + offset;
+            view->size = size;
+            view->offset = ring->rpos + offset;
+            view->skipped = ring->skipped + offset;
+            ring->rpos += offset + size;
+            ring->in_sync = 1;
+            ring->skipped = 0;
+            return 1;
+        }
+        if (at_end) {
+            // 最后一帧不完整，或者后面只剩垃圾数据
+            return 0;
+        }
+        // 丢掉已经确定不是帧头的数据：没有找到时保留最后6个字节，它们可能是下一个帧头的开头
+        size_t drop = ret == 1 ? offset : (contiguous > 6 ? contiguous - 6 : 0);
+        if (drop == 0) {
+            return 0;
+        }
+        ring->rpos += drop;
+        ring->skipped += drop;
+        ring->in_sync = 0;
+    }
+}
+
+/* ====================== ADTS 帧索引（按时间定位/截取） ======================
+ * 每个 ADTS 帧包含 number_of_raw_data_blocks_in_frame + 1 个 raw data block，每个 block 解码出1024个采样。
+ * 索引里保存每一帧的位置和它第一个采样的序号（前面所有帧的采样数之和），
+ * 建立一次以后，时长、按时间定位、按时间截取都只需要二分查找，不需要重新扫描文件。
+ */
+
+#define ADTS_SAMPLES_PER_BLOCK  1024
+
+static const int ADTSSampleRates[13] = {
+    96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350
+};
+
+typedef struct {
+    unsigned long long offset;      //! 帧头在文件中的位置
+    unsigned long long sample;      //! 帧的第一个采样的序号
+    int size;                       //! 帧长度（包括帧头）
+} ADTS_INDEX_ENTRY;
+
+typedef struct {
+    ADTS_INDEX_ENTRY *frames;
+    size_t count;
+    size_t capacity;
+    unsigned long long total_samples;
+    int sample_rate;                //! 第一帧的采样率
+} ADTS_INDEX;
+
+void FreeADTSIndex(ADTS_INDEX *index) {
+    free(index->frames);
+    memset(index, 0, sizeof(ADTS_INDEX));
+}
+
+/**
+ * Build the frame index of an ADTS stream.
+ * @param fp       Input file, may be a pipe.
+ * @param index    Output index, free it with FreeADTSIndex.
+ * @return 0 on success, -1 on failure.
+ */
+int BuildADTSIndex(FILE *fp, ADTS_INDEX *index) {
+    memset(index, 0, sizeof(ADTS_INDEX));
+    ADTS_RING ring;
+    if (ADTSRingInit(&ring, fp, 0) != 0) {
+        return -1;
+    }
+    ADTS_FRAME_VIEW frame;
+    while (ADTSRingNext(&ring, &frame)) {
+        if (index->count == index->capacity) {
+            size_t capacity = index->capacity ? index->capacity * 2 : 1024;
+            ADTS_INDEX_ENTRY *frames = (ADTS_INDEX_ENTRY *) realloc(index->frames, capacity * sizeof(ADTS_INDEX_ENTRY));
+            if (frames == NULL) {
+                ADTSRingClose(&ring);
+                FreeADTSIndex(index);
+                return -1;
+            }
+            index->frames = frames;
+            index->capacity = capacity;
+        }
+        if (index->count == 0) {
+            index->sample_rate = ADTSSampleRates[(frame.data[2] & 0x3c) >> 2];
+        }
+        ADTS_INDEX_ENTRY *e = &index->frames[index->count++];
+        e->offset = frame.offset;
+        e->sample = index->total_samples;
+        e->size = frame.size;
+        // number_of_raw_data_blocks_in_frame：第7个字节的最后2位
+        index->total_samples += (unsigned long long) ((frame.data[6] & 0x03) + 1) * ADTS_SAMPLES_PER_BLOCK;
+    }
+    ADTSRingClose(&ring);
+    return 0;
+}
+
+/**
+ * @return Duration of the stream in seconds.
+ */
+double ADTSIndexDuration(const ADTS_INDEX *index) {
+    return index->sample_rate > 0 ? (double) index->total_samples / index->sample_rate : 0;
+}
+
+// 二分查找第一个 sample 大于 target 的帧
+static size_t ADTSIndexUpperBound(const ADTS_INDEX *index, unsigned long long target) {
+    size_t lo = 0, hi = index->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (index->frames[mid].sample <= target) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static unsigned long long ADTSTimeToSample(const ADTS_INDEX *index, double t) {
+    return t > 0 ? (unsigned long long) (t * index->sample_rate) : 0;
+}
+
+/**
+ * Find the frame containing time t.
+ * @param skip_samples    Optional, samples to drop from the start of that frame to reach t exactly.
+ * @return Frame number, or -1 if t is beyond the end of the stream.
+ */
+long ADTSIndexSeek(const ADTS_INDEX *index, double t, unsigned *skip_samples) {
+    unsigned long long target = ADTSTimeToSample(index, t);
+    if (index->count == 0 || target >= index->total_samples) {
+        return -1;
+    }
+    size_t n = ADTSIndexUpperBound(index, target) - 1;
+    if (skip_samples) {
+        *skip_samples = (unsigned) (target - index->frames[n].sample);
+    }
+    return (long) n;
+}
+
+/**
+ * Find the frames covering [t0, t1).
+ * @param first    Output first frame.
+ * @param last     Output frame after the last one.
+ * @return 0 on success, -1 if the range is empty.
+ */
+int ADTSIndexRange(const ADTS_INDEX *index, double t0, double t1, size_t *first, size_t *last) {
+    long n = ADTSIndexSeek(index, t0, NULL);
+    if (n < 0 || t1 <= t0) {
+        return -1;
+    }
+    // 最后一帧是包含 t1 前一个采样的帧
+    unsigned long long end = ADTSTimeToSample(index, t1);
+    *first = (size_t) n;
+    *last = end > index->frames[n].sample ? ADTSIndexUpperBound(index, end - 1) : (size_t) n + 1;
+    return 0;
+}
+
+/**
+ * Copy the frames covering [t0, t1) to another file. Runs of adjacent frames are copied in one go,
+ * garbage between frames is left out.
+ * @return 0 on success, -1 on failure.
+ */
+int ADTSExtractRange(FILE *in, const ADTS_INDEX *index, double t0, double t1, FILE *out) {
+    size_t first, last;
+    if (ADTSIndexRange(index, t0, t1, &first, &last) != 0) {
+        return -1;
+    }
+    unsigned char buf[64 * 1024];
+    size_t i = first;
+    while (i < last) {
+        unsigned long long begin = index->frames[i].offset;
+        unsigned long long end = begin + index->frames[i].size;
+        for (i++; i < last && index->frames[i].offset == end; i++) {
+            end += index->frames[i].size;
+        }
+        if (AAC_FSEEK(in, begin, SEEK_SET) != 0) {
+            return -1;
+        }
+        while (begin < end) {
+            size_t n = end - begin > sizeof(buf) ? sizeof(buf) : (size_t) (end - begin);
+            if (fread(buf, 1, n, in) != n || fwrite(buf, 1, n, out) != n) {
+                return -1;
+            }
+            begin += n;
+        }
+    }
+    return 0;
+}
 
+/**
+ * Print the duration of an AAC file and the frame at time t.
+ * @param url    Location of input AAC file.
+ * @param t      Time in seconds.
+ */
+int simplest_aac_seek(char *url, double t) {
     FILE *ifile = fopen(url, "rb");
-    if(!ifile){
-        printf("Open file error");
+    if (!ifile) {
+        printf("Open file error\n");
+        return -1;
+    }
+    ADTS_INDEX index;
+    if (BuildADTSIndex(ifile, &index) != 0) {
+        printf("Build index error\n");
+        fclose(ifile);
         return -1;
     }
+    fclose(ifile);
 
-    printf("-----+- ADTS Frame Table -+------+\n");
-    printf(" NUM | Profile | Frequency| Size |\n");
-    printf("-----+---------+----------+------+\n");
+    printf("frames: %lu, samples: %llu, sample rate: %d, duration: %.3f s\n",
+           (unsigned long) index.count, index.total_samples, index.sample_rate, ADTSIndexDuration(&index));
+    unsigned skip = 0;
+    long n = ADTSIndexSeek(&index, t, &skip);
+    if (n < 0) {
+        printf("%.3f s is beyond the end of the stream\n", t);
+    } else {
+        printf("%.3f s -> frame %ld at offset %llu (sample %llu, skip %u samples)\n",
+               t, n, index.frames[n].offset, index.frames[n].sample, skip);
+    }
+    FreeADTSIndex(&index);
+    return 0;
+}
 
-    while(!feof(ifile)){
-        // 返回读取的数据的大小， 此处为整个文件的大小 480002 byte
-        data_size = fread(aacbuffer+offset, 1, 1024*1024-offset, ifile);
-        unsigned char* input_data = aacbuffer;
+/**
+ * Cut [t0, t1) out of an AAC file.
+ * @param url    Location of input AAC file.
+ * @param out    Location of output AAC file.
+ */
+int simplest_aac_extract(char *url, double t0, double t1, const char *out) {
+    FILE *ifile = fopen(url, "rb");
+    if (!ifile) {
+        printf("Open file error\n");
+        return -1;
+    }
+    ADTS_INDEX index;
+    if (BuildADTSIndex(ifile, &index) != 0) {
+        printf("Build index error\n");
+        fclose(ifile);
+        return -1;
+    }
+    FILE *ofile = fopen(out, "wb");
+    int ret = -1;
+    size_t first = 0, last = 0;
+    if (!ofile) {
+        printf("Open output file error\n");
+    } else if (ADTSIndexRange(&index, t0, t1, &first, &last) != 0) {
+        printf("Empty range\n");
+    } else if (ADTSExtractRange(ifile, &index, t0, t1, ofile) != 0) {
+        printf("Write output file error\n");
+    } else {
+        printf("frames %lu-%lu (%.3f s - %.3f s) -> %s\n", (unsigned long) first, (unsigned long) last - 1,
+               (double) index.frames[first].sample / index.sample_rate,
+               (double) (last < index.count ? index.frames[last].sample : index.total_samples) / index.sample_rate, out);
+        ret = 0;
+    }
+    if (ofile) {
+        fclose(ofile);
+    }
+    fclose(ifile);
+    FreeADTSIndex(&index);
+    return ret;
+}
+
+/* ====================== ADTS CRC 校验 ======================
+ * protection_absent 为0时帧头里带有 CRC-16（生成多项式 0x8005，初值 0xFFFF，高位在前）。
+ * 一帧包含多个 raw_data_block 时，帧头后面是 raw_data_block_position 和 adts_header_error_check，
+ * 它的校验范围只有帧头和 raw_data_block_position，这里校验的就是这一个 CRC。
+ * 只有一个 raw_data_block 时，crc_check 除了帧头还覆盖每个 SCE/CPE/LFE/CCE 元素 id_syn_ele 之后的前192比特，
+ * 以及 CPE 中第二个 ICS 的前128比特（元素不够长时补0）。找到这些范围要完整解析 ICS（包括 Huffman 解码的频谱数据），
+ * 这个程序只解析帧头，所以这种帧不做校验，帧列表里显示 n/a。
+ * CRC 使用 slice-by-8 查表，每次处理8个字节。需要校验的数据最多十几个字节，
+ * 所以没有使用 PCLMUL 折叠（折叠至少要64字节的数据才划算）。
+ */
+
+static unsigned short adts_crc_table[8][256];
 
-        while(1)
+static int InitADTSCrcTable() {
+    for (int v = 0; v < 256; v++) {
+        unsigned short crc = (unsigned short) (v << 8);
+        for (int k = 0; k < 8; k++) {
+            crc = (unsigned short) ((crc & 0x8000) ? (crc << 1) ^ 0x8005 : crc << 1);
+        }
+        adts_crc_table[0][v] = crc;
+    }
+    // adts_crc_table[k][v]：字节 v 后面再跟 k 个0字节的 CRC
+    for (int k = 1; k < 8; k++) {
+        for (int v = 0; v < 256; v++) {
+            unsigned short prev = adts_crc_table[k - 1][v];
+            adts_crc_table[k][v] = (unsigned short) ((prev << 8) ^ adts_crc_table[0][prev >> 8]);
+        }
+    }
+    return 1;
+}
+
+/**
+ * CRC-16 (polynomial 0x8005, MSB first, no final xor) with slice-by-8 table lookup.
+ * @param crc    Initial value, 0xFFFF for ADTS.
+ */
+unsigned short Crc16Update(unsigned short crc, const unsigned char *p, size_t len) {
+    static int inited = InitADTSCrcTable();
+    (void) inited;
+    const unsigned short (*t)[256] = adts_crc_table;
+    while (len >= 8) {
+        crc = t[7][p[0] ^ (crc >> 8)] ^ t[6][p[1] ^ (crc & 0xff)] ^ t[5][p[2]] ^ t[4][p[3]] ^
+              t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = (unsigned short) ((crc << 8) ^ t[0][(crc >> 8) ^ *p++]);
+    }
+    return crc;
+}
+
+#define ADTS_CRC_UNCHECKED  -2      // 只有一个 raw_data_block，CRC 覆盖的元素数据没有解析，不校验
+#define ADTS_CRC_ABSENT     -1      // protection_absent 为1，帧里没有 CRC
+#define ADTS_CRC_BAD        0
+#define ADTS_CRC_OK         1
+
+/**
+ * Verify the adts_header_error_check of an ADTS frame with several raw_data_blocks.
+ * Frames with a single raw_data_block are not checked, their CRC also covers the element data.
+ * @param frame    Whole frame, including the header.
+ * @param size     Frame size.
+ * @return ADTS_CRC_OK, ADTS_CRC_BAD, ADTS_CRC_ABSENT or ADTS_CRC_UNCHECKED.
+ */
+int VerifyADTSCrc(const unsigned char *frame, int size) {
+    if (frame[1] & 0x01) {
+        return ADTS_CRC_ABSENT;
+    }
+    int blocks = (frame[6] & 0x03) + 1;
+    if (blocks == 1) {
+        return ADTS_CRC_UNCHECKED;
+    }
+    // 帧头 + raw_data_block_position[1..blocks-1]
+    int header = 7 + 2 * (blocks - 1);
+    if (size < header + 2) {
+        return ADTS_CRC_BAD;
+    }
+    unsigned short crc = Crc16Update(0xffff, frame, header);
+    unsigned short stored = (unsigned short) ((frame[header] << 8) | frame[header + 1]);
+    return crc == stored ? ADTS_CRC_OK : ADTS_CRC_BAD;
+}
+
+// 命令行 -crc 打开；打开以后帧列表多一列 CRC，最后输出校验统计
+static int adts_verify_crc = 0;
+static int adts_crc_checked = 0;
+static int adts_crc_corrupted = 0;
+static int adts_crc_unchecked = 0;
+
+static void PrintADTSTableHeader(FILE *myout) {
+    adts_crc_checked = 0;
+    adts_crc_corrupted = 0;
+    adts_crc_unchecked = 0;
+    if (adts_verify_crc) {
+        fprintf(myout, "-----+- ADTS Frame Table -+------+-----+\n");
+        fprintf(myout, " NUM | Profile | Frequency| Size | CRC |\n");
+        fprintf(myout, "-----+---------+----------+------+-----+\n");
+    } else {
+        fprintf(myout, "-----+- ADTS Frame Table -+------+\n");
+        fprintf(myout, " NUM | Profile | Frequency| Size |\n");
+        fprintf(myout, "-----+---------+----------+------+\n");
+    }
+}
+
+static void PrintADTSTableFooter(FILE *myout) {
+    if (adts_verify_crc) {
+        fprintf(myout, "CRC: %d frames checked, %d corrupted, %d not checked (single raw_data_block)\n",
+                adts_crc_checked, adts_crc_corrupted, adts_crc_unchecked);
+    }
+}
+
+/**
+ * Print one row of the ADTS frame table.
+ * @param aacframe    Frame data, only the header is read unless CRC verification is on.
+ * @param size        Frame size.
+ * @param skipped     Bytes of garbage skipped before the frame.
+ */
+static void PrintADTSFrameRow(FILE *myout, int cnt, const unsigned char *aacframe, int size, unsigned long long skipped)
+{
+    //  用于存储音频配置文件（Profile）的信息。
+    //  在AAC编码中，Profile描述了音频的编码复杂性。例如，Main、LC（Low Complexity）和 SSR（Scalable Sample Rate）等。
+    char profile_str[10]={0};
+    //  用于存储采样频率（Sampling Frequency）的信息。采样频率是指每秒钟对声音信号进行采样的次数。
+    char frequence_str[10]={0};
+
+    //  取出 profile  , 第二个字节的头两位，共2位
+    unsigned char profile=aacframe[2]&0xC0;
+    //  右移 6位  ，取出对应2位的的实际数值
+    profile=profile>>6;
+    switch(profile){
+        case 0: sprintf(profile_str,"Main");break;
+        case 1: sprintf(profile_str,"LC");break;
+        case 2: sprintf(profile_str,"SSR");break;
+        default:sprintf(profile_str,"unknown");break;
+    }
+    // 取出 sampling_frequency_index , 第二个字节的 3-6位置  共4位
+    unsigned char sampling_frequency_index=aacframe[2]&0x3C;
+    // 右移 2位 ， 取出对应4位的实际数值
+    sampling_frequency_index=sampling_frequency_index>>2;
+    switch(sampling_frequency_index){
+        case 0: sprintf(frequence_str,"96000Hz");break;
+        case 1: sprintf(frequence_str,"88200Hz");break;
+        case 2: sprintf(frequence_str,"64000Hz");break;
+        case 3: sprintf(frequence_str,"48000Hz");break;
+        case 4: sprintf(frequence_str,"44100Hz");break;
+        case 5: sprintf(frequence_str,"32000Hz");break;
+        case 6: sprintf(frequence_str,"24000Hz");break;
+        case 7: sprintf(frequence_str,"22050Hz");break;
+        case 8: sprintf(frequence_str,"16000Hz");break;
+        case 9: sprintf(frequence_str,"12000Hz");break;
+        case 10: sprintf(frequence_str,"11025Hz");break;
+        case 11: sprintf(frequence_str,"8000Hz");break;
+        default:sprintf(frequence_str,"unknown");break;
+    }
+
+
+    if(skipped>0){
+        fprintf(myout,"  (resync: skipped %llu bytes)\n",skipped);
+    }
+    if(adts_verify_crc){
+        int crc = VerifyADTSCrc(aacframe, size);
+        if(crc == ADTS_CRC_UNCHECKED){
+            adts_crc_unchecked++;
+        }else if(crc != ADTS_CRC_ABSENT){
+            adts_crc_checked++;
+            adts_crc_corrupted += crc == ADTS_CRC_BAD;
+        }
+        fprintf(myout,"%5d| %8s|  %8s| %5d| %4s|\n",cnt,profile_str ,frequence_str,size,
+                crc == ADTS_CRC_OK ? "ok" : (crc == ADTS_CRC_BAD ? "BAD" : (crc == ADTS_CRC_UNCHECKED ? "n/a" : "-")));
+        return;
+    }
+    fprintf(myout,"%5d| %8s|  %8s| %5d|\n",cnt,profile_str ,frequence_str,size);
+}
+
+/* ====================== 多线程解析 ======================
+ * 把文件分成若干段，每个线程从段的开头重新同步（带向后检查），然后解析本段内开始的所有帧。
+ * 合并时按顺序检查：串行解析走到的位置恰好是下一段里的某一帧时，后面的结果必然相同，直接拼接；
+ * 否则（段的开头附近有伪同步字或者损坏的数据）由主线程按串行规则继续解析，直到与该段对齐。
+ * 这样输出与串行的 simplest_aac_parser 逐字节相同。每轮处理 线程数 x ADTS_PARALLEL_CHUNK 字节，内存占用有上限。
+ */
+
+#ifndef ADTS_PARALLEL_CHUNK
+#define ADTS_PARALLEL_CHUNK     (16 << 20)
+#endif
+
+typedef struct {
+    unsigned char *data;          //! 文件数据（映射的内存，或者读入的内存）
+    size_t size;
+    int mapped;                   //! 1：data 由 mmap 得到；0：data 由 malloc 得到
+} AAC_MAP;
+
+/**
+ * Map the whole AAC file into memory (read it when mmap is not available).
+ * @return 0 on success, -1 on failure.
+ */
+int MapAACFile(const char *url, AAC_MAP *map) {
+    memset(map, 0, sizeof(AAC_MAP));
+#ifndef _WIN32
+    int fd = open(url, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    map->size = (size_t) st.st_size;
+    if (map->size == 0) {
+        close(fd);
+        return 0;
+    }
+    void *addr = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr != MAP_FAILED) {
+        map->data = (unsigned char *) addr;
+        map->mapped = 1;
+        return 0;
+    }
+#endif
+    FILE *fp = fopen(url, "rb");
+    if (fp == NULL) {
+        return -1;
+    }
+    AAC_FSEEK(fp, 0, SEEK_END);
+    map->size = (size_t) ftell(fp);
+    AAC_FSEEK(fp, 0, SEEK_SET);
+    map->data = (unsigned char *) malloc(map->size > 0 ? map->size : 1);
+    if (map->data == NULL || fread(map->data, 1, map->size, fp) != map->size) {
+        free(map->data);
+        map->data = NULL;
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    return 0;
+}
+
+void UnmapAACFile(AAC_MAP *map) {
+    if (map->data != NULL) {
+#ifndef _WIN32
+        if (map->mapped) {
+            munmap(map->data, map->size);
+        } else
+#endif
         {
-            int ret=getADTSframe(input_data, data_size, aacframe, &size);
-            if(ret==-1){
-                break;
-            }else if(ret==1){
-                memcpy(aacbuffer,input_data,data_size);
-                offset=data_size;
-                break;
+            free(map->data);
+        }
+    }
+    memset(map, 0, sizeof(AAC_MAP));
+}
+
+/**
+ * Find the next frame with the same rules as ADTSRingNext, the whole stream is in memory.
+ * @param pos        In: where to continue. Out: end of the frame.
+ * @param in_sync    In/out: the previous frame ended at pos.
+ * @return 1 if a frame was found, 0 at the end of the stream.
+ */
+static int ADTSWalkNext(const unsigned char *data, size_t size, size_t *pos, int *in_sync,
+                        size_t *frame_offset, int *frame_size) {
+    size_t offset = 0;
+    if (*pos >= size || FindADTSFrame(data + *pos, size - *pos, *in_sync, 1, &offset, frame_size) != 0) {
+        *pos = size;
+        return 0;
+    }
+    *frame_offset = *pos + offset;
+    *pos = *frame_offset + *frame_size;
+    *in_sync = 1;
+    return 1;
+}
+
+typedef struct {
+    size_t offset;
+    int size;
+} ADTS_FRAME_POS;
+
+typedef struct {
+    size_t begin;                 //! 本段范围 [begin, end)
+    size_t end;
+    ADTS_FRAME_POS *frames;       //! 本段内开始的帧
+    size_t count;
+    size_t capacity;
+    size_t next_pos;              //! 解析完本段以后的状态
+    int next_in_sync;
+    int error;
+} ADTS_CHUNK;
+
+static void ScanADTSChunk(const unsigned char *data, size_t size, ADTS_CHUNK *chunk) {
+    // 文件开头与串行解析的初始状态相同，其它段从段首重新同步
+    size_t pos = chunk->begin;
+    int in_sync = chunk->begin == 0;
+    chunk->count = 0;
+    while (1) {
+        size_t save_pos = pos;
+        int save_in_sync = in_sync;
+        size_t frame_offset = 0;
+        int frame_size = 0;
+        if (!ADTSWalkNext(data, size, &pos, &in_sync, &frame_offset, &frame_size)) {
+            break;
+        }
+        if (frame_offset >= chunk->end) {
+            // 这一帧属于后面的段
+            pos = save_pos;
+            in_sync = save_in_sync;
+            break;
+        }
+        if (chunk->count == chunk->capacity) {
+            size_t capacity = chunk->capacity ? chunk->capacity * 2 : 4096;
+            ADTS_FRAME_POS *frames = (ADTS_FRAME_POS *) realloc(chunk->frames, capacity * sizeof(ADTS_FRAME_POS));
+            if (frames == NULL) {
+                chunk->error = 1;
+                return;
             }
+            chunk->frames = frames;
+            chunk->capacity = capacity;
+        }
+        chunk->frames[chunk->count].offset = frame_offset;
+        chunk->frames[chunk->count].size = frame_size;
+        chunk->count++;
+    }
+    chunk->next_pos = pos;
+    chunk->next_in_sync = in_sync;
+}
+
+// 合并时的串行状态
+typedef struct {
+    size_t pos;
+    int in_sync;
+    size_t prev_end;              //! 上一帧的结束位置，用来计算跳过的字节数
+    int cnt;
+    int done;                     //! 已经到达码流末尾
+} ADTS_MERGE_STATE;
+
+static void EmitADTSFrame(FILE *myout, const unsigned char *data, ADTS_MERGE_STATE *st, size_t offset, int size) {
+    PrintADTSFrameRow(myout, st->cnt, data + offset, size, (unsigned long long) (offset - st->prev_end));
+    st->prev_end = offset + size;
+    st->cnt++;
+}
 
-            //  用于存储音频配置文件（Profile）的信息。
-            //  在AAC编码中，Profile描述了音频的编码复杂性。例如，Main、LC（Low Complexity）和 SSR（Scalable Sample Rate）等。
-            char profile_str[10]={0};
-            //  用于存储采样频率（Sampling Frequency）的信息。采样频率是指每秒钟对声音信号进行采样的次数。
-            char frequence_str[10]={0};
-
-            //  取出 profile  , 第二个字节的头两位，共2位
-            unsigned char profile=aacframe[2]&0xC0;
-            //  右移 6位  ，取出对应2位的的实际数值
-            profile=profile>>6;
-            switch(profile){
-                case 0: sprintf(profile_str,"Main");break;
-                case 1: sprintf(profile_str,"LC");break;
-                case 2: sprintf(profile_str,"SSR");break;
-                default:sprintf(profile_str,"unknown");break;
+static void MergeADTSChunk(FILE *myout, const unsigned char *data, size_t size, const ADTS_CHUNK *chunk,
+                           ADTS_MERGE_STATE *st) {
+    size_t j = 0;
+    while (!st->done) {
+        // 串行解析的状态与本段第 j 帧对齐（或者与本段的初始状态相同）：后面的结果相同，直接拼接
+        if (j < chunk->count && ((st->in_sync && st->pos == chunk->frames[j].offset) ||
+                                 (j == 0 && st->pos == chunk->begin && st->in_sync == (chunk->begin == 0)))) {
+            for (; j < chunk->count; j++) {
+                EmitADTSFrame(myout, data, st, chunk->frames[j].offset, chunk->frames[j].size);
             }
-            // 取出 sampling_frequency_index , 第二个字节的 3-6位置  共4位
-            unsigned char sampling_frequency_index=aacframe[2]&0x3C;
-            // 右移 2位 ， 取出对应4位的实际数值
-            sampling_frequency_index=sampling_frequency_index>>2;
-            switch(sampling_frequency_index){
-                case 0: sprintf(frequence_str,"96000Hz");break;
-                case 1: sprintf(frequence_str,"88200Hz");break;
-                case 2: sprintf(frequence_str,"64000Hz");break;
-                case 3: sprintf(frequence_str,"48000Hz");break;
-                case 4: sprintf(frequence_str,"44100Hz");break;
-                case 5: sprintf(frequence_str,"32000Hz");break;
-                case 6: sprintf(frequence_str,"24000Hz");break;
-                case 7: sprintf(frequence_str,"22050Hz");break;
-                case 8: sprintf(frequence_str,"16000Hz");break;
-                case 9: sprintf(frequence_str,"12000Hz");break;
-                case 10: sprintf(frequence_str,"11025Hz");break;
-                case 11: sprintf(frequence_str,"8000Hz");break;
-                default:sprintf(frequence_str,"unknown");break;
+            st->pos = chunk->next_pos;
+            st->in_sync = chunk->next_in_sync;
+            return;
+        }
+        // 还没有对齐：按串行规则解析一帧
+        size_t save_pos = st->pos;
+        int save_in_sync = st->in_sync;
+        size_t frame_offset = 0;
+        int frame_size = 0;
+        if (!ADTSWalkNext(data, size, &st->pos, &st->in_sync, &frame_offset, &frame_size)) {
+            st->done = 1;
+            return;
+        }
+        if (frame_offset >= chunk->end) {
+            st->pos = save_pos;
+            st->in_sync = save_in_sync;
+            return;
+        }
+        EmitADTSFrame(myout, data, st, frame_offset, frame_size);
+        while (j < chunk->count && chunk->frames[j].offset < st->pos) {
+            j++;
+        }
+    }
+}
+
+/**
+ * Analysis AAC ADTS bitstream with multiple threads, the output is the same as simplest_aac_parser.
+ * @param url         Location of input AAC file.
+ * @param nthreads    Number of threads, 0 means one per CPU core.
+ */
+int simplest_aac_parser_parallel(char *url, int nthreads)
+{
+    FILE *myout=stdout;
+
+    AAC_MAP map;
+    if(MapAACFile(url, &map) != 0){
+        printf("Open file error");
+        return -1;
+    }
+    if(nthreads <= 0){
+        nthreads = (int) std::thread::hardware_concurrency();
+        if(nthreads <= 0){
+            nthreads = 1;
+        }
+    }
+    // 小文件也按线程数分段，但每段不超过 ADTS_PARALLEL_CHUNK
+    size_t chunk_size = map.size / nthreads + 1;
+    if(chunk_size > ADTS_PARALLEL_CHUNK){
+        chunk_size = ADTS_PARALLEL_CHUNK;
+    }
+    ADTS_CHUNK *chunks = (ADTS_CHUNK *) calloc(nthreads, sizeof(ADTS_CHUNK));
+    std::thread *threads = new std::thread[nthreads];
+    if(chunks == NULL){
+        printf("Alloc chunk error");
+        delete[] threads;
+        UnmapAACFile(&map);
+        return -1;
+    }
+
+    PrintADTSTableHeader(myout);
+
+    ADTS_MERGE_STATE st;
+    memset(&st, 0, sizeof(st));
+    st.in_sync = 1;
+    int ret = 0;
+    for(size_t round = 0; round < map.size && !st.done && ret == 0; round += chunk_size * nthreads){
+        int n = 0;
+        for(; n < nthreads && round + chunk_size * n < map.size; n++){
+            chunks[n].begin = round + chunk_size * n;
+            chunks[n].end = chunks[n].begin + chunk_size < map.size ? chunks[n].begin + chunk_size : map.size;
+            threads[n] = std::thread(ScanADTSChunk, map.data, map.size, &chunks[n]);
+        }
+        for(int i = 0; i < n; i++){
+            threads[i].join();
+            if(chunks[i].error){
+                ret = -1;
             }
+        }
+        for(int i = 0; i < n && ret == 0; i++){
+            MergeADTSChunk(myout, map.data, map.size, &chunks[i], &st);
+        }
+    }
+    if(ret != 0){
+        printf("Alloc frame list error");
+    } else {
+        PrintADTSTableFooter(myout);
+    }
+
+    for(int i = 0; i < nthreads; i++){
+        free(chunks[i].frames);
+    }
+    free(chunks);
+    delete[] threads;
+    UnmapAACFile(&map);
+    return ret;
+}
+
+/* ====================== ADTS -> 裸 AAC（FLV / 长度前缀） ======================
+ * FLV、MP4 里的 AAC 不带 ADTS 帧头：解码参数放在 AudioSpecificConfig 中，只出现一次，
+ * 之后每个 access unit 就是去掉7/9字节帧头的 raw_data_block。
+ *
+ *   AudioSpecificConfig (2 bytes)
+ *     audioObjectType(5) = profile + 1 | samplingFrequencyIndex(4) | channelConfiguration(4) | 0(3)
+ *
+ * 输出两种格式：
+ *   ADTS_REMUX_FLV ：纯音频 FLV。第一个 tag 是 AACPacketType 0（AudioSpecificConfig），后面每帧一个 AACPacketType 1
+ *   ADTS_REMUX_RAW ：每个 access unit 前面是4字节大端长度，AudioSpecificConfig 写到单独的文件
+ * 输入文件映射到内存，帧数据不做任何拷贝；每帧的 tag 头/长度放在 writer 里固定大小的前缀缓冲区中，
+ * 和帧数据一起通过 writev 批量写出，整个过程没有逐帧的内存分配。
+ */
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
 
+#define ADTS_IOV_BATCH          (IOV_MAX < 1024 ? IOV_MAX : 1024)
+#define ADTS_IOV_PREFIX_MAX     32      // 前缀最长：PreviousTagSize(4) + FLV tag 头(11) + AudioTagHeader(2)
 
-            fprintf(myout,"%5d| %8s|  %8s| %5d|\n",cnt,profile_str ,frequence_str,size);
-            data_size -= size;
-            input_data += size;
-            cnt++;
+#define ADTS_REMUX_RAW          0
+#define ADTS_REMUX_FLV          1
+
+typedef struct {
+    int fd;
+    struct iovec iov[ADTS_IOV_BATCH];
+    int count;
+    unsigned char prefix[ADTS_IOV_BATCH][ADTS_IOV_PREFIX_MAX];
+    int prefix_count;
+    int error;
+    unsigned long long bytes;     //! 已经写出的字节数
+} ADTS_IOV_WRITER;
+
+static void AdtsIovWriterInit(ADTS_IOV_WRITER *w, int fd) {
+    w->fd = fd;
+    w->count = 0;
+    w->prefix_count = 0;
+    w->error = 0;
+    w->bytes = 0;
+}
+
+static int AdtsIovWriterFlush(ADTS_IOV_WRITER *w) {
+    struct iovec *iov = w->iov;
+    int count = w->count;
+    while (count > 0 && !w->error) {
+        long n = writev(w->fd, iov, count);
+        if (n < 0) {
+            w->error = 1;
+            break;
+        }
+        w->bytes += n;
+        // 只写出了一部分：跳过已经写完的段，继续写剩下的
+        while (count > 0 && (size_t) n >= iov->iov_len) {
+            n -= (long) iov->iov_len;
+            iov++;
+            count--;
         }
+        if (count > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    w->count = 0;
+    w->prefix_count = 0;
+    return w->error ? -1 : 0;
+}
 
+static void AdtsIovWriterAdd(ADTS_IOV_WRITER *w, const void *data, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    if (w->count == ADTS_IOV_BATCH) {
+        AdtsIovWriterFlush(w);
+    }
+    w->iov[w->count].iov_base = (void *) data;
+    w->iov[w->count].iov_len = len;
+    w->count++;
+}
+
+// 返回一块前缀缓冲区，内容由调用者填写；保证它和后面紧跟的一段数据在同一批中写出
+static unsigned char *AdtsIovWriterPrefix(ADTS_IOV_WRITER *w, size_t len) {
+    if (w->count >= ADTS_IOV_BATCH - 1 || w->prefix_count == ADTS_IOV_BATCH) {
+        AdtsIovWriterFlush(w);
+    }
+    unsigned char *p = w->prefix[w->prefix_count++];
+    w->iov[w->count].iov_base = p;
+    w->iov[w->count].iov_len = len;
+    w->count++;
+    return p;
+}
+
+static void PutBE24(unsigned char *p, unsigned v) {
+    p[0] = (unsigned char) (v >> 16);
+    p[1] = (unsigned char) (v >> 8);
+    p[2] = (unsigned char) v;
+}
+
+static void PutBE32(unsigned char *p, unsigned v) {
+    p[0] = (unsigned char) (v >> 24);
+    PutBE24(p + 1, v);
+}
+
+/**
+ * Derive the AudioSpecificConfig from an ADTS header.
+ * @param asc    Output, 2 bytes.
+ */
+void BuildAudioSpecificConfig(const unsigned char *adts, unsigned char asc[2]) {
+    int object_type = ((adts[2] & 0xc0) >> 6) + 1;
+    int sf_index = (adts[2] & 0x3c) >> 2;
+    int channels = ((adts[2] & 0x01) << 2) | ((adts[3] & 0xc0) >> 6);
+    asc[0] = (unsigned char) ((object_type << 3) | (sf_index >> 1));
+    asc[1] = (unsigned char) (((sf_index & 0x01) << 7) | (channels << 3));
+}
+
+// 写 FLV tag 的前缀：上一个 tag 的 PreviousTagSize + tag 头 + AudioTagHeader
+static size_t PutFlvAudioTagPrefix(unsigned char *p, unsigned prev_tag_size, unsigned data_size,
+                                   unsigned timestamp, int aac_packet_type) {
+    PutBE32(p, prev_tag_size);
+    p[4] = 8;                                   // TagType：音频
+    PutBE24(p + 5, data_size);
+    PutBE24(p + 8, timestamp & 0xffffff);
+    p[11] = (unsigned char) (timestamp >> 24);  // TimestampExtended
+    PutBE24(p + 12, 0);                         // StreamID
+    // SoundFormat 10 (AAC) | SoundRate 3 | SoundSize 1 | SoundType 1：AAC 固定为 0xAF，实际参数看 AudioSpecificConfig
+    p[15] = 0xaf;
+    p[16] = (unsigned char) aac_packet_type;
+    return 17;
+}
+
+/**
+ * Strip the ADTS headers and write raw AAC access units.
+ * @param url        Input AAC file.
+ * @param out_url    Output file.
+ * @param format     ADTS_REMUX_FLV: audio-only FLV; ADTS_REMUX_RAW: 4-byte big-endian length before every access unit.
+ * @param asc_url    Optional, output AudioSpecificConfig (2 bytes).
+ * @return 0 on success, -1 on failure.
+ */
+int ADTSToRawAAC(const char *url, const char *out_url, int format, const char *asc_url) {
+    AAC_MAP map;
+    if (MapAACFile(url, &map) != 0) {
+        printf("Open file error\n");
+        return -1;
+    }
+    int fd = open(out_url, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0) {
+        printf("Open output file error\n");
+        UnmapAACFile(&map);
+        return -1;
+    }
+
+    static ADTS_IOV_WRITER writer;
+    AdtsIovWriterInit(&writer, fd);
+
+    static const unsigned char flv_header[9] = {'F', 'L', 'V', 1, 0x04, 0, 0, 0, 9};
+    unsigned char asc[2] = {0};
+    unsigned prev_tag_size = 0;
+    unsigned long long samples = 0;
+    int sample_rate = 0;
+    int frames = 0;
+    int ret = 0;
+    size_t pos = 0;
+    int in_sync = 1;
+    size_t offset = 0;
+    int size = 0;
+    while (ret == 0 && ADTSWalkNext(map.data, map.size, &pos, &in_sync, &offset, &size)) {
+        const unsigned char *frame = map.data + offset;
+        int blocks = (frame[6] & 0x03) + 1;
+        if (blocks > 1) {
+            // 多个 raw_data_block 时需要 raw_data_block_position 才能拆开，这里不支持
+            printf("Frame %d has %d raw data blocks, not supported\n", frames, blocks);
+            ret = -1;
+            break;
+        }
+        int header = (frame[1] & 0x01) ? 7 : 9;
+        unsigned raw_size = (unsigned) (size - header);
+        if (frames == 0) {
+            // 第一帧确定 AudioSpecificConfig
+            BuildAudioSpecificConfig(frame, asc);
+            sample_rate = ADTSSampleRates[(frame[2] & 0x3c) >> 2];
+            if (format == ADTS_REMUX_FLV) {
+                AdtsIovWriterAdd(&writer, flv_header, sizeof(flv_header));
+                unsigned char *p = AdtsIovWriterPrefix(&writer, 17 + 2);
+                PutFlvAudioTagPrefix(p, 0, 2 + 2, 0, 0);
+                memcpy(p + 17, asc, 2);
+                prev_tag_size = 11 + 2 + 2;
+            }
+        }
+        if (format == ADTS_REMUX_FLV) {
+            unsigned timestamp = (unsigned) (samples * 1000 / sample_rate);
+            PutFlvAudioTagPrefix(AdtsIovWriterPrefix(&writer, 17), prev_tag_size, raw_size + 2, timestamp, 1);
+            prev_tag_size = 11 + 2 + raw_size;
+        } else {
+            PutBE32(AdtsIovWriterPrefix(&writer, 4), raw_size);
+        }
+        AdtsIovWriterAdd(&writer, frame + header, raw_size);
+        samples += ADTS_SAMPLES_PER_BLOCK;
+        frames++;
+    }
+    if (ret == 0 && format == ADTS_REMUX_FLV && frames > 0) {
+        // 最后一个 tag 的 PreviousTagSize
+        PutBE32(AdtsIovWriterPrefix(&writer, 4), prev_tag_size);
+    }
+    if (AdtsIovWriterFlush(&writer) != 0) {
+        printf("Write output file error\n");
+        ret = -1;
+    }
+    close(fd);
+
+    if (ret == 0 && frames == 0) {
+        printf("No ADTS frame found\n");
+        ret = -1;
+    }
+    if (ret == 0 && asc_url != NULL) {
+        FILE *fp = fopen(asc_url, "wb");
+        int ok = fp != NULL && fwrite(asc, 1, 2, fp) == 2;
+        if (fp == NULL || fclose(fp) != 0 || !ok) {
+            printf("Write AudioSpecificConfig error\n");
+            ret = -1;
+        }
+    }
+    if (ret == 0) {
+        printf("%d frames, AudioSpecificConfig %02x %02x, %llu bytes -> %s\n", frames, asc[0], asc[1],
+               writer.bytes, out_url);
+    }
+    UnmapAACFile(&map);
+    return ret;
+}
+
+/**
+ * Analysis AAC ADTS bitstream.
+ * @param url    Location of input AAC file, "-" means stdin.
+ */
+int simplest_aac_parser(char *url)
+{
+    int cnt=0;
+
+    //FILE *myout=fopen("output_log.txt","wb+");
+    FILE *myout=stdout;
+
+    // 帧直接在环形缓冲区里解析，只读帧头，不再把每一帧复制出来；内存占用固定为 ADTS_RING_SIZE 左右
+    FILE *ifile = strcmp(url, "-") == 0 ? stdin : fopen(url, "rb");
+    if(!ifile){
+        printf("Open file error");
+        return -1;
+    }
+    ADTS_RING ring;
+    if(ADTSRingInit(&ring, ifile, 0) != 0){
+        printf("Alloc ring buffer error");
+        if(ifile != stdin) fclose(ifile);
+        return -1;
+    }
+
+    PrintADTSTableHeader(myout);
+
+    ADTS_FRAME_VIEW frame;
+    while(ADTSRingNext(&ring, &frame)){
+        PrintADTSFrameRow(myout, cnt, frame.data, frame.size, frame.skipped);
+        cnt++;
+    }
+    PrintADTSTableFooter(myout);
+    ADTSRingClose(&ring);
+    if(ifile != stdin){
+        fclose(ifile);
     }
-    fclose(ifile);
-    free(aacbuffer);
-    free(aacframe);
 
     return 0;
 }
@@ -177,5 +1397,32 @@ int simplest_aac_parser(char *url)
 
 
 int main(int argc, char *argv[]){
-    simplest_aac_parser("nocturne.aac");
+    // 用法：aac [-crc] [file.aac | -]，默认解析 nocturne.aac
+    //       aac [-crc] -threads N [file.aac]
+    //       aac -seek SECONDS [file.aac]
+    //       aac -extract T0 T1 [file.aac] [out.aac]
+    //       aac -toflv in.aac out.flv
+    //       aac -toraw in.aac out.raw out.asc
+    if (argc > 1 && strcmp(argv[1], "-crc") == 0) {
+        adts_verify_crc = 1;
+        argc--;
+        argv++;
+    }
+    if (argc > 2 && strcmp(argv[1], "-threads") == 0) {
+        return simplest_aac_parser_parallel(argc > 3 ? argv[3] : (char *) "nocturne.aac", atoi(argv[2])) == 0 ? 0 : 1;
+    }
+    if (argc > 3 && strcmp(argv[1], "-toflv") == 0) {
+        return ADTSToRawAAC(argv[2], argv[3], ADTS_REMUX_FLV, NULL) == 0 ? 0 : 1;
+    }
+    if (argc > 4 && strcmp(argv[1], "-toraw") == 0) {
+        return ADTSToRawAAC(argv[2], argv[3], ADTS_REMUX_RAW, argv[4]) == 0 ? 0 : 1;
+    }
+    if (argc > 2 && strcmp(argv[1], "-seek") == 0) {
+        return simplest_aac_seek(argc > 3 ? argv[3] : (char *) "nocturne.aac", atof(argv[2])) == 0 ? 0 : 1;
+    }
+    if (argc > 3 && strcmp(argv[1], "-extract") == 0) {
+        return simplest_aac_extract(argc > 4 ? argv[4] : (char *) "nocturne.aac", atof(argv[2]), atof(argv[3]),
+                                    argc > 5 ? argv[5] : "output.aac") == 0 ? 0 : 1;
+    }
+    simplest_aac_parser(argc > 1 ? argv[1] : (char *) "nocturne.aac");
 }
\ No newline at end of file
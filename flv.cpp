@@ -28,6 +28,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 //Important!
 #pragma pack(1)
@@ -55,6 +68,94 @@ typedef struct {
 } TAG_HEADER;
 
 
+#define FLV_IO_BUFFER_SIZE  (1 << 20)   // 输入文件的 stdio 缓冲区大小
+
+#ifdef _WIN32
+#define FLV_FSEEK   _fseeki64
+#define FLV_FTELL   _ftelli64
+#else
+#define FLV_FSEEK   fseeko
+#define FLV_FTELL   ftello
+#endif
+
+/**
+ * Copy len bytes starting at offset of in_fd to out_fd, without going through stdio.
+ * @param out_offset    Where to write in out_fd (advanced by the bytes written),
+ *                      NULL means the current file position of out_fd.
+ * @return 0 on success, -1 on failure.
+ */
+static int CopyFileRange(int in_fd, long long offset, int out_fd, long long *out_offset, long long len) {
+#ifdef __linux__
+    // 优先使用 copy_file_range（同一个文件系统上内核可以直接共享数据块），不支持时退回到 sendfile
+    loff_t in_off = offset;
+    loff_t out_off = out_offset ? *out_offset : 0;
+    int use_sendfile = 0;
+    while (len > 0) {
+        ssize_t n;
+        size_t chunk = len > (1LL << 30) ? (size_t) (1LL << 30) : (size_t) len;
+        if (!use_sendfile) {
+            n = copy_file_range(in_fd, &in_off, out_fd, out_offset ? &out_off : NULL, chunk, 0);
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+                use_sendfile = 1;
+                continue;
+            }
+        } else if (out_offset == NULL) {
+            off_t off = (off_t) in_off;
+            n = sendfile(out_fd, in_fd, &off, chunk);
+            in_off = off;
+        } else {
+            // sendfile 不能指定输出位置，交给下面的通用版本
+            break;
+        }
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        len -= n;
+    }
+    offset = in_off;
+    if (out_offset) {
+        *out_offset = out_off;
+    }
+    if (len == 0) {
+        return 0;
+    }
+#endif
+    // 通用版本：经过用户空间的缓冲区，一次读写 64KB
+    static unsigned char buf[1 << 16];
+    while (len > 0) {
+        size_t chunk = len > (long long) sizeof(buf) ? sizeof(buf) : (size_t) len;
+#ifndef _WIN32
+        ssize_t n = pread(in_fd, buf, chunk, (off_t) offset);
+        if (n <= 0) {
+            return -1;
+        }
+        ssize_t w = out_offset ? pwrite(out_fd, buf, n, (off_t) *out_offset) : write(out_fd, buf, n);
+#else
+        _lseeki64(in_fd, offset, SEEK_SET);
+        long n = _read(in_fd, buf, (unsigned) chunk);
+        if (n <= 0) {
+            return -1;
+        }
+        if (out_offset) {
+            _lseeki64(out_fd, *out_offset, SEEK_SET);
+        }
+        long w = _write(out_fd, buf, (unsigned) n);
+#endif
+        if (w != n) {
+            return -1;
+        }
+        offset += n;
+        if (out_offset) {
+            *out_offset += n;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
 //reverse_bytes - turn a BigEndian byte array into a LittleEndian integer
 // 大端序转小端序  ,FLV文件数据通常是以大端序存储的，而我们的电脑一般是小端序存储
 uint reverse_bytes(byte *p, char c) {
@@ -65,6 +166,90 @@ uint reverse_bytes(byte *p, char c) {
     return r;
 }
 
+// 音频 Tag Data 的第一个字节：音频格式、采样率、采样精度、声道类型
+static void FormatFlvAudioInfo(char tagdata_first_byte, char *audiotag_str) {
+    strcat(audiotag_str,"| ");
+    int x=tagdata_first_byte&0xF0;      // 前四位保留， 后四位归零
+    x=x>>4;
+    switch (x)  // 前四位：音频格式
+    {
+        case 0:strcat(audiotag_str,"Linear PCM, platform endian");break;
+        case 1:strcat(audiotag_str,"ADPCM");break;
+        case 2:strcat(audiotag_str,"MP3");break;
+        case 3:strcat(audiotag_str,"Linear PCM, little endian");break;
+        case 4:strcat(audiotag_str,"Nellymoser 16-kHz mono");break;
+        case 5:strcat(audiotag_str,"Nellymoser 8-kHz mono");break;
+        case 6:strcat(audiotag_str,"Nellymoser");break;
+        case 7:strcat(audiotag_str,"G.711 A-law logarithmic PCM");break;
+        case 8:strcat(audiotag_str,"G.711 mu-law logarithmic PCM");break;
+        case 9:strcat(audiotag_str,"reserved");break;
+        case 10:strcat(audiotag_str,"AAC");break;
+        case 11:strcat(audiotag_str,"Speex");break;
+        case 14:strcat(audiotag_str,"MP3 8-Khz");break;
+        case 15:strcat(audiotag_str,"Device-specific sound");break;
+        default:strcat(audiotag_str,"UNKNOWN");break;
+    }
+    strcat(audiotag_str,"| ");
+    x=tagdata_first_byte&0x0C;
+    x=x>>2;
+    switch (x)      // 接下来两位 ：采样率
+    {
+        case 0:strcat(audiotag_str,"5.5-kHz");break;
+        case 1:strcat(audiotag_str,"1-kHz");break;
+        case 2:strcat(audiotag_str,"22-kHz");break;
+        case 3:strcat(audiotag_str,"44-kHz");break;
+        default:strcat(audiotag_str,"UNKNOWN");break;
+    }
+    strcat(audiotag_str,"| ");
+    x=tagdata_first_byte&0x02;
+    x=x>>1;
+    switch (x)      // 采样精度
+    {
+        case 0:strcat(audiotag_str,"8Bit");break;
+        case 1:strcat(audiotag_str,"16Bit");break;
+        default:strcat(audiotag_str,"UNKNOWN");break;
+    }
+    strcat(audiotag_str,"| ");
+    x=tagdata_first_byte&0x01;
+    switch (x)      // 声道类型
+    {
+        case 0:strcat(audiotag_str,"Mono");break;
+        case 1:strcat(audiotag_str,"Stereo");break;
+        default:strcat(audiotag_str,"UNKNOWN");break;
+    }
+}
+
+// 视频 Tag Data 的第一个字节：帧类型、编码类型
+static void FormatFlvVideoInfo(char tagdata_first_byte, char *videotag_str) {
+    strcat(videotag_str,"| ");
+    int x=tagdata_first_byte&0xF0;      // 前四位保留，后四位归零
+    x=x>>4;
+    switch (x)      // 前四个字节：帧类型
+    {
+        case 1:strcat(videotag_str,"key frame  ");break;
+        case 2:strcat(videotag_str,"inter frame");break;
+        case 3:strcat(videotag_str,"disposable inter frame");break;
+        case 4:strcat(videotag_str,"generated keyframe");break;
+        case 5:strcat(videotag_str,"video info/command frame");break;
+        default:strcat(videotag_str,"UNKNOWN");break;
+    }
+    strcat(videotag_str,"| ");
+    x=tagdata_first_byte&0x0F; // 取后四位
+    switch (x)      // 后四个字节 ： 编码类型
+    {
+        case 1:strcat(videotag_str,"JPEG (currently unused)");break;
+        case 2:strcat(videotag_str,"Sorenson H.263");break;
+        case 3:strcat(videotag_str,"Screen video");break;
+        case 4:strcat(videotag_str,"On2 VP6");break;
+        case 5:strcat(videotag_str,"On2 VP6 with alpha channel");break;
+        case 6:strcat(videotag_str,"Screen video version 2");break;
+        case 7:strcat(videotag_str,"AVC");break;
+        default:strcat(videotag_str,"UNKNOWN");break;
+    }
+}
+
+static void FormatFlvScriptInfo(const byte *data, size_t size, char *out, size_t out_size);
+
 /**
  * Analysis FLV file
  * @param url    Location of input FLV file.
@@ -85,12 +270,20 @@ int simplest_flv_parser(char *url){
     TAG_HEADER tagheader;
     uint previoustagsize, previoustagsize_z=0;
     uint ts=0, ts_new=0;
+    long long a_offset=0;       // output.mp3 中下一次写入的位置
+    byte *script_buf=NULL;      // Script Tag 的数据
+    int script_capacity=0;
+    int write_error=0;          // 写输出文件出错以后不再写这一路，最后返回 -1
 
-    ifh = fopen(url, "rb+");
+    ifh = fopen(url, "rb");
     if ( ifh== NULL) {
         printf("Failed to open files!");
         return -1;
     }
+    // Tag Header 通过大块的 stdio 缓冲读入，跳过 Tag Data 时的 fseek 只是在缓冲区里移动；
+    // Tag Data 本身不经过 stdio，直接在文件之间复制
+    setvbuf(ifh, NULL, _IOFBF, FLV_IO_BUFFER_SIZE);
+    int ifd = fileno(ifh);
 
     //FLV file header   直接读取9个字节   ，这就是FLV的Header
     fread((char *)&flv,1,sizeof(FLV_HEADER),ifh);
@@ -115,14 +308,14 @@ int simplest_flv_parser(char *url){
 // ===================================FLV Header 处理完毕=======================================================================
 
     //process each tag
-    do {
-        // Previous Tag Size     getw() 取一个整数（4字节） ，并将指针向前移动过去
-        previoustagsize = getw(ifh);
+    while (1) {
+        // Previous Tag Size    取一个整数（4字节） ，并将指针向前移动过去
         // 第一个Previous Tag Size = 0  , 第二个 Previous Tag Size = 562   ✔
-//        printf("zh___previoustagsize = %d\n", reverse_bytes((byte *)&previoustagsize, sizeof(previoustagsize)));
-
-        // 读取Tag Header，也就是长度 = 11 字节
-        fread((void *)&tagheader,sizeof(TAG_HEADER),1,ifh);
+        // 读取Tag Header，也就是长度 = 11 字节；文件结束（或者最后一个 Tag 不完整）时退出
+        if (fread((void *)&previoustagsize, sizeof(previoustagsize), 1, ifh) != 1 ||
+            fread((void *)&tagheader,sizeof(TAG_HEADER),1,ifh) != 1) {
+            break;
+        }
 
         //int temp_datasize1=reverse_bytes((byte *)&tagheader.DataSize, sizeof(tagheader.DataSize));
         // 这实际上是将一个3字节的大端序整数转换为一个int类型的值 （第一次进来，也就是Script的值是 551 ）
@@ -141,69 +334,19 @@ int simplest_flv_parser(char *url){
 
         fprintf(myout,"[%6s] %6d %6d %6d |",tagtype_str,tagheader_datasize,tagheader_timestamp,reverse_bytes((byte *)&previoustagsize, sizeof(previoustagsize)));
 
-        //if we are not past the end of file, process the tag
-        if (feof(ifh)) {
-            break;
-        }
+        // Tag Data 在文件中的位置
+        long long data_offset = FLV_FTELL(ifh);
 
         //process tag by type
         switch (tagheader.TagType) {
 
             case TAG_TYPE_AUDIO:{
                 char audiotag_str[100]={0};
-                strcat(audiotag_str,"| ");
                 char tagdata_first_byte;
                 tagdata_first_byte=fgetc(ifh);
                 // 看一眼 这个值到底是多少
 //                printf("zh___info = %d\n",tagdata_first_byte);
-                int x=tagdata_first_byte&0xF0;      // 前四位保留， 后四位归零
-                x=x>>4;
-                switch (x)  // 前四位：音频格式
-                {
-                    case 0:strcat(audiotag_str,"Linear PCM, platform endian");break;
-                    case 1:strcat(audiotag_str,"ADPCM");break;
-                    case 2:strcat(audiotag_str,"MP3");break;
-                    case 3:strcat(audiotag_str,"Linear PCM, little endian");break;
-                    case 4:strcat(audiotag_str,"Nellymoser 16-kHz mono");break;
-                    case 5:strcat(audiotag_str,"Nellymoser 8-kHz mono");break;
-                    case 6:strcat(audiotag_str,"Nellymoser");break;
-                    case 7:strcat(audiotag_str,"G.711 A-law logarithmic PCM");break;
-                    case 8:strcat(audiotag_str,"G.711 mu-law logarithmic PCM");break;
-                    case 9:strcat(audiotag_str,"reserved");break;
-                    case 10:strcat(audiotag_str,"AAC");break;
-                    case 11:strcat(audiotag_str,"Speex");break;
-                    case 14:strcat(audiotag_str,"MP3 8-Khz");break;
-                    case 15:strcat(audiotag_str,"Device-specific sound");break;
-                    default:strcat(audiotag_str,"UNKNOWN");break;
-                }
-                strcat(audiotag_str,"| ");
-                x=tagdata_first_byte&0x0C;
-                x=x>>2;
-                switch (x)      // 接下来两位 ：采样率
-                {
-                    case 0:strcat(audiotag_str,"5.5-kHz");break;
-                    case 1:strcat(audiotag_str,"1-kHz");break;
-                    case 2:strcat(audiotag_str,"22-kHz");break;
-                    case 3:strcat(audiotag_str,"44-kHz");break;
-                    default:strcat(audiotag_str,"UNKNOWN");break;
-                }
-                strcat(audiotag_str,"| ");
-                x=tagdata_first_byte&0x02;
-                x=x>>1;
-                switch (x)      // 采样精度
-                {
-                    case 0:strcat(audiotag_str,"8Bit");break;
-                    case 1:strcat(audiotag_str,"16Bit");break;
-                    default:strcat(audiotag_str,"UNKNOWN");break;
-                }
-                strcat(audiotag_str,"| ");
-                x=tagdata_first_byte&0x01;
-                switch (x)      // 声道类型
-                {
-                    case 0:strcat(audiotag_str,"Mono");break;
-                    case 1:strcat(audiotag_str,"Stereo");break;
-                    default:strcat(audiotag_str,"UNKNOWN");break;
-                }
+                FormatFlvAudioInfo(tagdata_first_byte, audiotag_str);
                 fprintf(myout,"%s",audiotag_str);
 
                 //if the output file hasn't been opened, open it.
@@ -212,53 +355,25 @@ int simplest_flv_parser(char *url){
                 }
 
                 //TagData - First Byte Data
-                // MP3 格式，直接将音频数据取出来即可
+                // MP3 格式，直接将音频数据取出来即可：从输入文件的 TagData+1 直接写到 output.mp3 的对应位置
                 int data_size=reverse_bytes((byte *)&tagheader.DataSize, sizeof(tagheader.DataSize))-1;
-                if(output_a!=0){
-                    //TagData+1
-                    for (int i=0; i<data_size; i++)
-                        fputc(fgetc(ifh),afh);
-
-                }else{
-                    for (int i=0; i<data_size; i++)
-                        fgetc(ifh);
+                if(output_a!=0 && afh != NULL && data_size > 0 &&
+                   CopyFileRange(ifd, data_offset + 1, fileno(afh), &a_offset, data_size) != 0){
+                    printf("Write output file error\n");
+                    output_a=0;
+                    write_error=1;
                 }
+                FLV_FSEEK(ifh, data_offset + tagheader_datasize, SEEK_SET);
                 break;
             }
             case TAG_TYPE_VIDEO:{
                 char videotag_str[100]={0};
-                strcat(videotag_str,"| ");
                 char tagdata_first_byte;
                 tagdata_first_byte=fgetc(ifh);      // Tag Data 区域的 第一个字节包含了一些参数信息
-                int x=tagdata_first_byte&0xF0;      // 前四位保留，后四位归零
-                x=x>>4;
-                switch (x)      // 前四个字节：帧类型
-                {
-                    case 1:strcat(videotag_str,"key frame  ");break;
-                    case 2:strcat(videotag_str,"inter frame");break;
-                    case 3:strcat(videotag_str,"disposable inter frame");break;
-                    case 4:strcat(videotag_str,"generated keyframe");break;
-                    case 5:strcat(videotag_str,"video info/command frame");break;
-                    default:strcat(videotag_str,"UNKNOWN");break;
-                }
-                strcat(videotag_str,"| ");
-                x=tagdata_first_byte&0x0F; // 取后四位
-                switch (x)      // 后四个字节 ： 编码类型
-                {
-                    case 1:strcat(videotag_str,"JPEG (currently unused)");break;
-                    case 2:strcat(videotag_str,"Sorenson H.263");break;
-                    case 3:strcat(videotag_str,"Screen video");break;
-                    case 4:strcat(videotag_str,"On2 VP6");break;
-                    case 5:strcat(videotag_str,"On2 VP6 with alpha channel");break;
-                    case 6:strcat(videotag_str,"Screen video version 2");break;
-                    case 7:strcat(videotag_str,"AVC");break;
-                    default:strcat(videotag_str,"UNKNOWN");break;
-                }
+                FormatFlvVideoInfo(tagdata_first_byte, videotag_str);
                 // 拼接输出
                 fprintf(myout,"%s",videotag_str);
 
-                // 回到  Tag Data 的开始位置
-                fseek(ifh, -1, SEEK_CUR);
                 //if the output file hasn't been opened, open it.
                 if (vfh == NULL&&output_v!=0) {
                     //write the flv header (reuse the original file's hdr) and first previoustagsize
@@ -290,33 +405,2654 @@ int simplest_flv_parser(char *url){
                     // 此时 ifh 文件指针 在Previous Tag Size位置，
                     // 为保证下一次能够正常解析，需在下一次解析到来前 ，将文件指针回退到Previous Tag Size开始的位置，
                     // 保证程序正常的运行
-                    for (int i=0; i<data_size; i++)
-                        fputc(fgetc(ifh),vfh);
-                }else{
-                    for (int i=0; i<data_size; i++)
-                        fgetc(ifh);
+                    // 先把 stdio 缓冲区里的 FLV Header / Tag Header 写出去，再由内核直接复制 TagData
+                    if(fflush(vfh) != 0 || CopyFileRange(ifd, data_offset, fileno(vfh), NULL, data_size) != 0){
+                        printf("Write output file error\n");
+                        output_v=0;
+                        write_error=1;
+                    }
                 }
-                //rewind 4 bytes, because we need to read the previoustagsize again for the loop's sake
-                fseek(ifh, -4, SEEK_CUR);
+                // 下一次循环从 Previous Tag Size 开始读
+                FLV_FSEEK(ifh, data_offset + tagheader_datasize, SEEK_SET);
 
                 break;
             }
+            case TAG_TYPE_SCRIPT:{
+                // Script Data 区域：读入以后按需解析 onMetaData 中的几个字段
+                char scripttag_str[100]={0};
+                if (tagheader_datasize > script_capacity) {
+                    free(script_buf);
+                    script_capacity = tagheader_datasize;
+                    script_buf = (byte *) malloc(script_capacity);
+                }
+                if (script_buf != NULL && fread(script_buf, 1, tagheader_datasize, ifh) == (size_t) tagheader_datasize) {
+                    FormatFlvScriptInfo(script_buf, tagheader_datasize, scripttag_str, sizeof(scripttag_str));
+                }
+                fprintf(myout,"%s",scripttag_str);
+                FLV_FSEEK(ifh, data_offset + tagheader_datasize, SEEK_SET);
+                break;
+            }
             default:
                 //skip the data of this tag
-                // 也就是Script Data 区域， 跳过
-                fseek(ifh, reverse_bytes((byte *)&tagheader.DataSize, sizeof(tagheader.DataSize)), SEEK_CUR);
+                FLV_FSEEK(ifh, data_offset + tagheader_datasize, SEEK_SET);
         }
 
         fprintf(myout,"\n");
 
-    } while (!feof(ifh));
+    }
 
 
+    free(script_buf);
     fcloseall();
 
+    return write_error ? -1 : 0;
+}
+
+/* ====================== 文件映射与 Tag 遍历 ====================== */
+
+typedef struct {
+    byte *data;                 //! 文件数据（映射的内存，或者读入的内存）
+    size_t size;
+    int mapped;                 //! 1：data 由 mmap 得到；0：data 由 malloc 得到
+    FILE *writeback;            //! 可写但没有 mmap 时打开的文件，UnmapFlvFile 时把 data 写回去
+} FLV_MAP;
+
+/**
+ * Map the whole FLV file into memory (read it when mmap is not available).
+ * @param writable    1: changes to data are written back to the file (MAP_SHARED).
+ * @return 0 on success, -1 on failure.
+ */
+int MapFlvFileEx(const char *url, FLV_MAP *map, int writable) {
+    memset(map, 0, sizeof(FLV_MAP));
+#ifndef _WIN32
+    int fd = open(url, writable ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    map->size = (size_t) st.st_size;
+    if (map->size == 0) {
+        close(fd);
+        return 0;
+    }
+    void *addr = writable ? mmap(NULL, map->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                          : mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr != MAP_FAILED) {
+        map->data = (byte *) addr;
+        map->mapped = 1;
+        return 0;
+    }
+#endif
+    FILE *fp = fopen(url, writable ? "r+b" : "rb");
+    if (fp == NULL) {
+        return -1;
+    }
+    FLV_FSEEK(fp, 0, SEEK_END);
+    map->size = (size_t) FLV_FTELL(fp);
+    FLV_FSEEK(fp, 0, SEEK_SET);
+    map->data = (byte *) malloc(map->size > 0 ? map->size : 1);
+    if (map->data == NULL || fread(map->data, 1, map->size, fp) != map->size) {
+        free(map->data);
+        map->data = NULL;
+        fclose(fp);
+        return -1;
+    }
+    if (writable) {
+        map->writeback = fp;
+    } else {
+        fclose(fp);
+    }
     return 0;
 }
 
-int main(int argc, char *argv[]) {
-    simplest_flv_parser("cuc_ieschool.flv");
+int MapFlvFile(const char *url, FLV_MAP *map) {
+    return MapFlvFileEx(url, map, 0);
+}
+
+/**
+ * Unmap the file; a writable mapping that was read into memory is written back here.
+ * @return 0 on success, -1 if writing back failed.
+ */
+int UnmapFlvFile(FLV_MAP *map) {
+    int ret = 0;
+    if (map->writeback != NULL) {
+        FLV_FSEEK(map->writeback, 0, SEEK_SET);
+        if (fwrite(map->data, 1, map->size, map->writeback) != map->size) {
+            ret = -1;
+        }
+        if (fclose(map->writeback) != 0) {
+            ret = -1;
+        }
+    }
+    if (map->data != NULL) {
+#ifndef _WIN32
+        if (map->mapped) {
+            munmap(map->data, map->size);
+        } else
+#endif
+        {
+            free(map->data);
+        }
+    }
+    memset(map, 0, sizeof(FLV_MAP));
+    return ret;
+}
+
+#define FLV_TAG_HEADER_SIZE     11
+
+// 一个 Tag 在文件中的位置；offset 是 Tag Header 的位置（不含前面的 Previous Tag Size）
+typedef struct {
+    size_t offset;
+    int type;
+    unsigned data_size;
+    unsigned timestamp;         //! 已经合并了扩展时间戳（TAG_HEADER::Reserved 的最高字节）
+    const byte *data;           //! Tag Data
+} FLV_TAG_VIEW;
+
+/**
+ * Get the offset of the first tag (after the FLV header and PreviousTagSize0).
+ * @return 0 if the data does not start with a valid FLV header.
+ */
+static size_t FlvFirstTagOffset(const byte *data, size_t size) {
+    if (size < 9 + 4 || memcmp(data, "FLV", 3) != 0) {
+        return 0;
+    }
+    size_t header_size = reverse_bytes((byte *) data + 5, 4);
+    return header_size >= 9 && header_size + 4 <= size ? header_size + 4 : 0;
+}
+
+/**
+ * Read the complete tag at *pos and move *pos to the next tag.
+ * @return 1 on success, 0 at the end of the file (or on a truncated tag).
+ */
+static int FlvNextTag(const byte *data, size_t size, size_t *pos, FLV_TAG_VIEW *tag) {
+    size_t p = *pos;
+    if (p + FLV_TAG_HEADER_SIZE > size) {
+        return 0;
+    }
+    const byte *h = data + p;
+    tag->offset = p;
+    tag->type = h[0] & 0x1f;
+    tag->data_size = reverse_bytes((byte *) h + 1, 3);
+    tag->timestamp = reverse_bytes((byte *) h + 4, 3) | ((unsigned) h[7] << 24);
+    tag->data = h + FLV_TAG_HEADER_SIZE;
+    if (p + FLV_TAG_HEADER_SIZE + tag->data_size > size) {
+        return 0;
+    }
+    *pos = p + FLV_TAG_HEADER_SIZE + tag->data_size + 4;
+    return 1;
+}
+
+// 写 Tag Header 中的时间戳：低24位在 Timestamp，最高8位是 TimestampExtended（TAG_HEADER::Reserved 的第一个字节）
+static void PutFlvTimestamp(byte *h, unsigned timestamp) {
+    h[4] = (byte) (timestamp >> 16);
+    h[5] = (byte) (timestamp >> 8);
+    h[6] = (byte) timestamp;
+    h[7] = (byte) (timestamp >> 24);
+}
+
+
+/* ====================== AMF0 ====================== */
+
+#define AMF0_NUMBER         0x00
+#define AMF0_BOOLEAN        0x01
+#define AMF0_STRING         0x02
+#define AMF0_OBJECT         0x03
+#define AMF0_NULL           0x05
+#define AMF0_UNDEFINED      0x06
+#define AMF0_REFERENCE      0x07
+#define AMF0_ECMA_ARRAY     0x08
+#define AMF0_OBJECT_END     0x09
+#define AMF0_STRICT_ARRAY   0x0a
+#define AMF0_DATE           0x0b
+#define AMF0_LONG_STRING    0x0c
+#define AMF0_UNSUPPORTED    0x0d
+#define AMF0_XML_DOCUMENT   0x0f
+#define AMF0_TYPED_OBJECT   0x10
+
+#define AMF0_MAX_DEPTH      32
+
+static const byte *Amf0SkipValue(const byte *p, const byte *end, int depth);
+
+// 跳过 object/ECMA array 的属性列表，直到 00 00 09
+static const byte *Amf0SkipProperties(const byte *p, const byte *end, int depth) {
+    while (p != NULL && end - p >= 3) {
+        unsigned key_len = (p[0] << 8) | p[1];
+        if (key_len == 0 && p[2] == AMF0_OBJECT_END) {
+            return p + 3;
+        }
+        if ((size_t) (end - p - 2) < key_len) {
+            return NULL;
+        }
+        p = Amf0SkipValue(p + 2 + key_len, end, depth);
+    }
+    return NULL;
+}
+
+/**
+ * Skip one AMF0 value (type marker included).
+ * @return Pointer after the value, NULL if the data is invalid or truncated.
+ */
+static const byte *Amf0SkipValue(const byte *p, const byte *end, int depth) {
+    if (p == NULL || p >= end || depth > AMF0_MAX_DEPTH) {
+        return NULL;
+    }
+    size_t left = end - p - 1;
+    size_t n = 0;
+    switch (*p++) {
+        case AMF0_NUMBER: n = 8; break;
+        case AMF0_BOOLEAN: n = 1; break;
+        case AMF0_STRING:
+            if (left < 2) return NULL;
+            n = 2 + ((p[0] << 8) | p[1]);
+            break;
+        case AMF0_OBJECT:
+            return Amf0SkipProperties(p, end, depth + 1);
+        case AMF0_NULL:
+        case AMF0_UNDEFINED:
+        case AMF0_UNSUPPORTED:
+            n = 0;
+            break;
+        case AMF0_REFERENCE: n = 2; break;
+        case AMF0_ECMA_ARRAY:
+            // 数组长度只是提示，以 00 00 09 为准
+            if (left < 4) return NULL;
+            return Amf0SkipProperties(p + 4, end, depth + 1);
+        case AMF0_STRICT_ARRAY: {
+            if (left < 4) return NULL;
+            unsigned count = reverse_bytes((byte *) p, 4);
+            p += 4;
+            for (unsigned i = 0; i < count && p != NULL; i++) {
+                // 关键帧数组可能有几十万个 number，直接按9字节跳过
+                if (end - p >= 9 && *p == AMF0_NUMBER) {
+                    p += 9;
+                    continue;
+                }
+                p = Amf0SkipValue(p, end, depth + 1);
+            }
+            return p;
+        }
+        case AMF0_DATE: n = 8 + 2; break;
+        case AMF0_LONG_STRING:
+        case AMF0_XML_DOCUMENT:
+            if (left < 4) return NULL;
+            n = 4 + (size_t) reverse_bytes((byte *) p, 4);
+            break;
+        case AMF0_TYPED_OBJECT: {
+            if (left < 2) return NULL;
+            size_t name_len = (p[0] << 8) | p[1];
+            if (left < 2 + name_len) return NULL;
+            return Amf0SkipProperties(p + 2 + name_len, end, depth + 1);
+        }
+        default:
+            return NULL;
+    }
+    return n <= left ? p + n : NULL;
+}
+
+static byte *PutAmf0Key(byte *p, const char *key) {
+    size_t len = strlen(key);
+    p[0] = (byte) (len >> 8);
+    p[1] = (byte) len;
+    memcpy(p + 2, key, len);
+    return p + 2 + len;
+}
+
+static byte *PutAmf0Number(byte *p, double v) {
+    unsigned long long bits;
+    memcpy(&bits, &v, 8);
+    *p++ = AMF0_NUMBER;
+    for (int i = 7; i >= 0; i--) {
+        *p++ = (byte) (bits >> (8 * i));
+    }
+    return p;
+}
+
+// 属性列表的结束标记 00 00 09
+static byte *PutAmf0ObjectEnd(byte *p) {
+    p[0] = 0;
+    p[1] = 0;
+    p[2] = AMF0_OBJECT_END;
+    return p + 3;
+}
+
+static byte *PutBE32(byte *p, unsigned v) {
+    p[0] = (byte) (v >> 24);
+    p[1] = (byte) (v >> 16);
+    p[2] = (byte) (v >> 8);
+    p[3] = (byte) v;
+    return p + 4;
+}
+
+
+/* ====================== AMF0 按需解析（onMetaData） ======================
+ * 脚本 Tag 里的 keyframes 数组可能有好几MB。这里不把 AMF0 解码成树，也不分配内存：
+ * AMF0_VIEW 只是指向文件数据（映射的内存）中某个值的指针，查找属性时只比较键名，
+ * 不需要的值直接跳过，只有真正被读取的字段才会被解码。
+ */
+
+typedef struct {
+    const byte *p;              //! 值的类型标记
+    const byte *end;            //! 数据的结束位置（不一定是这个值的结束位置）
+} AMF0_VIEW;
+
+// 只包含 number 的 strict array，第 i 个元素在 p + 9 * i + 1，可以随机访问
+typedef struct {
+    const byte *p;              //! 第一个元素的类型标记
+    unsigned count;
+} AMF0_NUMBER_ARRAY;
+
+static int Amf0Type(const AMF0_VIEW *v) {
+    return v->p < v->end ? v->p[0] : -1;
+}
+
+static double Amf0DecodeNumber(const byte *p) {
+    unsigned long long bits = 0;
+    for (int i = 0; i < 8; i++) {
+        bits = (bits << 8) | p[i];
+    }
+    double v;
+    memcpy(&v, &bits, 8);
+    return v;
+}
+
+/**
+ * @return 0 on success, -1 if the value is not a number.
+ */
+int Amf0GetNumber(const AMF0_VIEW *v, double *out) {
+    if (Amf0Type(v) != AMF0_NUMBER || v->end - v->p < 9) {
+        return -1;
+    }
+    *out = Amf0DecodeNumber(v->p + 1);
+    return 0;
+}
+
+int Amf0GetBoolean(const AMF0_VIEW *v, int *out) {
+    if (Amf0Type(v) != AMF0_BOOLEAN || v->end - v->p < 2) {
+        return -1;
+    }
+    *out = v->p[1] != 0;
+    return 0;
+}
+
+/**
+ * Get a string value without copying it (not NUL-terminated).
+ * @return 0 on success, -1 if the value is not a string.
+ */
+int Amf0GetString(const AMF0_VIEW *v, const char **str, size_t *len) {
+    size_t n;
+    if (Amf0Type(v) == AMF0_STRING && v->end - v->p >= 3) {
+        n = (v->p[1] << 8) | v->p[2];
+        *str = (const char *) v->p + 3;
+    } else if (Amf0Type(v) == AMF0_LONG_STRING && v->end - v->p >= 5) {
+        n = reverse_bytes((byte *) v->p + 1, 4);
+        *str = (const char *) v->p + 5;
+    } else {
+        return -1;
+    }
+    if ((size_t) (v->end - (const byte *) *str) < n) {
+        return -1;
+    }
+    *len = n;
+    return 0;
+}
+
+/**
+ * Find a property of an object, ECMA array or typed object. Values in front of it are skipped, not decoded.
+ * @return 0 on success, -1 if not found.
+ */
+int Amf0ObjectGet(const AMF0_VIEW *obj, const char *key, AMF0_VIEW *out) {
+    const byte *p = obj->p;
+    const byte *end = obj->end;
+    switch (Amf0Type(obj)) {
+        case AMF0_OBJECT: p += 1; break;
+        case AMF0_ECMA_ARRAY: p += 5; break;
+        case AMF0_TYPED_OBJECT:
+            if (end - p < 3) return -1;
+            p += 3 + ((p[1] << 8) | p[2]);
+            break;
+        default: return -1;
+    }
+    size_t key_len = strlen(key);
+    while (p != NULL && end - p >= 3) {
+        size_t n = (p[0] << 8) | p[1];
+        if (n == 0 && p[2] == AMF0_OBJECT_END) {
+            return -1;
+        }
+        if ((size_t) (end - p - 2) < n) {
+            return -1;
+        }
+        const byte *value = p + 2 + n;
+        if (n == key_len && memcmp(p + 2, key, n) == 0) {
+            out->p = value;
+            out->end = end;
+            return 0;
+        }
+        p = Amf0SkipValue(value, end, 0);
+    }
+    return -1;
+}
+
+/**
+ * View a strict array that only holds numbers, checking the type markers once.
+ * @return 0 on success, -1 if the value is not such an array.
+ */
+int Amf0GetNumberArray(const AMF0_VIEW *v, AMF0_NUMBER_ARRAY *out) {
+    if (Amf0Type(v) != AMF0_STRICT_ARRAY || v->end - v->p < 5) {
+        return -1;
+    }
+    unsigned count = reverse_bytes((byte *) v->p + 1, 4);
+    const byte *p = v->p + 5;
+    if ((size_t) (v->end - p) / 9 < count) {
+        return -1;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        if (p[9 * (size_t) i] != AMF0_NUMBER) {
+            return -1;
+        }
+    }
+    out->p = p;
+    out->count = count;
+    return 0;
+}
+
+static double Amf0NumberArrayAt(const AMF0_NUMBER_ARRAY *a, unsigned i) {
+    return Amf0DecodeNumber(a->p + 9 * (size_t) i + 1);
+}
+
+/**
+ * Open the onMetaData of a script tag.
+ * @param data    Tag Data.
+ * @param meta    Output view of the ECMA array/object holding the metadata.
+ * @return 0 on success, -1 if the tag is not onMetaData.
+ */
+int FlvOpenMetaData(const byte *data, size_t size, AMF0_VIEW *meta) {
+    AMF0_VIEW name = {data, data + size};
+    const char *str;
+    size_t len;
+    if (Amf0GetString(&name, &str, &len) != 0 || len != 10 || memcmp(str, "onMetaData", 10) != 0) {
+        return -1;
+    }
+    meta->p = (const byte *) str + len;
+    meta->end = data + size;
+    int type = Amf0Type(meta);
+    return type == AMF0_ECMA_ARRAY || type == AMF0_OBJECT ? 0 : -1;
+}
+
+/**
+ * Read a numeric onMetaData field such as duration, width, height, framerate, videocodecid or audiocodecid.
+ * @return 0 on success, -1 if missing.
+ */
+int FlvMetaNumber(const AMF0_VIEW *meta, const char *key, double *out) {
+    AMF0_VIEW v;
+    return Amf0ObjectGet(meta, key, &v) == 0 ? Amf0GetNumber(&v, out) : -1;
+}
+
+/**
+ * Get keyframes.times and keyframes.filepositions as random-access views.
+ * @return 0 on success, -1 if there is no usable keyframes index.
+ */
+int FlvMetaKeyframes(const AMF0_VIEW *meta, AMF0_NUMBER_ARRAY *times, AMF0_NUMBER_ARRAY *positions) {
+    AMF0_VIEW keyframes, v;
+    if (Amf0ObjectGet(meta, "keyframes", &keyframes) != 0) {
+        return -1;
+    }
+    if (Amf0ObjectGet(&keyframes, "times", &v) != 0 || Amf0GetNumberArray(&v, times) != 0) {
+        return -1;
+    }
+    if (Amf0ObjectGet(&keyframes, "filepositions", &v) != 0 || Amf0GetNumberArray(&v, positions) != 0) {
+        return -1;
+    }
+    return times->count == positions->count ? 0 : -1;
+}
+
+/**
+ * Describe a script tag for the tag table, only the few fields shown are decoded.
+ */
+static void FormatFlvScriptInfo(const byte *data, size_t size, char *out, size_t out_size) {
+    AMF0_VIEW meta;
+    if (FlvOpenMetaData(data, size, &meta) != 0) {
+        snprintf(out, out_size, "| script data");
+        return;
+    }
+    double duration = 0, width = 0, height = 0, framerate = 0;
+    int n = snprintf(out, out_size, "| onMetaData");
+    if (FlvMetaNumber(&meta, "duration", &duration) == 0 && n < (int) out_size) {
+        n += snprintf(out + n, out_size - n, "| %.3f s", duration);
+    }
+    if (FlvMetaNumber(&meta, "width", &width) == 0 && FlvMetaNumber(&meta, "height", &height) == 0 &&
+        n < (int) out_size) {
+        n += snprintf(out + n, out_size - n, "| %.0fx%.0f", width, height);
+    }
+    if (FlvMetaNumber(&meta, "framerate", &framerate) == 0 && n < (int) out_size) {
+        snprintf(out + n, out_size - n, "| %.2f fps", framerate);
+    }
+}
+
+/**
+ * Print the onMetaData fields of an FLV file, decoded straight from the mapped file.
+ * @param url    Location of input FLV file.
+ */
+int simplest_flv_metadata(char *url) {
+    FLV_MAP map;
+    if (MapFlvFile(url, &map) != 0) {
+        printf("Failed to open files!\n");
+        return -1;
+    }
+    size_t pos = FlvFirstTagOffset(map.data, map.size);
+    FLV_TAG_VIEW tag;
+    AMF0_VIEW meta;
+    int found = 0;
+    while (pos != 0 && FlvNextTag(map.data, map.size, &pos, &tag)) {
+        if (tag.type == TAG_TYPE_SCRIPT && FlvOpenMetaData(tag.data, tag.data_size, &meta) == 0) {
+            found = 1;
+            break;
+        }
+    }
+    if (!found) {
+        printf("No onMetaData\n");
+        UnmapFlvFile(&map);
+        return -1;
+    }
+
+    static const char *number_fields[] = {
+        "duration", "width", "height", "framerate", "videodatarate", "videocodecid",
+        "audiodatarate", "audiosamplerate", "audiocodecid", "filesize"
+    };
+    printf("============== onMetaData ==============\n");
+    for (size_t i = 0; i < sizeof(number_fields) / sizeof(number_fields[0]); i++) {
+        double v;
+        if (FlvMetaNumber(&meta, number_fields[i], &v) == 0) {
+            printf("%-16s %.3f\n", number_fields[i], v);
+        }
+    }
+    AMF0_VIEW v;
+    const char *str;
+    size_t len;
+    if (Amf0ObjectGet(&meta, "encoder", &v) == 0 && Amf0GetString(&v, &str, &len) == 0) {
+        printf("%-16s %.*s\n", "encoder", (int) len, str);
+    }
+    AMF0_NUMBER_ARRAY times, positions;
+    if (FlvMetaKeyframes(&meta, &times, &positions) == 0) {
+        printf("%-16s %u\n", "keyframes", times.count);
+        for (unsigned i = 0; i < times.count; i++) {
+            printf("  %10.3f s  @ %.0f\n", Amf0NumberArrayAt(&times, i), Amf0NumberArrayAt(&positions, i));
+        }
+    }
+    printf("========================================\n");
+    UnmapFlvFile(&map);
+    return 0;
+}
+
+/* ====================== 关键帧索引（onMetaData keyframes） ======================
+ * 播放器按时间 seek 时，需要 onMetaData 里的
+ *     keyframes { times: [秒, ...], filepositions: [关键帧 Tag 在文件中的位置, ...] }
+ * 没有这个索引时只能从头线性扫描。这里扫描视频 Tag 的帧类型（高4位为1即关键帧，AVC 序列头除外），
+ * 重写第一个 Tag 的 onMetaData（没有时插入一个新的），其余属性原样保留。
+ * AMF0 的 number 固定为8字节，所以新 onMetaData 的大小与索引的数值无关：先算出大小，
+ * 所有关键帧位置加上脚本 Tag 变化的字节数即可。后面的 Tag 不变，一次 copy_file_range 复制过去。
+ */
+
+typedef struct {
+    double *times;
+    unsigned long long *positions;
+    size_t count;
+    size_t capacity;
+} FLV_KEYFRAME_INDEX;
+
+static void FreeFlvKeyframeIndex(FLV_KEYFRAME_INDEX *index) {
+    free(index->times);
+    free(index->positions);
+    memset(index, 0, sizeof(FLV_KEYFRAME_INDEX));
+}
+
+static int FlvKeyframeIndexAppend(FLV_KEYFRAME_INDEX *index, double time, unsigned long long position) {
+    if (index->count == index->capacity) {
+        size_t capacity = index->capacity ? index->capacity * 2 : 256;
+        double *times = (double *) realloc(index->times, capacity * sizeof(double));
+        if (times == NULL) {
+            return -1;
+        }
+        index->times = times;
+        unsigned long long *positions = (unsigned long long *) realloc(index->positions, capacity * sizeof(unsigned long long));
+        if (positions == NULL) {
+            return -1;
+        }
+        index->positions = positions;
+        index->capacity = capacity;
+    }
+    index->times[index->count] = time;
+    index->positions[index->count] = position;
+    index->count++;
+    return 0;
+}
+
+/**
+ * Collect the key frames of all video tags.
+ * @return 0 on success, -1 on failure.
+ */
+static int BuildFlvKeyframeIndex(const byte *data, size_t size, FLV_KEYFRAME_INDEX *index) {
+    memset(index, 0, sizeof(FLV_KEYFRAME_INDEX));
+    size_t pos = FlvFirstTagOffset(data, size);
+    FLV_TAG_VIEW tag;
+    while (pos != 0 && FlvNextTag(data, size, &pos, &tag)) {
+        if (tag.type != TAG_TYPE_VIDEO || tag.data_size < 1 || (tag.data[0] >> 4) != 1) {
+            continue;
+        }
+        // AVC 的序列头（AVCPacketType 0）和序列结束（AVCPacketType 2）不是可以 seek 到的帧
+        if ((tag.data[0] & 0x0f) == 7 && (tag.data_size < 2 || tag.data[1] != 1)) {
+            continue;
+        }
+        if (FlvKeyframeIndexAppend(index, tag.timestamp / 1000.0, tag.offset) != 0) {
+            FreeFlvKeyframeIndex(index);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// 判断 tag 是不是 onMetaData，是的话返回 ECMA array/object 的属性列表位置
+static const byte *FlvMetaDataProperties(const FLV_TAG_VIEW *tag, int *is_ecma) {
+    const byte *p = tag->data;
+    const byte *end = p + tag->data_size;
+    if (tag->type != TAG_TYPE_SCRIPT || tag->data_size < 13 || p[0] != AMF0_STRING ||
+        ((p[1] << 8) | p[2]) != 10 || memcmp(p + 3, "onMetaData", 10) != 0) {
+        return NULL;
+    }
+    p += 13;
+    if (p < end && *p == AMF0_ECMA_ARRAY && end - p >= 5) {
+        *is_ecma = 1;
+        return p + 5;
+    }
+    if (p < end && *p == AMF0_OBJECT) {
+        *is_ecma = 0;
+        return p + 1;
+    }
+    return NULL;
+}
+
+/**
+ * Write a copy of the FLV file whose onMetaData contains a keyframes index.
+ * @param url        Input FLV file.
+ * @param out_url    Output FLV file.
+ * @return 0 on success, -1 on failure.
+ */
+int FlvInjectKeyframes(const char *url, const char *out_url) {
+    FLV_MAP map;
+    if (MapFlvFile(url, &map) != 0) {
+        printf("Failed to open files!\n");
+        return -1;
+    }
+    size_t first = FlvFirstTagOffset(map.data, map.size);
+    if (first == 0) {
+        printf("Not a FLV file\n");
+        UnmapFlvFile(&map);
+        return -1;
+    }
+    FLV_KEYFRAME_INDEX index;
+    if (BuildFlvKeyframeIndex(map.data, map.size, &index) != 0) {
+        printf("Build keyframe index error\n");
+        UnmapFlvFile(&map);
+        return -1;
+    }
+
+    // 原来的 onMetaData（必须是第一个 Tag）：保留除 keyframes、filesize 以外的属性
+    size_t pos = first;
+    FLV_TAG_VIEW tag;
+    const byte *props = NULL;
+    const byte *props_end = NULL;
+    int is_ecma = 1;
+    size_t old_size = 0;                // 被替换的 Tag 连同后面的 Previous Tag Size 的大小
+    if (FlvNextTag(map.data, map.size, &pos, &tag) && (props = FlvMetaDataProperties(&tag, &is_ecma)) != NULL) {
+        props_end = Amf0SkipProperties(props, tag.data + tag.data_size, 0);
+        if (props_end == NULL) {
+            props = NULL;
+        } else {
+            props_end -= 3;             // 不含 00 00 09
+            old_size = pos - first;
+        }
+    }
+    size_t copied_size = 0;
+    unsigned copied_count = 0;
+    for (const byte *p = props; p != NULL && p < props_end;) {
+        unsigned key_len = (p[0] << 8) | p[1];
+        const byte *next = Amf0SkipValue(p + 2 + key_len, props_end, 0);
+        int drop = (key_len == 9 && memcmp(p + 2, "keyframes", 9) == 0) ||
+                   (key_len == 8 && memcmp(p + 2, "filesize", 8) == 0);
+        if (!drop) {
+            copied_size += next - p;
+            copied_count++;
+        }
+        p = next;
+    }
+
+    // 新的 Tag Data：onMetaData + ECMA array(原有属性, filesize, keyframes{times, filepositions})
+    size_t array_size = 4 + (size_t) index.count * 9;
+    size_t data_size = 13 + 5 + copied_size + (2 + 8 + 9) + (2 + 9 + 1) + (2 + 5 + 1 + array_size) +
+                       (2 + 13 + 1 + array_size) + 3 + 3;
+    // DataSize 只有24位，关键帧太多时 onMetaData 放不下
+    if (data_size > 0xFFFFFF) {
+        printf("Too many keyframes (%lu), onMetaData would be %lu bytes\n", (unsigned long) index.count,
+               (unsigned long) data_size);
+        FreeFlvKeyframeIndex(&index);
+        UnmapFlvFile(&map);
+        return -1;
+    }
+    size_t new_size = FLV_TAG_HEADER_SIZE + data_size + 4;
+    long long delta = (long long) new_size - (long long) old_size;
+    byte *tagbuf = (byte *) malloc(new_size);
+    if (tagbuf == NULL) {
+        printf("Alloc onMetaData error\n");
+        FreeFlvKeyframeIndex(&index);
+        UnmapFlvFile(&map);
+        return -1;
+    }
+    byte *p = tagbuf;
+    *p++ = TAG_TYPE_SCRIPT;
+    *p++ = (byte) (data_size >> 16);
+    *p++ = (byte) (data_size >> 8);
+    *p++ = (byte) data_size;
+    memset(p, 0, 7);                    // Timestamp、TimestampExtended、StreamID
+    p += 7;
+    *p++ = AMF0_STRING;
+    p = PutAmf0Key(p, "onMetaData");
+    *p++ = AMF0_ECMA_ARRAY;
+    p = PutBE32(p, copied_count + 2);
+    for (const byte *q = props; q != NULL && q < props_end;) {
+        unsigned key_len = (q[0] << 8) | q[1];
+        const byte *next = Amf0SkipValue(q + 2 + key_len, props_end, 0);
+        int drop = (key_len == 9 && memcmp(q + 2, "keyframes", 9) == 0) ||
+                   (key_len == 8 && memcmp(q + 2, "filesize", 8) == 0);
+        if (!drop) {
+            memcpy(p, q, next - q);
+            p += next - q;
+        }
+        q = next;
+    }
+    p = PutAmf0Key(p, "filesize");
+    p = PutAmf0Number(p, (double) ((long long) map.size + delta));
+    p = PutAmf0Key(p, "keyframes");
+    *p++ = AMF0_OBJECT;
+    p = PutAmf0Key(p, "times");
+    *p++ = AMF0_STRICT_ARRAY;
+    p = PutBE32(p, (unsigned) index.count);
+    for (size_t i = 0; i < index.count; i++) {
+        p = PutAmf0Number(p, index.times[i]);
+    }
+    p = PutAmf0Key(p, "filepositions");
+    *p++ = AMF0_STRICT_ARRAY;
+    p = PutBE32(p, (unsigned) index.count);
+    for (size_t i = 0; i < index.count; i++) {
+        // 关键帧都在被替换的脚本 Tag 之后，位置统一平移
+        p = PutAmf0Number(p, (double) ((long long) index.positions[i] + delta));
+    }
+    p = PutAmf0ObjectEnd(p);            // keyframes
+    p = PutAmf0ObjectEnd(p);            // onMetaData
+    p = PutBE32(p, (unsigned) (FLV_TAG_HEADER_SIZE + data_size));
+
+    int ret = -1;
+    FILE *ofh = fopen(out_url, "wb");
+    if (ofh == NULL) {
+        printf("Failed to open files!\n");
+    } else {
+        // FLV Header + PreviousTagSize0，新的 onMetaData，之后的 Tag 原样复制
+        size_t rest = first + old_size;
+        if (fwrite(map.data, 1, first, ofh) == first && fwrite(tagbuf, 1, new_size, ofh) == new_size &&
+            fflush(ofh) == 0) {
+            int in_fd = open(url, O_RDONLY);
+            if (in_fd >= 0) {
+                ret = CopyFileRange(in_fd, (long long) rest, fileno(ofh), NULL, (long long) (map.size - rest));
+                close(in_fd);
+            }
+        }
+        if (fclose(ofh) != 0) {
+            ret = -1;
+        }
+        if (ret != 0) {
+            printf("Write output file error\n");
+        } else {
+            printf("%lu keyframes, onMetaData %lu -> %lu bytes, output %lld bytes\n", (unsigned long) index.count,
+                   (unsigned long) old_size, (unsigned long) new_size, (long long) map.size + delta);
+        }
+    }
+    free(tagbuf);
+    FreeFlvKeyframeIndex(&index);
+    UnmapFlvFile(&map);
+    return ret;
+}
+
+/* ====================== 分离 H.264/AAC 基本流 ======================
+ * FLV 中的 AVC/AAC 与基本流格式不同：
+ *   视频：AVCPacketType 0 为 AVCDecoderConfigurationRecord（SPS/PPS），1 为长度前缀的 NALU（前面还有3字节 CompositionTime）
+ *         -> 输出 Annex B：每个 NALU 前加 00 00 00 01，关键帧前插入 SPS/PPS（帧里已经带有 SPS 时不再插入）
+ *   音频：AACPacketType 0 为 AudioSpecificConfig，1 为不带帧头的 raw AAC
+ *         -> 输出 ADTS：每帧前加7字节的 ADTS 帧头；MP3 等其它格式直接输出 Tag Data
+ * 输入文件映射到内存，输出经过 FLV_WRITER 的大缓冲区合并成大块写入。
+ */
+
+#define FLV_WRITER_BUFFER_SIZE  (1 << 20)
+#define FLV_WRITER_ALIGN        4096
+#define FLV_MAX_PARAM_SETS      32
+
+typedef struct {
+    FILE *fp;
+    byte *buf;                  //! 按页对齐的缓冲区
+    size_t len;
+    int error;
+    unsigned long long bytes;   //! 写出的总字节数
+} FLV_WRITER;
+
+static byte *FlvAlignedAlloc(size_t size) {
+#ifdef _WIN32
+    return (byte *) _aligned_malloc(size, FLV_WRITER_ALIGN);
+#else
+    void *p = NULL;
+    return posix_memalign(&p, FLV_WRITER_ALIGN, size) == 0 ? (byte *) p : NULL;
+#endif
+}
+
+static void FlvAlignedFree(byte *p) {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+static int FlvWriterOpen(FLV_WRITER *w, const char *url) {
+    memset(w, 0, sizeof(FLV_WRITER));
+    w->fp = fopen(url, "wb");
+    w->buf = FlvAlignedAlloc(FLV_WRITER_BUFFER_SIZE);
+    if (w->fp == NULL || w->buf == NULL) {
+        if (w->fp) fclose(w->fp);
+        FlvAlignedFree(w->buf);
+        memset(w, 0, sizeof(FLV_WRITER));
+        return -1;
+    }
+    // 数据已经在 FLV_WRITER 里合并过了，不需要 stdio 再复制一次
+    setvbuf(w->fp, NULL, _IONBF, 0);
+    return 0;
+}
+
+static void FlvWriterFlush(FLV_WRITER *w) {
+    if (w->len > 0 && fwrite(w->buf, 1, w->len, w->fp) != w->len) {
+        w->error = 1;
+    }
+    w->len = 0;
+}
+
+// 除了最后一次以外，每次都写出整个缓冲区，文件中的写入位置总是 FLV_WRITER_BUFFER_SIZE 的整数倍
+static void FlvWriterPut(FLV_WRITER *w, const void *data, size_t len) {
+    const byte *p = (const byte *) data;
+    w->bytes += len;
+    while (len > 0) {
+        if (w->len == 0 && len >= FLV_WRITER_BUFFER_SIZE) {
+            // 缓冲区是空的：整块的数据直接写出
+            size_t n = len - len % FLV_WRITER_BUFFER_SIZE;
+            if (fwrite(p, 1, n, w->fp) != n) {
+                w->error = 1;
+            }
+            p += n;
+            len -= n;
+            continue;
+        }
+        size_t n = FLV_WRITER_BUFFER_SIZE - w->len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(w->buf + w->len, p, n);
+        w->len += n;
+        p += n;
+        len -= n;
+        if (w->len == FLV_WRITER_BUFFER_SIZE) {
+            FlvWriterFlush(w);
+        }
+    }
+}
+
+/**
+ * Flush and close the writer.
+ * @return 0 on success, -1 if any write failed.
+ */
+static int FlvWriterClose(FLV_WRITER *w) {
+    if (w->fp == NULL) {
+        return 0;
+    }
+    FlvWriterFlush(w);
+    int ret = (fclose(w->fp) == 0 && !w->error) ? 0 : -1;
+    FlvAlignedFree(w->buf);
+    memset(w, 0, sizeof(FLV_WRITER));
+    return ret;
+}
+
+// AVCDecoderConfigurationRecord 中的参数集，指向映射的文件数据
+typedef struct {
+    int length_size;            //! NALU 长度字段的字节数
+    int sps_count;
+    int pps_count;
+    const byte *sps[FLV_MAX_PARAM_SETS];
+    unsigned sps_len[FLV_MAX_PARAM_SETS];
+    const byte *pps[FLV_MAX_PARAM_SETS];
+    unsigned pps_len[FLV_MAX_PARAM_SETS];
+} FLV_AVC_CONFIG;
+
+/**
+ * Parse an AVCDecoderConfigurationRecord.
+ * @return 0 on success, -1 on failure.
+ */
+int ParseFlvAvcConfig(const byte *p, size_t size, FLV_AVC_CONFIG *cfg) {
+    memset(cfg, 0, sizeof(FLV_AVC_CONFIG));
+    if (size < 7 || p[0] != 1) {
+        return -1;
+    }
+    cfg->length_size = (p[4] & 0x03) + 1;
+    size_t n = 5;
+    for (int pass = 0; pass < 2; pass++) {
+        if (n >= size) {
+            return -1;
+        }
+        int count = pass == 0 ? (p[n] & 0x1f) : p[n];
+        n++;
+        for (int i = 0; i < count; i++) {
+            if (n + 2 > size) {
+                return -1;
+            }
+            unsigned len = (p[n] << 8) | p[n + 1];
+            n += 2;
+            if (n + len > size) {
+                return -1;
+            }
+            if (pass == 0 && cfg->sps_count < FLV_MAX_PARAM_SETS) {
+                cfg->sps[cfg->sps_count] = p + n;
+                cfg->sps_len[cfg->sps_count++] = len;
+            } else if (pass == 1 && cfg->pps_count < FLV_MAX_PARAM_SETS) {
+                cfg->pps[cfg->pps_count] = p + n;
+                cfg->pps_len[cfg->pps_count++] = len;
+            }
+            n += len;
+        }
+    }
+    return 0;
+}
+
+// AudioSpecificConfig 中生成 ADTS 帧头需要的字段
+typedef struct {
+    int object_type;
+    int sf_index;
+    int channels;
+} FLV_AAC_CONFIG;
+
+/**
+ * Parse the first bytes of an AudioSpecificConfig.
+ * @return 0 on success, -1 if it cannot be expressed as an ADTS header.
+ */
+int ParseFlvAacConfig(const byte *p, size_t size, FLV_AAC_CONFIG *cfg) {
+    if (size < 2) {
+        return -1;
+    }
+    cfg->object_type = p[0] >> 3;
+    cfg->sf_index = ((p[0] & 0x07) << 1) | (p[1] >> 7);
+    cfg->channels = (p[1] >> 3) & 0x0f;
+    // ADTS 只有2比特的 profile（object type 1~4），也不能表示显式给出的采样率
+    if (cfg->object_type < 1 || cfg->object_type > 4 || cfg->sf_index > 12) {
+        return -1;
+    }
+    return 0;
+}
+
+static void PutAdtsHeader(byte *h, const FLV_AAC_CONFIG *cfg, unsigned frame_length) {
+    h[0] = 0xff;
+    h[1] = 0xf1;                // MPEG-4, layer 0, protection_absent
+    h[2] = (byte) (((cfg->object_type - 1) << 6) | (cfg->sf_index << 2) | (cfg->channels >> 2));
+    h[3] = (byte) (((cfg->channels & 0x03) << 6) | (frame_length >> 11));
+    h[4] = (byte) (frame_length >> 3);
+    h[5] = (byte) (((frame_length & 0x07) << 5) | 0x1f);    // adts_buffer_fullness = 0x7FF
+    h[6] = 0xfc;
+}
+
+static void WriteAnnexbNalu(FLV_WRITER *w, const byte *nal, size_t len) {
+    static const byte start_code[4] = {0, 0, 0, 1};
+    FlvWriterPut(w, start_code, 4);
+    FlvWriterPut(w, nal, len);
+}
+
+/**
+ * Extract the H.264 and AAC (or other audio) elementary streams of an FLV file in one pass.
+ * @param url          Input FLV file.
+ * @param video_url    Output H.264 Annex B file, NULL to skip video.
+ * @param audio_url    Output ADTS file (raw tag data for non-AAC audio), NULL to skip audio.
+ * @return 0 on success, -1 on failure.
+ */
+int FlvExtractStreams(const char *url, const char *video_url, const char *audio_url) {
+    FLV_MAP map;
+    if (MapFlvFile(url, &map) != 0) {
+        printf("Failed to open files!\n");
+        return -1;
+    }
+    size_t pos = FlvFirstTagOffset(map.data, map.size);
+    if (pos == 0) {
+        printf("Not a FLV file\n");
+        UnmapFlvFile(&map);
+        return -1;
+    }
+    FLV_WRITER vw, aw;
+    memset(&vw, 0, sizeof(vw));
+    memset(&aw, 0, sizeof(aw));
+    if ((video_url && FlvWriterOpen(&vw, video_url) != 0) || (audio_url && FlvWriterOpen(&aw, audio_url) != 0)) {
+        printf("Failed to open files!\n");
+        FlvWriterClose(&vw);
+        FlvWriterClose(&aw);
+        UnmapFlvFile(&map);
+        return -1;
+    }
+
+    FLV_AVC_CONFIG avc;
+    FLV_AAC_CONFIG aac = {0, 0, 0};
+    int have_avc = 0, have_aac = 0;
+    int video_frames = 0, audio_frames = 0, skipped = 0;
+    int audio_format = -1;
+    FLV_TAG_VIEW tag;
+    while (FlvNextTag(map.data, map.size, &pos, &tag)) {
+        const byte *d = tag.data;
+        unsigned size = tag.data_size;
+        if (tag.type == TAG_TYPE_VIDEO && video_url && size >= 5 && (d[0] & 0x0f) == 7) {
+            if (d[1] == 0) {
+                have_avc = ParseFlvAvcConfig(d + 5, size - 5, &avc) == 0;
+                continue;
+            }
+            if (d[1] != 1 || !have_avc) {
+                skipped += d[1] == 1;
+                continue;
+            }
+            const byte *p = d + 5;
+            const byte *end = d + size;
+            // 关键帧：帧里没有 SPS 时先写 avcC 里的 SPS/PPS
+            int key = (d[0] >> 4) == 1;
+            for (const byte *q = p; key && end - q >= avc.length_size;) {
+                size_t len = reverse_bytes((byte *) q, avc.length_size);
+                q += avc.length_size;
+                if (len > (size_t) (end - q)) {
+                    break;
+                }
+                if (len > 0 && (q[0] & 0x1f) == 7) {
+                    key = 0;
+                }
+                q += len;
+            }
+            if (key) {
+                for (int i = 0; i < avc.sps_count; i++) WriteAnnexbNalu(&vw, avc.sps[i], avc.sps_len[i]);
+                for (int i = 0; i < avc.pps_count; i++) WriteAnnexbNalu(&vw, avc.pps[i], avc.pps_len[i]);
+            }
+            while (end - p >= avc.length_size) {
+                size_t len = reverse_bytes((byte *) p, avc.length_size);
+                p += avc.length_size;
+                if (len > (size_t) (end - p)) {
+                    break;
+                }
+                WriteAnnexbNalu(&vw, p, len);
+                p += len;
+            }
+            video_frames++;
+        } else if (tag.type == TAG_TYPE_AUDIO && audio_url && size >= 1) {
+            audio_format = d[0] >> 4;
+            if (audio_format != 10) {
+                // 其它格式（MP3 等）本身就是基本流
+                FlvWriterPut(&aw, d + 1, size - 1);
+                audio_frames++;
+                continue;
+            }
+            if (size >= 2 && d[1] == 0) {
+                have_aac = ParseFlvAacConfig(d + 2, size - 2, &aac) == 0;
+                continue;
+            }
+            unsigned frame_length = size - 2 + 7;
+            if (size < 2 || !have_aac || frame_length > 8191) {
+                skipped++;
+                continue;
+            }
+            byte header[7];
+            PutAdtsHeader(header, &aac, frame_length);
+            FlvWriterPut(&aw, header, sizeof(header));
+            FlvWriterPut(&aw, d + 2, size - 2);
+            audio_frames++;
+        }
+    }
+
+    unsigned long long video_bytes = vw.bytes, audio_bytes = aw.bytes;
+    int ret = (FlvWriterClose(&vw) == 0 && FlvWriterClose(&aw) == 0) ? 0 : -1;
+    if (ret != 0) {
+        printf("Write output file error\n");
+    } else {
+        printf("video: %d frames, %llu bytes\n", video_frames, video_bytes);
+        printf("audio: %d frames, %llu bytes (%s)\n", audio_frames, audio_bytes,
+               audio_format == 10 ? "ADTS" : (audio_format == 2 ? "MP3" : "raw"));
+        if (skipped > 0) {
+            printf("skipped %d tags without a usable sequence header\n", skipped);
+        }
+    }
+    UnmapFlvFile(&map);
+    return ret;
+}
+
+/* ====================== 把 H.264/AAC 基本流封装成 FLV ======================
+ * simplest_flv_parser 的逆过程：
+ *   视频：Annex B 按访问单元（一帧）切分，起始码换成4字节长度前缀；SPS/PPS 生成 AVCDecoderConfigurationRecord
+ *   音频：去掉 ADTS 帧头，第一帧的帧头生成 AudioSpecificConfig
+ * 第一遍扫描得到视频帧的位置、POC（用来计算 CompositionTime）和所有 Tag 的大小，
+ * 所以 onMetaData 中的 duration、filesize 在写出第一个 Tag 之前就已经确定。
+ * 第二遍按 DTS 合并两路输入：每一路只有一个等待写出的样本，每次写出 DTS 较小的那个。
+ */
+
+#define FLV_MUX_DEFAULT_FPS     25
+#define FLV_MUX_RBSP_SIZE       256     // SPS 和片头只需要前面的一部分
+
+// 00 00 01 的位置，没有找到时返回 end
+static const byte *FindAnnexbStartCode(const byte *p, const byte *end) {
+    while (end - p >= 3) {
+        const byte *q = (const byte *) memchr(p + 2, 1, end - p - 2);
+        if (q == NULL) {
+            return end;
+        }
+        if (q[-1] == 0 && q[-2] == 0) {
+            return q - 2;
+        }
+        p = q - 1;
+    }
+    return end;
+}
+
+/**
+ * Get the next NALU of an Annex B stream.
+ * @param pos    Where to start searching, set to the start code of the following NALU.
+ * @return 1 if nal/len were filled, 0 at the end of the stream.
+ */
+static int NextAnnexbNalu(const byte *data, size_t size, size_t *pos, const byte **nal, size_t *len) {
+    const byte *end = data + size;
+    const byte *sc = FindAnnexbStartCode(data + *pos, end);
+    if (sc == end) {
+        *pos = size;
+        return 0;
+    }
+    const byte *p = sc + 3;
+    const byte *next = FindAnnexbStartCode(p, end);
+    *pos = (size_t) (next - data);
+    // 4字节起始码的第一个 00 以及 trailing_zero_8bits 不属于这个 NALU
+    while (next > p && next[-1] == 0) {
+        next--;
+    }
+    *nal = p;
+    *len = (size_t) (next - p);
+    return 1;
+}
+
+// 去掉防竞争字节 00 00 03 中的 03
+static size_t FlvEbspToRbsp(const byte *src, size_t len, byte *dst, size_t dst_size) {
+    size_t out = 0;
+    int zeros = 0;
+    for (size_t i = 0; i < len && out < dst_size; i++) {
+        if (zeros >= 2 && src[i] == 0x03) {
+            zeros = 0;
+            continue;
+        }
+        zeros = src[i] == 0 ? zeros + 1 : 0;
+        dst[out++] = src[i];
+    }
+    return out;
+}
+
+typedef struct {
+    const byte *data;
+    size_t size;
+    size_t pos;                 //! 当前位置（比特）
+} FLV_BIT_READER;
+
+static unsigned FlvReadBits(FLV_BIT_READER *br, int n) {
+    unsigned v = 0;
+    for (int i = 0; i < n; i++, br->pos++) {
+        size_t byte_pos = br->pos >> 3;
+        int bit = byte_pos < br->size ? (br->data[byte_pos] >> (7 - (br->pos & 7))) & 1 : 0;
+        v = (v << 1) | bit;
+    }
+    return v;
+}
+
+// ue(v)
+static unsigned FlvReadUE(FLV_BIT_READER *br) {
+    int zeros = 0;
+    while (FlvReadBits(br, 1) == 0 && zeros < 32) {
+        if (br->pos > br->size * 8) {
+            return 0;
+        }
+        zeros++;
+    }
+    return zeros >= 32 ? 0 : (1u << zeros) - 1 + FlvReadBits(br, zeros);
+}
+
+static int FlvReadSE(FLV_BIT_READER *br) {
+    unsigned k = FlvReadUE(br);
+    return (k & 1) ? (int) ((k + 1) >> 1) : -(int) (k >> 1);
+}
+
+// 封装时用到的 SPS 字段
+typedef struct {
+    int profile_idc;
+    int chroma_format_idc;
+    int separate_colour_plane_flag;
+    int bit_depth_luma;
+    int bit_depth_chroma;
+    int log2_max_frame_num;
+    int pic_order_cnt_type;
+    int log2_max_pic_order_cnt_lsb;
+    int frame_mbs_only_flag;
+    int width;                  //! 裁剪后的宽度
+    int height;                 //! 裁剪后的高度
+    unsigned num_units_in_tick; //! VUI timing_info，没有时为0
+    unsigned time_scale;
+} FLV_H264_SPS;
+
+/**
+ * Parse the SPS fields needed by the muxer.
+ * @param nal    SPS NALU, including the NALU header byte.
+ * @return 0 on success, -1 on error.
+ */
+static int ParseFlvSps(const byte *nal, size_t len, FLV_H264_SPS *sps) {
+    byte rbsp[FLV_MUX_RBSP_SIZE];
+    FLV_BIT_READER br = {rbsp, FlvEbspToRbsp(nal + 1, len - 1, rbsp, sizeof(rbsp)), 0};
+    memset(sps, 0, sizeof(FLV_H264_SPS));
+    sps->profile_idc = FlvReadBits(&br, 8);
+    FlvReadBits(&br, 16);                       // constraint_set_flags, level_idc
+    FlvReadUE(&br);                             // seq_parameter_set_id
+    sps->chroma_format_idc = 1;
+    sps->bit_depth_luma = sps->bit_depth_chroma = 8;
+    switch (sps->profile_idc) {
+        case 100: case 110: case 122: case 244: case 44:
+        case 83: case 86: case 118: case 128: case 138: case 139: case 134: case 135:
+            sps->chroma_format_idc = FlvReadUE(&br);
+            if (sps->chroma_format_idc == 3) {
+                sps->separate_colour_plane_flag = FlvReadBits(&br, 1);
+            }
+            sps->bit_depth_luma = FlvReadUE(&br) + 8;
+            sps->bit_depth_chroma = FlvReadUE(&br) + 8;
+            FlvReadBits(&br, 1);                // qpprime_y_zero_transform_bypass_flag
+            if (FlvReadBits(&br, 1)) {          // seq_scaling_matrix_present_flag
+                for (int i = 0; i < (sps->chroma_format_idc != 3 ? 8 : 12); i++) {
+                    if (!FlvReadBits(&br, 1)) {
+                        continue;
+                    }
+                    int last_scale = 8, next_scale = 8;
+                    for (int j = 0; j < (i < 6 ? 16 : 64) && next_scale != 0; j++) {
+                        next_scale = (last_scale + FlvReadSE(&br) + 256) % 256;
+                        last_scale = next_scale != 0 ? next_scale : last_scale;
+                    }
+                }
+            }
+            break;
+        default:
+            break;
+    }
+    sps->log2_max_frame_num = FlvReadUE(&br) + 4;
+    sps->pic_order_cnt_type = FlvReadUE(&br);
+    if (sps->pic_order_cnt_type == 0) {
+        sps->log2_max_pic_order_cnt_lsb = FlvReadUE(&br) + 4;
+    } else if (sps->pic_order_cnt_type == 1) {
+        FlvReadBits(&br, 1);                    // delta_pic_order_always_zero_flag
+        FlvReadSE(&br);                         // offset_for_non_ref_pic
+        FlvReadSE(&br);                         // offset_for_top_to_bottom_field
+        unsigned cycle = FlvReadUE(&br);
+        for (unsigned i = 0; i < cycle && i < 256; i++) {
+            FlvReadSE(&br);
+        }
+    }
+    FlvReadUE(&br);                             // max_num_ref_frames
+    FlvReadBits(&br, 1);                        // gaps_in_frame_num_value_allowed_flag
+    int width_in_mbs = FlvReadUE(&br) + 1;
+    int height_in_map_units = FlvReadUE(&br) + 1;
+    sps->frame_mbs_only_flag = FlvReadBits(&br, 1);
+    if (!sps->frame_mbs_only_flag) {
+        FlvReadBits(&br, 1);                    // mb_adaptive_frame_field_flag
+    }
+    FlvReadBits(&br, 1);                        // direct_8x8_inference_flag
+    sps->width = width_in_mbs * 16;
+    sps->height = (2 - sps->frame_mbs_only_flag) * height_in_map_units * 16;
+    if (FlvReadBits(&br, 1)) {                  // frame_cropping_flag
+        int left = FlvReadUE(&br), right = FlvReadUE(&br), top = FlvReadUE(&br), bottom = FlvReadUE(&br);
+        int crop_x = 1, crop_y = 2 - sps->frame_mbs_only_flag;
+        if (sps->chroma_format_idc != 0 && !sps->separate_colour_plane_flag) {
+            crop_x = sps->chroma_format_idc == 3 ? 1 : 2;
+            crop_y *= sps->chroma_format_idc == 1 ? 2 : 1;
+        }
+        sps->width -= (left + right) * crop_x;
+        sps->height -= (top + bottom) * crop_y;
+    }
+    if (FlvReadBits(&br, 1)) {                  // vui_parameters_present_flag：只需要 timing_info
+        if (FlvReadBits(&br, 1) && FlvReadBits(&br, 8) == 255) {
+            FlvReadBits(&br, 32);               // sar_width, sar_height
+        }
+        if (FlvReadBits(&br, 1)) {
+            FlvReadBits(&br, 1);                // overscan_appropriate_flag
+        }
+        if (FlvReadBits(&br, 1)) {              // video_signal_type_present_flag
+            FlvReadBits(&br, 4);
+            if (FlvReadBits(&br, 1)) {
+                FlvReadBits(&br, 24);
+            }
+        }
+        if (FlvReadBits(&br, 1)) {              // chroma_loc_info_present_flag
+            FlvReadUE(&br);
+            FlvReadUE(&br);
+        }
+        if (FlvReadBits(&br, 1)) {              // timing_info_present_flag
+            sps->num_units_in_tick = FlvReadBits(&br, 32);
+            sps->time_scale = FlvReadBits(&br, 32);
+        }
+    }
+    if (br.pos > br.size * 8 || sps->width <= 0 || sps->height <= 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Read pic_order_cnt_lsb from a slice header (POC type 0).
+ * @return pic_order_cnt_lsb, -1 on error.
+ */
+static int FlvSlicePocLsb(const byte *nal, size_t len, const FLV_H264_SPS *sps) {
+    byte rbsp[32];
+    FLV_BIT_READER br = {rbsp, FlvEbspToRbsp(nal + 1, len - 1, rbsp, sizeof(rbsp)), 0};
+    FlvReadUE(&br);                             // first_mb_in_slice
+    FlvReadUE(&br);                             // slice_type
+    FlvReadUE(&br);                             // pic_parameter_set_id
+    if (sps->separate_colour_plane_flag) {
+        FlvReadBits(&br, 2);                    // colour_plane_id
+    }
+    FlvReadBits(&br, sps->log2_max_frame_num);  // frame_num
+    if (!sps->frame_mbs_only_flag && FlvReadBits(&br, 1)) {
+        FlvReadBits(&br, 1);                    // bottom_field_flag
+    }
+    if ((nal[0] & 0x1f) == 5) {
+        FlvReadUE(&br);                         // idr_pic_id
+    }
+    int lsb = (int) FlvReadBits(&br, sps->log2_max_pic_order_cnt_lsb);
+    return br.pos > br.size * 8 ? -1 : lsb;
+}
+
+// 一个视频帧（访问单元）
+typedef struct {
+    size_t begin;               //! 第一个NALU的起始码在 .h264 中的位置
+    size_t end;                 //! 下一帧的起始位置
+    unsigned size;              //! 写进 Tag 的 NALU 数据的大小（含4字节长度前缀）
+    int poc;
+    int pts_index;              //! 显示顺序的帧号
+    int key;
+} FLV_MUX_SAMPLE;
+
+typedef struct {
+    FLV_MUX_SAMPLE *samples;
+    int count;
+    int capacity;
+    const byte *sps;            //! 第一个 SPS / PPS，用来生成 AVCDecoderConfigurationRecord
+    size_t sps_len;
+    const byte *pps;
+    size_t pps_len;
+    FLV_H264_SPS sps_info;
+    int delay;                  //! 显示时间比解码时间晚的最大帧数
+} FLV_MUX_VIDEO;
+
+static int FlvMuxAppendSample(FLV_MUX_VIDEO *v, size_t begin) {
+    if (v->count == v->capacity) {
+        int capacity = v->capacity ? v->capacity * 2 : 1024;
+        FLV_MUX_SAMPLE *p = (FLV_MUX_SAMPLE *) realloc(v->samples, capacity * sizeof(FLV_MUX_SAMPLE));
+        if (p == NULL) {
+            return -1;
+        }
+        v->samples = p;
+        v->capacity = capacity;
+    }
+    FLV_MUX_SAMPLE *s = &v->samples[v->count++];
+    memset(s, 0, sizeof(FLV_MUX_SAMPLE));
+    s->begin = begin;
+    return 0;
+}
+
+static int CompareSamplePoc(const void *a, const void *b) {
+    const int *x = (const int *) a, *y = (const int *) b;
+    // 每个元素是 {poc, 帧号}，POC 相同时保持解码顺序
+    return x[0] != y[0] ? (x[0] < y[0] ? -1 : 1) : (x[1] < y[1] ? -1 : (x[1] > y[1]));
+}
+
+/**
+ * Split an Annex B stream into access units and compute their display order.
+ * 新的访问单元从 AUD/SPS/PPS/SEI 或者 first_mb_in_slice == 0 的片开始（7.4.1.2.3），只支持逐行的帧
+ * @return 0 on success, -1 on failure.
+ */
+static int ScanFlvMuxVideo(const byte *data, size_t size, FLV_MUX_VIDEO *v) {
+    memset(v, 0, sizeof(FLV_MUX_VIDEO));
+    size_t pos = 0, nal_pos = 0;
+    const byte *nal;
+    size_t len;
+    int have_sps = 0, in_au = 0, has_vcl = 0;
+    int prev_poc_msb = 0, prev_poc_lsb = 0;
+    // active：最近一个 SPS，只用于计算 POC；v->sps_info 和 v->sps 都是第一个 SPS，写进 avcC 和 onMetaData
+    FLV_H264_SPS active, parsed;
+    while (nal_pos = pos, NextAnnexbNalu(data, size, &pos, &nal, &len)) {
+        if (len == 0) {
+            continue;
+        }
+        int type = nal[0] & 0x1f;
+        int vcl = type >= 1 && type <= 5;
+        int starts_au = (type == 9 || type == 7 || type == 8 || type == 6 || (type >= 14 && type <= 18)) ||
+                        (vcl && len > 1 && (nal[1] & 0x80));
+        if (!in_au || (has_vcl && starts_au)) {
+            if (in_au) {
+                v->samples[v->count - 1].end = nal_pos;
+            }
+            if (FlvMuxAppendSample(v, nal_pos) != 0) {
+                return -1;
+            }
+            in_au = 1;
+            has_vcl = 0;
+        }
+        FLV_MUX_SAMPLE *s = &v->samples[v->count - 1];
+        if (type == 7 && ParseFlvSps(nal, len, &parsed) == 0) {
+            active = parsed;
+            if (!have_sps) {
+                v->sps_info = parsed;
+                v->sps = nal;
+                v->sps_len = len;
+                have_sps = 1;
+            }
+        } else if (type == 8 && v->pps == NULL) {
+            v->pps = nal;
+            v->pps_len = len;
+        }
+        if (type != 9) {
+            s->size += 4 + (unsigned) len;      // AUD 不写进 FLV
+        }
+        if (vcl && !has_vcl) {
+            // 帧的第一个片：计算 POC。POC 类型 1/2 按解码顺序显示
+            s->key = type == 5;
+            if (type == 5) {
+                prev_poc_msb = prev_poc_lsb = 0;
+            }
+            s->poc = v->count * 2;
+            if (have_sps && active.pic_order_cnt_type == 0) {
+                int lsb = FlvSlicePocLsb(nal, len, &active);
+                int max_lsb = 1 << active.log2_max_pic_order_cnt_lsb;
+                int msb = prev_poc_msb;
+                if (lsb < prev_poc_lsb && prev_poc_lsb - lsb >= max_lsb / 2) {
+                    msb += max_lsb;
+                } else if (lsb > prev_poc_lsb && lsb - prev_poc_lsb > max_lsb / 2) {
+                    msb -= max_lsb;
+                }
+                s->poc = msb + (lsb < 0 ? 0 : lsb);
+                if ((nal[0] & 0x60) != 0) {     // 只有参考帧更新 prevPicOrderCnt
+                    prev_poc_msb = msb;
+                    prev_poc_lsb = lsb < 0 ? 0 : lsb;
+                }
+            }
+        }
+        has_vcl |= vcl;
+    }
+    if (in_au) {
+        v->samples[v->count - 1].end = size;
+        if (!has_vcl) {
+            v->count--;                         // 码流末尾只有参数集/SEI，没有图像
+        }
+    }
+    if (v->sps == NULL || v->pps == NULL || v->count == 0) {
+        return -1;
+    }
+
+    // 每个 IDR 开始的一段内按 POC 排序，得到显示顺序
+    int *order = (int *) malloc(v->count * 2 * sizeof(int));
+    if (order == NULL) {
+        return -1;
+    }
+    for (int start = 0; start < v->count;) {
+        int end = start + 1;
+        while (end < v->count && !v->samples[end].key) {
+            end++;
+        }
+        for (int i = start; i < end; i++) {
+            order[2 * i] = v->samples[i].poc;
+            order[2 * i + 1] = i;
+        }
+        qsort(order + 2 * start, end - start, 2 * sizeof(int), CompareSamplePoc);
+        for (int i = start; i < end; i++) {
+            FLV_MUX_SAMPLE *s = &v->samples[order[2 * i + 1]];
+            s->pts_index = i;
+            if (order[2 * i + 1] - i > v->delay) {
+                v->delay = order[2 * i + 1] - i;
+            }
+        }
+        start = end;
+    }
+    free(order);
+    return 0;
+}
+
+// 读 ADTS 帧头；返回帧长度，0 表示这里不是一个有效的 ADTS 帧
+static unsigned FlvAdtsFrame(const byte *p, size_t left, unsigned *header_len, int *blocks) {
+    if (left < 7 || p[0] != 0xff || (p[1] & 0xf6) != 0xf0) {
+        return 0;
+    }
+    unsigned frame_length = ((p[3] & 0x03) << 11) | (p[4] << 3) | (p[5] >> 5);
+    *header_len = (p[1] & 0x01) ? 7 : 9;        // protection_absent == 0 时有2字节 CRC
+    *blocks = (p[6] & 0x03) + 1;
+    return frame_length > *header_len && frame_length <= left ? frame_length : 0;
+}
+
+typedef struct {
+    FLV_AAC_CONFIG aac;         //! 第一帧的帧头
+    int sample_rate;
+    unsigned long long frames;
+    unsigned long long samples; //! 采样数，每个 raw_data_block 1024 个
+    unsigned long long bytes;   //! 所有音频 Tag（含 Previous Tag Size）的大小
+} FLV_MUX_AUDIO;
+
+/**
+ * Count the ADTS frames and get the AAC config from the first one.
+ * @return 0 on success, -1 if there is no usable ADTS frame.
+ */
+static int ScanFlvMuxAudio(const byte *data, size_t size, FLV_MUX_AUDIO *a) {
+    static const int sample_rates[13] = {96000, 88200, 64000, 48000, 44100, 32000, 24000,
+                                         22050, 16000, 12000, 11025, 8000, 7350};
+    memset(a, 0, sizeof(FLV_MUX_AUDIO));
+    unsigned header_len;
+    int blocks;
+    for (size_t pos = 0; pos < size;) {
+        unsigned frame_length = FlvAdtsFrame(data + pos, size - pos, &header_len, &blocks);
+        if (frame_length == 0) {
+            pos++;                              // 重新同步
+            continue;
+        }
+        if (a->frames == 0) {
+            const byte *h = data + pos;
+            a->aac.object_type = (h[2] >> 6) + 1;
+            a->aac.sf_index = (h[2] >> 2) & 0x0f;
+            a->aac.channels = ((h[2] & 0x01) << 2) | (h[3] >> 6);
+        }
+        a->frames++;
+        a->samples += 1024 * blocks;
+        a->bytes += FLV_TAG_HEADER_SIZE + 2 + (frame_length - header_len) + 4;
+        pos += frame_length;
+    }
+    if (a->frames == 0 || a->aac.sf_index > 12) {
+        return -1;
+    }
+    a->sample_rate = sample_rates[a->aac.sf_index];
+    return 0;
+}
+
+static void FlvWriterPutTagHeader(FLV_WRITER *w, int type, unsigned data_size, unsigned timestamp) {
+    byte h[FLV_TAG_HEADER_SIZE];
+    h[0] = (byte) type;
+    h[1] = (byte) (data_size >> 16);
+    h[2] = (byte) (data_size >> 8);
+    h[3] = (byte) data_size;
+    PutFlvTimestamp(h, timestamp);
+    h[8] = h[9] = h[10] = 0;                    // StreamID
+    FlvWriterPut(w, h, sizeof(h));
+}
+
+static void FlvWriterPutTagEnd(FLV_WRITER *w, unsigned data_size) {
+    byte b[4];
+    PutBE32(b, FLV_TAG_HEADER_SIZE + data_size);
+    FlvWriterPut(w, b, sizeof(b));
+}
+
+// AVCDecoderConfigurationRecord：一个 SPS、一个 PPS，NALU 长度前缀为4字节
+static size_t PutAvcConfig(byte *p, const FLV_MUX_VIDEO *v) {
+    const FLV_H264_SPS *si = &v->sps_info;
+    byte *start = p;
+    *p++ = 1;                                   // configurationVersion
+    *p++ = v->sps[1];                           // AVCProfileIndication
+    *p++ = v->sps[2];                           // profile_compatibility
+    *p++ = v->sps[3];                           // AVCLevelIndication
+    *p++ = 0xff;                                // lengthSizeMinusOne = 3
+    *p++ = 0xe1;                                // numOfSequenceParameterSets = 1
+    *p++ = (byte) (v->sps_len >> 8);
+    *p++ = (byte) v->sps_len;
+    memcpy(p, v->sps, v->sps_len);
+    p += v->sps_len;
+    *p++ = 1;                                   // numOfPictureParameterSets
+    *p++ = (byte) (v->pps_len >> 8);
+    *p++ = (byte) v->pps_len;
+    memcpy(p, v->pps, v->pps_len);
+    p += v->pps_len;
+    if (si->profile_idc == 100 || si->profile_idc == 110 || si->profile_idc == 122 || si->profile_idc == 144) {
+        *p++ = (byte) (0xfc | si->chroma_format_idc);
+        *p++ = (byte) (0xf8 | (si->bit_depth_luma - 8));
+        *p++ = (byte) (0xf8 | (si->bit_depth_chroma - 8));
+        *p++ = 0;                               // numOfSequenceParameterSetExt
+    }
+    return p - start;
+}
+
+// 第二遍：写出 FLV Header、onMetaData、序列头，然后按 DTS 交错写出音视频 Tag
+static int WriteFlvMux(const FLV_MAP *vmap, const FLV_MUX_VIDEO *video, const FLV_MAP *amap,
+                       const FLV_MUX_AUDIO *audio, const char *out_url, double fps) {
+    int has_video = video->count > 0, has_audio = audio->frames > 0;
+    unsigned long long sample_rate = has_audio ? audio->sample_rate : 1;
+    // 帧率用分数表示：fps_num / fps_den，时间戳 = 帧号 * 1000 * fps_den / fps_num
+    unsigned long long fps_num = FLV_MUX_DEFAULT_FPS, fps_den = 1;
+    if (fps > 0) {
+        fps_num = (unsigned long long) (fps * 1000 + 0.5);
+        fps_den = 1000;
+    } else if (video->sps_info.num_units_in_tick > 0 && video->sps_info.time_scale > 0) {
+        fps_num = video->sps_info.time_scale;
+        fps_den = 2ULL * video->sps_info.num_units_in_tick;
+    }
+
+    // 序列头
+    byte *avcc = (byte *) malloc(32 + video->sps_len + video->pps_len);
+    if (avcc == NULL) {
+        return -1;
+    }
+    size_t avcc_len = has_video ? PutAvcConfig(avcc, video) : 0;
+    const FLV_AAC_CONFIG *aac = &audio->aac;
+    byte asc[2] = {(byte) ((aac->object_type << 3) | (aac->sf_index >> 1)),
+                   (byte) (((aac->sf_index & 1) << 7) | (aac->channels << 3))};
+
+    // onMetaData：时长、文件大小在写出之前就已经知道
+    unsigned long long video_bytes = 0;
+    for (int i = 0; i < video->count; i++) {
+        video_bytes += FLV_TAG_HEADER_SIZE + 5 + video->samples[i].size + 4;
+    }
+    unsigned long long video_ms = video->count * 1000ULL * fps_den / fps_num;
+    unsigned long long audio_ms = audio->samples * 1000 / sample_rate;
+    double duration = (video_ms > audio_ms ? video_ms : audio_ms) / 1000.0;
+
+    byte meta[512];
+    byte *p = meta;
+    *p++ = AMF0_STRING;
+    p = PutAmf0Key(p, "onMetaData");
+    *p++ = AMF0_ECMA_ARRAY;
+    p = PutBE32(p, 2 + (has_video ? 4 : 0) + (has_audio ? 4 : 0));
+    p = PutAmf0Key(p, "duration");
+    p = PutAmf0Number(p, duration);
+    if (has_video) {
+        p = PutAmf0Key(p, "width");
+        p = PutAmf0Number(p, video->sps_info.width);
+        p = PutAmf0Key(p, "height");
+        p = PutAmf0Number(p, video->sps_info.height);
+        p = PutAmf0Key(p, "framerate");
+        p = PutAmf0Number(p, (double) fps_num / fps_den);
+        p = PutAmf0Key(p, "videocodecid");
+        p = PutAmf0Number(p, 7);
+    }
+    if (has_audio) {
+        p = PutAmf0Key(p, "audiosamplerate");
+        p = PutAmf0Number(p, (double) sample_rate);
+        p = PutAmf0Key(p, "audiosamplesize");
+        p = PutAmf0Number(p, 16);
+        p = PutAmf0Key(p, "stereo");
+        *p++ = AMF0_BOOLEAN;
+        *p++ = aac->channels == 2;
+        p = PutAmf0Key(p, "audiocodecid");
+        p = PutAmf0Number(p, 10);
+    }
+    p = PutAmf0Key(p, "filesize");
+    byte *filesize_pos = p;
+    p = PutAmf0Number(p, 0);
+    p = PutAmf0ObjectEnd(p);
+    unsigned meta_len = (unsigned) (p - meta);
+    unsigned long long filesize = 9 + 4 + (FLV_TAG_HEADER_SIZE + meta_len + 4) + video_bytes + audio->bytes +
+                                  (has_video ? FLV_TAG_HEADER_SIZE + 5 + avcc_len + 4 : 0) +
+                                  (has_audio ? FLV_TAG_HEADER_SIZE + 2 + sizeof(asc) + 4 : 0);
+    PutAmf0Number(filesize_pos, (double) filesize);
+
+    FLV_WRITER w;
+    if (FlvWriterOpen(&w, out_url) != 0) {
+        printf("Failed to open files!\n");
+        free(avcc);
+        return -1;
+    }
+    byte header[13] = {'F', 'L', 'V', 1, (byte) ((has_audio ? 0x04 : 0) | (has_video ? 0x01 : 0)),
+                       0, 0, 0, 9, 0, 0, 0, 0};   // FLV Header + PreviousTagSize0
+    FlvWriterPut(&w, header, sizeof(header));
+    FlvWriterPutTagHeader(&w, TAG_TYPE_SCRIPT, meta_len, 0);
+    FlvWriterPut(&w, meta, meta_len);
+    FlvWriterPutTagEnd(&w, meta_len);
+    if (has_video) {
+        byte b[5] = {0x17, 0, 0, 0, 0};         // 关键帧 + AVC，AVCPacketType 0
+        FlvWriterPutTagHeader(&w, TAG_TYPE_VIDEO, 5 + (unsigned) avcc_len, 0);
+        FlvWriterPut(&w, b, sizeof(b));
+        FlvWriterPut(&w, avcc, avcc_len);
+        FlvWriterPutTagEnd(&w, 5 + (unsigned) avcc_len);
+    }
+    if (has_audio) {
+        byte b[2] = {0xaf, 0};                  // AAC（SoundRate/SoundSize/SoundType 固定为 3/1/1），AACPacketType 0
+        FlvWriterPutTagHeader(&w, TAG_TYPE_AUDIO, 2 + sizeof(asc), 0);
+        FlvWriterPut(&w, b, sizeof(b));
+        FlvWriterPut(&w, asc, sizeof(asc));
+        FlvWriterPutTagEnd(&w, 2 + sizeof(asc));
+    }
+    free(avcc);
+
+    // 两路各有一个等待写出的样本：视频是 samples[vi]，音频是 apos 处的 ADTS 帧
+    int vi = 0;
+    size_t apos = 0;
+    unsigned long long asamples = 0;
+    while (vi < video->count || apos < amap->size) {
+        unsigned header_len = 0, frame_length = 0;
+        int blocks = 0;
+        while (apos < amap->size &&
+               (frame_length = FlvAdtsFrame(amap->data + apos, amap->size - apos, &header_len, &blocks)) == 0) {
+            apos++;
+        }
+        unsigned long long adts = asamples * 1000 / sample_rate;
+        unsigned long long vdts = vi * 1000ULL * fps_den / fps_num;
+        if (vi < video->count && (frame_length == 0 || vdts <= adts)) {
+            const FLV_MUX_SAMPLE *s = &video->samples[vi];
+            // CompositionTime = PTS - DTS，PTS 整体推迟 delay 帧，保证不小于 DTS
+            unsigned long long pts = (unsigned long long) (s->pts_index + video->delay) * 1000 * fps_den / fps_num;
+            int cts = (int) (pts - vdts);
+            byte b[5] = {(byte) ((s->key ? 0x10 : 0x20) | 7), 1, (byte) (cts >> 16), (byte) (cts >> 8), (byte) cts};
+            FlvWriterPutTagHeader(&w, TAG_TYPE_VIDEO, 5 + s->size, (unsigned) vdts);
+            FlvWriterPut(&w, b, sizeof(b));
+            const byte *nal;
+            size_t len;
+            for (size_t pos = s->begin; NextAnnexbNalu(vmap->data, s->end, &pos, &nal, &len);) {
+                if (len == 0 || (nal[0] & 0x1f) == 9) {
+                    continue;
+                }
+                byte prefix[4];
+                PutBE32(prefix, (unsigned) len);
+                FlvWriterPut(&w, prefix, sizeof(prefix));
+                FlvWriterPut(&w, nal, len);
+            }
+            FlvWriterPutTagEnd(&w, 5 + s->size);
+            vi++;
+        } else if (frame_length > 0) {
+            unsigned raw_len = frame_length - header_len;
+            byte b[2] = {0xaf, 1};
+            FlvWriterPutTagHeader(&w, TAG_TYPE_AUDIO, 2 + raw_len, (unsigned) adts);
+            FlvWriterPut(&w, b, sizeof(b));
+            FlvWriterPut(&w, amap->data + apos + header_len, raw_len);
+            FlvWriterPutTagEnd(&w, 2 + raw_len);
+            asamples += 1024 * blocks;
+            apos += frame_length;
+        }
+    }
+    unsigned long long written = w.bytes;
+    if (FlvWriterClose(&w) != 0) {
+        printf("Write output file error\n");
+        return -1;
+    }
+    printf("video: %d frames (%.3f fps, delay %d), audio: %llu frames, %.3f s, %llu bytes\n",
+           video->count, (double) fps_num / fps_den, video->delay, audio->frames, duration, written);
+    return 0;
+}
+
+/**
+ * Mux an H.264 Annex B stream and an ADTS AAC stream into FLV.
+ * @param video_url    Input .h264, NULL means no video.
+ * @param audio_url    Input .aac, NULL means no audio.
+ * @param fps          Video frame rate, 0 means the SPS timing info (or FLV_MUX_DEFAULT_FPS).
+ * @return 0 on success, -1 on failure.
+ */
+int FlvMuxStreams(const char *video_url, const char *audio_url, const char *out_url, double fps) {
+    FLV_MAP vmap, amap;
+    memset(&vmap, 0, sizeof(vmap));
+    memset(&amap, 0, sizeof(amap));
+    if ((video_url && MapFlvFile(video_url, &vmap) != 0) || (audio_url && MapFlvFile(audio_url, &amap) != 0)) {
+        printf("Failed to open files!\n");
+        UnmapFlvFile(&vmap);
+        UnmapFlvFile(&amap);
+        return -1;
+    }
+    // 第一遍：视频帧的位置和显示顺序，音频帧的数量
+    FLV_MUX_VIDEO video;
+    FLV_MUX_AUDIO audio;
+    memset(&video, 0, sizeof(video));
+    memset(&audio, 0, sizeof(audio));
+    int ret = -1;
+    if (video_url && ScanFlvMuxVideo(vmap.data, vmap.size, &video) != 0) {
+        printf("No H.264 frames with SPS/PPS found\n");
+    } else if (audio_url && ScanFlvMuxAudio(amap.data, amap.size, &audio) != 0) {
+        printf("No ADTS frames found\n");
+    } else {
+        ret = WriteFlvMux(&vmap, &video, &amap, &audio, out_url, fps);
+    }
+    free(video.samples);
+    UnmapFlvFile(&vmap);
+    UnmapFlvFile(&amap);
+    return ret;
+}
+
+/* ====================== 时间戳修改与多文件拼接 ======================
+ * 修改时间戳只需要改每个 Tag Header 中的4个字节（Timestamp + TimestampExtended），Tag Data 不用动：
+ *   -retime/-rebase：文件以 MAP_SHARED 方式映射，直接在映射的内存中修改，写回的只有被修改的页
+ *   -concat：每个输入文件中连续的 Tag 用一次 CopyFileRange 复制（copy_file_range 在同一个文件系统上可以共享数据块），
+ *            然后把输出文件映射到内存，逐个修改 Tag Header
+ * 两种方式的开销都只和 Tag 的个数有关，与文件大小无关。
+ * 缩放时间戳时，AVC/HEVC 视频 Tag 中的 CompositionTime 也按同样的比例缩放（同样只有3个字节）。
+ */
+
+// 音频、视频 Tag 中最小的时间戳；没有音视频 Tag 时为0
+static unsigned FlvMinTimestamp(const byte *data, size_t size, size_t pos, size_t end) {
+    FLV_TAG_VIEW tag;
+    unsigned min_ts = 0;
+    int found = 0;
+    while (pos < end && FlvNextTag(data, size, &pos, &tag)) {
+        if ((tag.type == TAG_TYPE_AUDIO || tag.type == TAG_TYPE_VIDEO) && (!found || tag.timestamp < min_ts)) {
+            min_ts = tag.timestamp;
+            found = 1;
+        }
+    }
+    return min_ts;
+}
+
+/**
+ * Change the timestamps of the tags in [pos, end): ts = (ts - base) * scale + offset, clamped to 0 ~ 0xFFFFFFFF.
+ * @return Number of tags changed.
+ */
+static unsigned long RetimeFlvTags(byte *data, size_t size, size_t pos, size_t end,
+                                   long long base, double scale, long long offset) {
+    FLV_TAG_VIEW tag;
+    unsigned long changed = 0;
+    while (pos < end && FlvNextTag(data, size, &pos, &tag)) {
+        double t = ((double) tag.timestamp - (double) base) * scale + (double) offset;
+        unsigned ts = t <= 0 ? 0 : (t >= 4294967295.0 ? 0xFFFFFFFFu : (unsigned) (t + 0.5));
+        if (ts != tag.timestamp) {
+            PutFlvTimestamp(data + tag.offset, ts);
+            changed++;
+        }
+        // CompositionTime：AVCPacketType 为 1 时 Tag Data 第3~5字节，有符号24位
+        // 最后一个 Tag 的 Tag Data 可能为空，这时 tag.data 已经在映射范围之外
+        if (scale != 1.0 && tag.type == TAG_TYPE_VIDEO && tag.data_size >= 5 &&
+            ((tag.data[0] & 0x0f) == 7 || (tag.data[0] & 0x0f) == 12) && tag.data[1] == 1) {
+            byte *c = data + tag.offset + FLV_TAG_HEADER_SIZE + 2;
+            int cts = (int) ((unsigned) c[0] << 24 | c[1] << 16 | c[2] << 8) >> 8;
+            double v = cts * scale;
+            cts = (int) (v < 0 ? v - 0.5 : v + 0.5);
+            c[0] = (byte) (cts >> 16);
+            c[1] = (byte) (cts >> 8);
+            c[2] = (byte) cts;
+        }
+    }
+    return changed;
+}
+
+/**
+ * Rebase and/or scale the timestamps of an FLV file in place.
+ * @param offset    Added after scaling (ms).
+ * @param scale     Timestamps (and CompositionTime) are multiplied by scale.
+ * @param rebase    1: subtract the smallest audio/video timestamp first, so the file starts at offset.
+ * @return 0 on success, -1 on failure.
+ */
+int FlvRetimeInPlace(const char *url, long long offset, double scale, int rebase) {
+    FLV_MAP map;
+    if (MapFlvFileEx(url, &map, 1) != 0) {
+        printf("Failed to open files!\n");
+        return -1;
+    }
+    size_t first = FlvFirstTagOffset(map.data, map.size);
+    if (first == 0) {
+        printf("Not a FLV file\n");
+        UnmapFlvFile(&map);
+        return -1;
+    }
+    long long base = rebase ? FlvMinTimestamp(map.data, map.size, first, map.size) : 0;
+    unsigned long changed = RetimeFlvTags(map.data, map.size, first, map.size, base, scale, offset);
+    if (UnmapFlvFile(&map) != 0) {
+        printf("Write output file error\n");
+        return -1;
+    }
+    printf("%lu tag headers changed\n", changed);
+    return 0;
+}
+
+// 需要比较的序列头（AVC/HEVC 的 AVCPacketType 0，AAC 的 AACPacketType 0）
+static int IsFlvSequenceHeader(const FLV_TAG_VIEW *tag) {
+    if (tag->type == TAG_TYPE_VIDEO && tag->data_size >= 2) {
+        int codec = tag->data[0] & 0x0f;
+        return (codec == 7 || codec == 12) && tag->data[1] == 0;
+    }
+    return tag->type == TAG_TYPE_AUDIO && tag->data_size >= 2 && (tag->data[0] >> 4) == 10 && tag->data[1] == 0;
+}
+
+/**
+ * Concatenate FLV files. Each file is rebased to start where the previous one ended.
+ * 后面文件中的 onMetaData 和与前面相同的序列头会被去掉；第一个文件的 onMetaData 中的 duration、filesize 会被更新，
+ * keyframes 只对第一个文件有效，需要时用 -keyframes 重新生成。
+ * @return 0 on success, -1 on failure.
+ */
+int FlvConcat(const char *out_url, char **inputs, int count) {
+    FILE *ofh = fopen(out_url, "wb+");
+    if (ofh == NULL) {
+        printf("Failed to open files!\n");
+        return -1;
+    }
+    int out_fd = fileno(ofh);
+    long long out_pos = 0;
+    long long next_start = 0;           // 下一个文件的第一个 Tag 在输出中的时间戳
+    byte *seq[2] = {NULL, NULL};        // 最近写出的视频/音频序列头
+    unsigned seq_len[2] = {0, 0};
+    // 每个输入文件在输出中的范围以及时间戳的变化
+    long long *regions = (long long *) malloc(count * 4 * sizeof(long long));
+    byte flags = 0;
+    int ret = regions ? 0 : -1;
+
+    for (int i = 0; i < count && ret == 0; i++) {
+        FLV_MAP map;
+        size_t first;
+        int in_fd = -1;
+        if (MapFlvFile(inputs[i], &map) != 0 || (first = FlvFirstTagOffset(map.data, map.size)) == 0 ||
+            (in_fd = open(inputs[i], O_RDONLY)) < 0) {
+            printf("Failed to open %s\n", inputs[i]);
+            UnmapFlvFile(&map);
+            ret = -1;
+            break;
+        }
+        if (i == 0) {
+            // FLV Header 和 PreviousTagSize0 来自第一个文件
+            ret = CopyFileRange(in_fd, 0, out_fd, &out_pos, (long long) first);
+        }
+        flags |= map.data[4];
+        long long base = FlvMinTimestamp(map.data, map.size, first, map.size);
+        regions[4 * i] = out_pos;
+        regions[4 * i + 2] = base;
+        regions[4 * i + 3] = next_start;
+
+        // 连续的、需要保留的 Tag 合并成一次复制
+        size_t pos = first, run_start = first;
+        long long last_ts[2] = {-1, -1}, last_gap[2] = {0, 0}, end_ts = 0;
+        FLV_TAG_VIEW tag;
+        while (ret == 0) {
+            size_t tag_pos = pos;
+            int more = FlvNextTag(map.data, map.size, &pos, &tag);
+            int drop = 0;
+            if (more && pos > map.size) {
+                more = 0;                       // 最后一个 Tag 缺少 Previous Tag Size
+            }
+            if (more && tag.type == TAG_TYPE_SCRIPT) {
+                drop = i > 0;
+            } else if (more && IsFlvSequenceHeader(&tag)) {
+                int k = tag.type == TAG_TYPE_AUDIO;
+                drop = seq[k] != NULL && seq_len[k] == tag.data_size && memcmp(seq[k], tag.data, tag.data_size) == 0;
+                if (!drop) {
+                    byte *copy = (byte *) realloc(seq[k], tag.data_size);
+                    if (copy != NULL) {
+                        memcpy(copy, tag.data, tag.data_size);
+                        seq[k] = copy;
+                        seq_len[k] = tag.data_size;
+                    }
+                }
+            } else if (more && (tag.type == TAG_TYPE_AUDIO || tag.type == TAG_TYPE_VIDEO)) {
+                // 文件的结束时间 = 每一路最后一个时间戳 + 最后一个时间间隔
+                int k = tag.type == TAG_TYPE_AUDIO;
+                long long ts = (long long) tag.timestamp - base;
+                if (last_ts[k] >= 0 && ts > last_ts[k]) {
+                    last_gap[k] = ts - last_ts[k];
+                }
+                last_ts[k] = ts;
+                if (ts + last_gap[k] > end_ts) {
+                    end_ts = ts + last_gap[k];
+                }
+            }
+            if (!more || drop) {
+                if (tag_pos > run_start) {
+                    ret = CopyFileRange(in_fd, (long long) run_start, out_fd, &out_pos, (long long) (tag_pos - run_start));
+                }
+                run_start = pos;
+            }
+            if (!more) {
+                break;
+            }
+        }
+        regions[4 * i + 1] = out_pos;
+        next_start += end_ts;
+        close(in_fd);
+        UnmapFlvFile(&map);
+    }
+    if (fclose(ofh) != 0) {
+        ret = -1;
+    }
+
+    // 修改输出文件中的 Tag Header
+    FLV_MAP out;
+    if (ret == 0 && MapFlvFileEx(out_url, &out, 1) == 0) {
+        unsigned long changed = 0;
+        out.data[4] = flags;
+        for (int i = 0; i < count; i++) {
+            changed += RetimeFlvTags(out.data, out.size, (size_t) regions[4 * i], (size_t) regions[4 * i + 1],
+                                     regions[4 * i + 2], 1.0, regions[4 * i + 3]);
+        }
+        size_t pos = FlvFirstTagOffset(out.data, out.size);
+        FLV_TAG_VIEW tag;
+        AMF0_VIEW meta, v;
+        if (FlvNextTag(out.data, out.size, &pos, &tag) && tag.type == TAG_TYPE_SCRIPT &&
+            FlvOpenMetaData(tag.data, tag.data_size, &meta) == 0) {
+            if (Amf0ObjectGet(&meta, "duration", &v) == 0 && Amf0Type(&v) == AMF0_NUMBER && v.end - v.p >= 9) {
+                PutAmf0Number((byte *) v.p, next_start / 1000.0);
+            }
+            if (Amf0ObjectGet(&meta, "filesize", &v) == 0 && Amf0Type(&v) == AMF0_NUMBER && v.end - v.p >= 9) {
+                PutAmf0Number((byte *) v.p, (double) out.size);
+            }
+        }
+        if (UnmapFlvFile(&out) != 0) {
+            ret = -1;
+        } else {
+            printf("%d files, %.3f s, %lld bytes, %lu tag headers changed\n", count, next_start / 1000.0,
+                   (long long) out_pos, changed);
+        }
+    } else if (ret == 0) {
+        ret = -1;
+    }
+    if (ret != 0) {
+        printf("Write output file error\n");
+    }
+    free(seq[0]);
+    free(seq[1]);
+    free(regions);
+    return ret;
+}
+
+/* ====================== 完整性检查与修复 ======================
+ * 每个 Tag 后面的 Previous Tag Size 等于 11 + DataSize，所以 Tag 链可以从前往后走，也可以从文件末尾往回走：
+ *   正向：检查 Tag Header 是否合理、Tag 是否超出文件、Previous Tag Size 是否正确、音视频时间戳是否递增
+ *   反向：从最后的 Previous Tag Size 往回走，能一直走到第一个 Tag 说明文件尾部是完整的
+ * 遇到损坏的数据时向后查找“看起来像 Tag”的位置重新同步：Tag Header 合理、Previous Tag Size 正确，
+ * 并且紧接着的下一个 Tag Header 也合理（或者已经到了文件末尾）。
+ * 检查只访问 Tag Header 和 Previous Tag Size，开销与 Tag 的个数有关；修复时完好的连续 Tag 整块写出。
+ */
+
+typedef struct {
+    unsigned long tags;             //! 完好的 Tag 个数
+    unsigned long bad_prev_size;    //! Previous Tag Size 错误，但 Tag 本身完好
+    unsigned long corrupt;          //! 损坏的区域个数
+    unsigned long long skipped;     //! 损坏的区域一共跳过的字节数
+    unsigned long bad_timestamp;    //! 比同一路前一个 Tag 小的时间戳
+    long long first_error;          //! 第一个问题的位置，-1 表示没有
+    long long good_end;             //! 最后一个完好的 Tag（含 Previous Tag Size，缺少时不含）的结束位置
+    unsigned last_tag_size;         //! 最后一个完好的 Tag 的大小（11 + DataSize）
+    unsigned long long tail;        //! 文件末尾不完整的字节数
+    int missing_last_prev;          //! 最后一个 Tag 完整，只缺少 Previous Tag Size
+    unsigned long back_tags;        //! 反向能走过的 Tag 个数
+    long long back_stop;            //! 反向停下的位置
+} FLV_CHECK;
+
+static int FlvTagHeaderPlausible(const byte *h) {
+    // TagType 的保留位和 Filter 位为0，StreamID 总为0
+    return (h[0] == TAG_TYPE_AUDIO || h[0] == TAG_TYPE_VIDEO || h[0] == TAG_TYPE_SCRIPT) &&
+           h[8] == 0 && h[9] == 0 && h[10] == 0;
+}
+
+// 重新同步时使用的更严格的判断：整个 Tag 都在文件内，Previous Tag Size 正确，下一个 Tag Header 也合理
+static int FlvTagLooksValid(const byte *data, size_t size, size_t pos) {
+    if (pos + FLV_TAG_HEADER_SIZE + 4 > size || !FlvTagHeaderPlausible(data + pos)) {
+        return 0;
+    }
+    size_t data_size = reverse_bytes((byte *) data + pos + 1, 3);
+    size_t end = pos + FLV_TAG_HEADER_SIZE + data_size;
+    if (data_size == 0 || end + 4 > size || reverse_bytes((byte *) data + end, 4) != FLV_TAG_HEADER_SIZE + data_size) {
+        return 0;
+    }
+    end += 4;
+    return end + FLV_TAG_HEADER_SIZE > size || FlvTagHeaderPlausible(data + end);
+}
+
+static size_t FlvResync(const byte *data, size_t size, size_t pos) {
+    for (; pos + FLV_TAG_HEADER_SIZE + 4 <= size; pos++) {
+        // 先用 StreamID 的3个0字节快速排除
+        if (data[pos + 10] == 0 && data[pos + 9] == 0 && FlvTagLooksValid(data, size, pos)) {
+            return pos;
+        }
+    }
+    return size;
+}
+
+static void FlvCheckError(FLV_CHECK *c, size_t pos) {
+    if (c->first_error < 0) {
+        c->first_error = (long long) pos;
+    }
+}
+
+/**
+ * Walk the tag chain forwards (and backwards), optionally writing a repaired copy.
+ * @param w    Repaired output (FLV header and PreviousTagSize0 already written), NULL to only check.
+ */
+static void FlvCheckWalk(const byte *data, size_t size, size_t first, FLV_CHECK *c, FLV_WRITER *w) {
+    memset(c, 0, sizeof(FLV_CHECK));
+    c->first_error = -1;
+    long long last_ts[2] = {-1, -1};
+    size_t pos = first;
+    size_t run = first;                 // 还没有写出的完好 Tag 的开始位置
+    while (pos < size) {
+        const byte *h = data + pos;
+        size_t data_size = pos + FLV_TAG_HEADER_SIZE <= size ? reverse_bytes((byte *) h + 1, 3) : 0;
+        size_t end = pos + FLV_TAG_HEADER_SIZE + data_size;
+        int ok = pos + FLV_TAG_HEADER_SIZE <= size && FlvTagHeaderPlausible(h) && end <= size;
+        int fix_prev = 0;
+        if (ok && end + 4 <= size && reverse_bytes((byte *) data + end, 4) != FLV_TAG_HEADER_SIZE + data_size) {
+            // Previous Tag Size 不对：如果后面紧接着是一个合理的 Tag，只是这4个字节错了
+            size_t next = end + 4;
+            ok = next + FLV_TAG_HEADER_SIZE > size || FlvTagHeaderPlausible(data + next);
+            fix_prev = ok;
+        }
+        if (!ok) {
+            size_t next = FlvResync(data, size, pos + 1);
+            if (next == size) {
+                // 后面再也没有完整的 Tag：文件在这里被截断了
+                c->tail = size - pos;
+                FlvCheckError(c, pos);
+                break;
+            }
+            c->corrupt++;
+            c->skipped += next - pos;
+            FlvCheckError(c, pos);
+            if (w && pos > run) FlvWriterPut(w, data + run, pos - run);
+            pos = run = next;
+            continue;
+        }
+
+        // 时间戳：音频、视频各自不能变小（DTS），修复时改成同一路前一个 Tag 的时间戳
+        unsigned ts = reverse_bytes((byte *) h + 4, 3) | ((unsigned) h[7] << 24);
+        int k = h[0] == TAG_TYPE_AUDIO ? 0 : 1;
+        int fix_ts = 0;
+        if (h[0] != TAG_TYPE_SCRIPT) {
+            if ((long long) ts < last_ts[k]) {
+                c->bad_timestamp++;
+                FlvCheckError(c, pos);
+                fix_ts = 1;
+                ts = (unsigned) last_ts[k];
+            }
+            last_ts[k] = ts;
+        }
+        int missing_prev = end + 4 > size;
+        if (fix_prev) {
+            c->bad_prev_size++;
+            FlvCheckError(c, end);
+        }
+        if (missing_prev) {
+            c->missing_last_prev = 1;
+            c->tail = size - end;
+            FlvCheckError(c, end);
+        }
+        if (w && (fix_ts || fix_prev || missing_prev)) {
+            // 需要修改的 Tag 单独写出
+            if (pos > run) FlvWriterPut(w, data + run, pos - run);
+            byte header[FLV_TAG_HEADER_SIZE], prev[4];
+            memcpy(header, h, sizeof(header));
+            PutFlvTimestamp(header, ts);
+            PutBE32(prev, (unsigned) (FLV_TAG_HEADER_SIZE + data_size));
+            FlvWriterPut(w, header, sizeof(header));
+            FlvWriterPut(w, h + FLV_TAG_HEADER_SIZE, data_size);
+            FlvWriterPut(w, prev, sizeof(prev));
+            run = missing_prev ? size : end + 4;
+        }
+        c->tags++;
+        c->good_end = (long long) (missing_prev ? end : end + 4);
+        c->last_tag_size = (unsigned) (FLV_TAG_HEADER_SIZE + data_size);
+        pos = missing_prev ? size : end + 4;
+    }
+    if (c->good_end == 0) {
+        c->good_end = (long long) first;
+    }
+    if (w && (size_t) c->good_end > run && !c->missing_last_prev) {
+        FlvWriterPut(w, data + run, (size_t) c->good_end - run);
+    }
+
+    // 反向：从文件末尾的 Previous Tag Size 往回走
+    size_t p = size;
+    while (p >= first + 4 + FLV_TAG_HEADER_SIZE) {
+        size_t prev = reverse_bytes((byte *) data + p - 4, 4);
+        if (prev < FLV_TAG_HEADER_SIZE || prev > p - 4 - first) {
+            break;
+        }
+        size_t t = p - 4 - prev;
+        if (!FlvTagHeaderPlausible(data + t) || reverse_bytes((byte *) data + t + 1, 3) != prev - FLV_TAG_HEADER_SIZE) {
+            break;
+        }
+        c->back_tags++;
+        p = t;
+    }
+    c->back_stop = (long long) p;
+}
+
+/**
+ * Check the tag chain of an FLV file and optionally repair it.
+ * @param out_url    NULL: only check. Same as url: fix a damaged tail in place (truncate the file).
+ *                   Otherwise: write a repaired copy (corrupt regions dropped, tags and sizes rewritten).
+ * @return 0 if the file is intact (or was repaired), 1 if problems were found, -1 on failure.
+ */
+int FlvCheck(const char *url, const char *out_url) {
+    FLV_MAP map;
+    if (MapFlvFile(url, &map) != 0) {
+        printf("Failed to open files!\n");
+        return -1;
+    }
+#ifndef _WIN32
+    if (map.mapped) {
+        madvise(map.data, map.size, MADV_SEQUENTIAL);
+    }
+#endif
+    size_t first = FlvFirstTagOffset(map.data, map.size);
+    if (first == 0) {
+        printf("Not a FLV file\n");
+        UnmapFlvFile(&map);
+        return -1;
+    }
+    int in_place = out_url != NULL && strcmp(out_url, url) == 0;
+    FLV_WRITER w;
+    FLV_WRITER *wp = NULL;
+    if (out_url != NULL && !in_place) {
+        if (FlvWriterOpen(&w, out_url) != 0) {
+            printf("Failed to open files!\n");
+            UnmapFlvFile(&map);
+            return -1;
+        }
+        FlvWriterPut(&w, map.data, first);
+        wp = &w;
+    }
+    FLV_CHECK c;
+    FlvCheckWalk(map.data, map.size, first, &c, wp);
+
+    printf("tags:                  %lu\n", c.tags);
+    if (c.corrupt > 0) {
+        printf("corrupt regions:       %lu (%llu bytes skipped)\n", c.corrupt, c.skipped);
+    }
+    if (c.bad_prev_size > 0) {
+        printf("bad PreviousTagSize:   %lu\n", c.bad_prev_size);
+    }
+    if (c.bad_timestamp > 0) {
+        printf("decreasing timestamps: %lu\n", c.bad_timestamp);
+    }
+    if (c.tail > 0 || c.missing_last_prev) {
+        printf("truncated:             %llu bytes at the end%s\n", c.tail,
+               c.missing_last_prev ? " (last PreviousTagSize missing)" : "");
+    }
+    printf("backward chain:        %lu tags%s", c.back_tags, (size_t) c.back_stop == first ? "\n" : "");
+    if ((size_t) c.back_stop != first) {
+        printf(", stops at offset %lld\n", c.back_stop);
+    }
+    int damaged = c.first_error >= 0;
+    if (damaged) {
+        printf("first problem at offset %lld\n", c.first_error);
+    }
+
+    int ret = damaged ? 1 : 0;
+    if (wp != NULL) {
+        unsigned long long written = w.bytes;
+        ret = FlvWriterClose(&w) == 0 ? 0 : -1;
+        if (ret == 0) {
+            printf("repaired: %llu bytes written\n", written);
+        }
+    } else if (in_place && damaged) {
+        // 只有文件尾部有问题时才能直接修改：截断到最后一个完好的 Tag，缺少的 Previous Tag Size 补上
+        if (c.corrupt > 0 || c.bad_prev_size > 0 || c.bad_timestamp > 0) {
+            printf("the file is damaged before the end, write a repaired copy instead\n");
+            ret = -1;
+        } else {
+            long long good_end = c.good_end;
+            byte prev[4];
+            PutBE32(prev, c.last_tag_size);
+            UnmapFlvFile(&map);
+            FILE *fp = fopen(url, "r+b");
+            ret = -1;
+            if (fp != NULL) {
+#ifdef _WIN32
+                int t = _chsize_s(_fileno(fp), good_end);
+#else
+                int t = ftruncate(fileno(fp), (off_t) good_end);
+#endif
+                if (t == 0 && (!c.missing_last_prev ||
+                               (FLV_FSEEK(fp, good_end, SEEK_SET) == 0 && fwrite(prev, 1, 4, fp) == 4))) {
+                    ret = 0;
+                }
+                if (fclose(fp) != 0) {
+                    ret = -1;
+                }
+            }
+            printf(ret == 0 ? "repaired in place\n" : "Write output file error\n");
+            return ret;
+        }
+    }
+    UnmapFlvFile(&map);
+    return ret;
+}
+
+/* ====================== 直播流的增量解析（HTTP-FLV / RTMP 录制） ======================
+ * FLV_STREAM_PARSER 是一个推模式的状态机：调用者把从管道或者 socket 收到的数据按任意大小写进来，
+ * 然后读出 FLV Header 和 Tag 事件，整个过程不需要 seek，内存占用只有一块固定大小的缓冲区。
+ * Tag Data 可以分成多段读出（FLV_STREAM_FIRST/LAST）：Tag 比缓冲区大时一定会分段；
+ * 打开 partial 以后，已经收到的 Tag Data 马上就能读出，不需要等整个 Tag 到齐。
+ */
+
+#ifndef FLV_STREAM_BUFFER_SIZE
+#define FLV_STREAM_BUFFER_SIZE      (1 << 20)
+#endif
+
+#define FLV_STREAM_EVENT_HEADER     1       // data 是 9 字节的 FLV Header
+#define FLV_STREAM_EVENT_TAG        2       // data 是 Tag Data（或者其中的一段）
+
+#define FLV_STREAM_FIRST            0x01    // Tag Data 的第一段
+#define FLV_STREAM_LAST             0x02    // Tag Data 的最后一段；完整的 Tag 两个标志都有
+#define FLV_STREAM_TRUNCATED        0x04    // 输入在 Tag 结束之前就结束了
+
+enum {
+    FLV_STREAM_STATE_HEADER,        // 等待 FLV Header
+    FLV_STREAM_STATE_SKIP,          // 跳过 FLV Header 之后多出来的字节（DataOffset > 9）
+    FLV_STREAM_STATE_TAG,           // 等待 Previous Tag Size + Tag Header
+    FLV_STREAM_STATE_DATA           // 读出 Tag Data
+};
+
+typedef struct {
+    int event;                    //! FLV_STREAM_EVENT_*
+    TAG_HEADER tagheader;         //! 原始的 Tag Header
+    int tag_type;
+    unsigned data_size;           //! 整个 Tag Data 的大小
+    unsigned timestamp;           //! 已经合并了扩展时间戳
+    unsigned prev_tag_size;       //! Tag 前面的 Previous Tag Size
+    const byte *data;             //! 数据（或者其中的一段），在下一次 FlvStreamWrite 之前有效
+    size_t length;                //! data 的长度
+    unsigned long long offset;    //! data 在整个流中的位置
+    unsigned long long tag_offset;//! Tag Header 在整个流中的位置
+    int flags;                    //! FLV_STREAM_*
+} FLV_STREAM_EVENT;
+
+typedef struct {
+    byte *buf;
+    size_t capacity;
+    size_t begin;                 //! 还没有处理的数据的开始位置
+    size_t end;                   //! 有效数据的结束位置
+    int state;                    //! FLV_STREAM_STATE_*
+    int partial;                  //! 1：收到多少 Tag Data 就读出多少
+    int eof;                      //! 输入已经结束
+    unsigned long long consumed;  //! 已经从缓冲区移出的字节数
+    unsigned long long skip;      //! SKIP 状态还要跳过的字节数
+    unsigned remain;              //! 当前 Tag 还没有读出的 Tag Data 字节数
+    FLV_STREAM_EVENT tag;         //! 当前 Tag 的信息
+} FLV_STREAM_PARSER;
+
+/**
+ * Init the streaming parser.
+ * @param capacity    Buffer size, 0 means FLV_STREAM_BUFFER_SIZE.
+ * @param partial     1: Tag Data is returned as soon as it arrives (lower latency, more fragments).
+ * @return 0 on success, -1 on failure.
+ */
+int FlvStreamInit(FLV_STREAM_PARSER *sp, size_t capacity, int partial) {
+    memset(sp, 0, sizeof(FLV_STREAM_PARSER));
+    // 至少要能放下 Previous Tag Size 和 Tag Header
+    sp->capacity = capacity > 16 ? capacity : (capacity == 0 ? FLV_STREAM_BUFFER_SIZE : 16);
+    sp->partial = partial;
+    sp->state = FLV_STREAM_STATE_HEADER;
+    sp->buf = (byte *) malloc(sp->capacity);
+    return sp->buf ? 0 : -1;
+}
+
+void FlvStreamClose(FLV_STREAM_PARSER *sp) {
+    free(sp->buf);
+    memset(sp, 0, sizeof(FLV_STREAM_PARSER));
+}
+
+/**
+ * Write bytes into the parser.
+ * @return Number of bytes accepted (may be less than len when the buffer is full,
+ *         read events with FlvStreamRead and write the rest again).
+ */
+size_t FlvStreamWrite(FLV_STREAM_PARSER *sp, const byte *data, size_t len) {
+    if (sp->end == sp->capacity && sp->begin > 0) {
+        // 缓冲区写满了：把还没有处理的数据移到最前面
+        memmove(sp->buf, sp->buf + sp->begin, sp->end - sp->begin);
+        sp->consumed += sp->begin;
+        sp->end -= sp->begin;
+        sp->begin = 0;
+    }
+    size_t n = sp->capacity - sp->end;
+    if (n > len) {
+        n = len;
+    }
+    memcpy(sp->buf + sp->end, data, n);
+    sp->end += n;
+    return n;
+}
+
+/**
+ * Mark the end of the input, a truncated last tag can be read after this.
+ */
+void FlvStreamEnd(FLV_STREAM_PARSER *sp) {
+    sp->eof = 1;
+}
+
+/**
+ * Read the next event from the parser.
+ * @return 1 if event was filled, 0 if more input is needed (or the stream has ended),
+ *         -1 if the input is not an FLV stream.
+ */
+int FlvStreamRead(FLV_STREAM_PARSER *sp, FLV_STREAM_EVENT *event) {
+    while (1) {
+        size_t avail = sp->end - sp->begin;
+        const byte *p = sp->buf + sp->begin;
+        switch (sp->state) {
+            case FLV_STREAM_STATE_HEADER: {
+                if (avail < sizeof(FLV_HEADER)) {
+                    return 0;
+                }
+                unsigned header_size = reverse_bytes((byte *) p + 5, 4);
+                if (p[0] != 'F' || p[1] != 'L' || p[2] != 'V' || header_size < sizeof(FLV_HEADER)) {
+                    return -1;
+                }
+                memset(event, 0, sizeof(FLV_STREAM_EVENT));
+                event->event = FLV_STREAM_EVENT_HEADER;
+                event->data = p;
+                event->length = sizeof(FLV_HEADER);
+                event->offset = sp->consumed + sp->begin;
+                event->flags = FLV_STREAM_FIRST | FLV_STREAM_LAST;
+                sp->begin += sizeof(FLV_HEADER);
+                sp->skip = header_size - sizeof(FLV_HEADER);
+                sp->state = FLV_STREAM_STATE_SKIP;
+                return 1;
+            }
+            case FLV_STREAM_STATE_SKIP: {
+                size_t n = sp->skip < avail ? (size_t) sp->skip : avail;
+                sp->begin += n;
+                sp->skip -= n;
+                if (sp->skip > 0) {
+                    return 0;
+                }
+                sp->state = FLV_STREAM_STATE_TAG;
+                break;
+            }
+            case FLV_STREAM_STATE_TAG: {
+                // Previous Tag Size（4字节） + Tag Header（11字节）；流结束时不完整的 Tag Header 直接丢弃
+                if (avail < 4 + FLV_TAG_HEADER_SIZE) {
+                    return 0;
+                }
+                FLV_STREAM_EVENT *tag = &sp->tag;
+                memset(tag, 0, sizeof(FLV_STREAM_EVENT));
+                tag->event = FLV_STREAM_EVENT_TAG;
+                tag->prev_tag_size = reverse_bytes((byte *) p, 4);
+                memcpy(&tag->tagheader, p + 4, FLV_TAG_HEADER_SIZE);
+                tag->tag_type = p[4];
+                tag->data_size = (p[5] << 16) | (p[6] << 8) | p[7];
+                tag->timestamp = ((unsigned) p[11] << 24) | (p[8] << 16) | (p[9] << 8) | p[10];
+                tag->tag_offset = sp->consumed + sp->begin + 4;
+                tag->flags = FLV_STREAM_FIRST;
+                sp->begin += 4 + FLV_TAG_HEADER_SIZE;
+                sp->remain = tag->data_size;
+                sp->state = FLV_STREAM_STATE_DATA;
+                break;
+            }
+            case FLV_STREAM_STATE_DATA: {
+                size_t n = sp->remain < avail ? sp->remain : avail;
+                int complete = n == sp->remain;
+                // 一段 Tag Data 可以读出的条件：Tag 已经完整，或者缓冲区已经被这个 Tag 占满，
+                // 或者输入已经结束，或者打开了 partial 并且有新数据
+                if (!complete && !sp->eof && !(sp->begin == 0 && sp->end == sp->capacity) &&
+                    !(sp->partial && n > 0)) {
+                    return 0;
+                }
+                *event = sp->tag;
+                event->data = p;
+                event->length = n;
+                event->offset = sp->consumed + sp->begin;
+                if (complete) {
+                    event->flags |= FLV_STREAM_LAST;
+                    sp->state = FLV_STREAM_STATE_TAG;
+                } else if (sp->eof) {
+                    event->flags |= FLV_STREAM_LAST | FLV_STREAM_TRUNCATED;
+                    sp->state = FLV_STREAM_STATE_TAG;
+                }
+                sp->begin += n;
+                sp->remain -= (unsigned) n;
+                sp->tag.flags = 0;
+                return 1;
+            }
+        }
+    }
+}
+
+/**
+ * Analysis FLV stream from a pipe or file without seeking (live HTTP-FLV or RTMP dumps).
+ * 输出与 simplest_flv_parser 相同的 Tag 列表，每个 Tag 的数据一到齐就输出
+ * @param url    Location of input FLV stream, "-" means stdin.
+ */
+int simplest_flv_parser_stream(char *url) {
+    FILE *myout = stdout;
+
+    FILE *ifile = strcmp(url, "-") == 0 ? stdin : fopen(url, "rb");
+    if (ifile == NULL) {
+        printf("Failed to open files!");
+        return -1;
+    }
+    FLV_STREAM_PARSER sp;
+    if (FlvStreamInit(&sp, 0, 1) != 0) {
+        printf("Alloc stream parser error\n");
+        if (ifile != stdin) fclose(ifile);
+        return -1;
+    }
+    int ifd = fileno(ifile);
+
+    byte chunk[64 * 1024];
+    FLV_STREAM_EVENT ev;
+    byte *script_buf = NULL;      // Script Tag 的数据，需要完整的数据才能解析
+    size_t script_len = 0;
+    char info[100] = {0};
+    int ret = 0;
+
+    while (ret == 0) {
+        // 用 read 而不是 fread：管道里有多少数据就处理多少，不会等缓冲区填满
+        long n = (long) read(ifd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            n = 0;
+            FlvStreamEnd(&sp);
+        }
+        size_t done = 0;
+        do {
+            done += FlvStreamWrite(&sp, chunk + done, (size_t) n - done);
+            int r;
+            while ((r = FlvStreamRead(&sp, &ev)) > 0) {
+                if (ev.event == FLV_STREAM_EVENT_HEADER) {
+                    FLV_HEADER flv;
+                    memcpy(&flv, ev.data, sizeof(FLV_HEADER));
+                    fprintf(myout,"============== FLV Header ==============\n");
+                    fprintf(myout,"Signature:  0x %c %c %c\n",flv.Signature[0],flv.Signature[1],flv.Signature[2]);
+                    fprintf(myout,"Version:    0x %X\n",flv.Version);
+                    fprintf(myout,"Flags  :    0x %X\n",flv.Flags);
+                    fprintf(myout,"HeaderSize: 0x %X\n",reverse_bytes((byte *)&flv.DataOffset, sizeof(flv.DataOffset)));
+                    fprintf(myout,"========================================\n");
+                    continue;
+                }
+                // 音频/视频只需要 Tag Data 的第一个字节，Script 要把所有分段拼起来
+                if (ev.flags & FLV_STREAM_FIRST) {
+                    info[0] = 0;
+                    script_len = 0;
+                    if (ev.tag_type == TAG_TYPE_SCRIPT) {
+                        free(script_buf);
+                        script_buf = (byte *) malloc(ev.data_size > 0 ? ev.data_size : 1);
+                    }
+                    if (ev.length > 0 && ev.tag_type == TAG_TYPE_AUDIO) {
+                        FormatFlvAudioInfo((char) ev.data[0], info);
+                    } else if (ev.length > 0 && ev.tag_type == TAG_TYPE_VIDEO) {
+                        FormatFlvVideoInfo((char) ev.data[0], info);
+                    }
+                }
+                if (ev.tag_type == TAG_TYPE_SCRIPT && script_buf != NULL) {
+                    memcpy(script_buf + script_len, ev.data, ev.length);
+                    script_len += ev.length;
+                }
+                if (!(ev.flags & FLV_STREAM_LAST)) {
+                    continue;
+                }
+                const char *type_str = ev.tag_type == TAG_TYPE_AUDIO ? "AUDIO" :
+                                       ev.tag_type == TAG_TYPE_VIDEO ? "VIDEO" :
+                                       ev.tag_type == TAG_TYPE_SCRIPT ? "SCRIPT" : "UNKNOWN";
+                fprintf(myout,"[%6s] %6d %6d %6d |",type_str,ev.data_size,ev.timestamp & 0xFFFFFF,ev.prev_tag_size);
+                // 流在 Tag 中间结束时与 simplest_flv_parser 一样：仍然输出这一行，但不解析不完整的 Script
+                if (ev.tag_type == TAG_TYPE_SCRIPT && script_buf != NULL && !(ev.flags & FLV_STREAM_TRUNCATED)) {
+                    FormatFlvScriptInfo(script_buf, script_len, info, sizeof(info));
+                }
+                fprintf(myout,"%s\n",info);
+            }
+            if (r < 0) {
+                printf("Not an FLV stream\n");
+                ret = -1;
+                break;
+            }
+        } while (done < (size_t) n);
+        if (n == 0) {
+            break;
+        }
+    }
+
+    free(script_buf);
+    FlvStreamClose(&sp);
+    if (ifile != stdin) {
+        fclose(ifile);
+    }
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    // 用法：flv [file.flv]，默认解析 cuc_ieschool.flv，分离出 output.flv/output.mp3
+    //       flv -keyframes in.flv out.flv
+    //       flv -meta [file.flv]
+    //       flv -demux in.flv out.h264 out.aac
+    //       flv -stream [file.flv|-]
+    //       flv -retime file.flv offset [scale]，flv -rebase file.flv [offset] [scale]（直接修改文件）
+    //       flv -concat out.flv in1.flv in2.flv ...
+    //       flv -check file.flv [out.flv]，out.flv 与 file.flv 相同时直接截断损坏的尾部
+    //       flv -mux in.h264 in.aac out.flv [fps]，没有视频或音频时用 - 代替
+    if (argc > 4 && strcmp(argv[1], "-demux") == 0) {
+        return FlvExtractStreams(argv[2], argv[3], argv[4]) == 0 ? 0 : 1;
+    }
+    if (argc > 1 && strcmp(argv[1], "-meta") == 0) {
+        return simplest_flv_metadata(argc > 2 ? argv[2] : (char *) "cuc_ieschool.flv") == 0 ? 0 : 1;
+    }
+    if (argc > 3 && strcmp(argv[1], "-keyframes") == 0) {
+        return FlvInjectKeyframes(argv[2], argv[3]) == 0 ? 0 : 1;
+    }
+    if (argc > 4 && strcmp(argv[1], "-mux") == 0) {
+        const char *video_url = strcmp(argv[2], "-") == 0 ? NULL : argv[2];
+        const char *audio_url = strcmp(argv[3], "-") == 0 ? NULL : argv[3];
+        return FlvMuxStreams(video_url, audio_url, argv[4], argc > 5 ? atof(argv[5]) : 0) == 0 ? 0 : 1;
+    }
+    if (argc > 2 && (strcmp(argv[1], "-retime") == 0 || strcmp(argv[1], "-rebase") == 0)) {
+        int rebase = strcmp(argv[1], "-rebase") == 0;
+        long long offset = argc > 3 ? atoll(argv[3]) : 0;
+        double scale = argc > 4 ? atof(argv[4]) : 1.0;
+        return FlvRetimeInPlace(argv[2], offset, scale, rebase) == 0 ? 0 : 1;
+    }
+    if (argc > 3 && strcmp(argv[1], "-concat") == 0) {
+        return FlvConcat(argv[2], argv + 3, argc - 3) == 0 ? 0 : 1;
+    }
+    if (argc > 2 && strcmp(argv[1], "-check") == 0) {
+        int ret = FlvCheck(argv[2], argc > 3 ? argv[3] : NULL);
+        return ret < 0 ? 2 : ret;
+    }
+    if (argc > 1 && strcmp(argv[1], "-stream") == 0) {
+        return simplest_flv_parser_stream(argc > 2 ? argv[2] : (char *) "-") == 0 ? 0 : 1;
+    }
+    return simplest_flv_parser(argc > 1 ? argv[1] : (char *) "cuc_ieschool.flv") == 0 ? 0 : 1;
 }
\ No newline at end of file
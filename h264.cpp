@@ -28,6 +28,50 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+// Windows 没有 writev，用 _write 逐段写出
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+#define IOV_MAX 1024
+static long writev(int fd, const struct iovec *iov, int iovcnt) {
+    long total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        int n = _write(fd, iov[i].iov_base, (unsigned) iov[i].iov_len);
+        if (n < 0) {
+            return total > 0 ? total : -1;
+        }
+        total += n;
+        if ((size_t) n < iov[i].iov_len) {
+            break;
+        }
+    }
+    return total;
+}
+#endif
+#include <sys/stat.h>
+
+// x86 平台上使用 SSE2/AVX2 加速起始码的查找
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define H264_X86_SIMD 1
+#endif
 
 // 1～12由H.264使⽤，24～31由H.264以外的应⽤
 typedef enum {
@@ -66,224 +110,2845 @@ typedef struct {
 
 FILE *h264bitstream = NULL;                // 文件流
 
-int info2 = 0, info3 = 0;
+/* ====================== 内存映射 + 向量化起始码查找 ======================
+ * GetAnnexbNALU 每次只用 fgetc 读取一个字节，然后再 fseek 回退，对于几个GB的码流非常慢。
+ * 下面的实现先把整个文件映射到内存中，然后在内存中直接查找 00 00 01 / 00 00 00 01 起始码，
+ * 查找过程使用 SSE2/AVX2 每次比较 16/32 个字节，同时保留一个标量版本作为后备。
+ */
+
+typedef struct {
+    unsigned char *data;          //! 文件数据（映射的内存，或者读入的内存）
+    size_t size;                  //! 文件大小
+    int mapped;                   //! 1：data 由 mmap 得到；0：data 由 malloc 得到
+} H264_MAP;
+
+/**
+ * Map the whole H.264 file into memory.
+ * @param url         Location of input H.264 bitstream file.
+ * @param map         Output mapping.
+ * @param writable    1: the mapping can be modified in place (copy-on-write, the file is never changed).
+ * @return 0 on success, -1 on failure.
+ */
+int MapH264FileEx(const char *url, H264_MAP *map, int writable) {
+    memset(map, 0, sizeof(H264_MAP));
+#ifndef _WIN32
+    int fd = open(url, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    map->size = (size_t) st.st_size;
+    // 空文件无法 mmap，直接返回空的映射
+    if (map->size == 0) {
+        close(fd);
+        return 0;
+    }
+    // MAP_PRIVATE：修改只作用于本进程的副本（只有被修改的页才会被复制）
+    void *addr = mmap(NULL, map->size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, fd, 0);
+    // 映射之后文件描述符就可以关闭了，映射依然有效
+    close(fd);
+    if (addr != MAP_FAILED) {
+        // 告诉内核我们是顺序访问的，让它尽量提前预读
+        madvise(addr, map->size, MADV_SEQUENTIAL);
+        map->data = (unsigned char *) addr;
+        map->mapped = 1;
+        return 0;
+    }
+#endif
+    // 不支持 mmap（或者 mmap 失败）的时候，退化为一次性读入内存
+    FILE *fp = fopen(url, "rb");
+    if (fp == NULL) {
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    map->size = (size_t) ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    map->data = (unsigned char *) malloc(map->size > 0 ? map->size : 1);
+    if (map->data == NULL || fread(map->data, 1, map->size, fp) != map->size) {
+        free(map->data);
+        map->data = NULL;
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    return 0;
+}
 
-static int FindStartCode2(unsigned char *Buf) {
-    if (Buf[0] != 0 || Buf[1] != 0 || Buf[2] != 1) return 0; //0x000001?
-    else return 1;
+int MapH264File(const char *url, H264_MAP *map) {
+    return MapH264FileEx(url, map, 0);
 }
 
-static int FindStartCode3(unsigned char *Buf) {
-    if (Buf[0] != 0 || Buf[1] != 0 || Buf[2] != 0 || Buf[3] != 1) return 0;//0x00000001?
-    else return 1;
+void UnmapH264File(H264_MAP *map) {
+    if (map->data != NULL) {
+#ifndef _WIN32
+        if (map->mapped) {
+            munmap(map->data, map->size);
+        } else
+#endif
+        {
+            free(map->data);
+        }
+    }
+    memset(map, 0, sizeof(H264_MAP));
 }
 
+// 下面的查找函数都是查找 00 00 xx，xx 为 0x01 时是起始码，为 0x03 时是防竞争字节（emulation prevention）
 
-int GetAnnexbNALU(NALU_t *nalu) {
-    // 已读取的字节长度
-    int pos = 0;
-    int StartCodeFound, rewind;
-    unsigned char *Buf;
-
-    // 分配 nalu中设置的最大缓冲区大小的内存空间
-    if ((Buf = (unsigned char *) calloc(nalu->max_size, sizeof(char))) == NULL)
-        printf("GetAnnexbNALU: Could not allocate Buf memory\n");
-
-    // 初始化起始码长度 (假设为3字节)
-    nalu->startcodeprefix_len = 3;
-
-    // fread() 方法如果成功会返回 读取的字节数，否则则代表失败
-    // 此时已经从.h264文件中读取了三个字节到Buf缓冲区中
-    if (3 != fread(Buf, 1, 3, h264bitstream)) {
-        free(Buf);
+// 标量版本：先用 memchr 找 xx（libc 里的 memchr 本身就是向量化的），再回头检查前面两个字节是不是 00 00
+static const unsigned char *FindZeroZeroScalar(const unsigned char *p, const unsigned char *end, unsigned char xx) {
+    if (end - p < 3) {
+        return end;
+    }
+    const unsigned char *q = p + 2;
+    while (q < end) {
+        q = (const unsigned char *) memchr(q, xx, end - q);
+        if (q == NULL) {
+            return end;
+        }
+        if (q[-1] == 0 && q[-2] == 0) {
+            return q - 2;
+        }
+        q++;
+    }
+    return end;
+}
+
+#ifdef H264_X86_SIMD
+// SSE2 版本：一次比较16个位置，分别加载 p、p+1、p+2 三个向量，三个条件同时满足的位置就是要找的位置
+static const unsigned char *FindZeroZeroSSE2(const unsigned char *p, const unsigned char *end, unsigned char xx) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i last = _mm_set1_epi8((char) xx);
+    while (end - p >= 16 + 2) {
+        __m128i a = _mm_loadu_si128((const __m128i *) p);
+        __m128i b = _mm_loadu_si128((const __m128i *) (p + 1));
+        __m128i c = _mm_loadu_si128((const __m128i *) (p + 2));
+        __m128i m = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(a, zero), _mm_cmpeq_epi8(b, zero)),
+                                  _mm_cmpeq_epi8(c, last));
+        int mask = _mm_movemask_epi8(m);
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+    return FindZeroZeroScalar(p, end, xx);
+}
+
+// AVX2 版本：与 SSE2 相同，一次比较32个位置
+__attribute__((target("avx2")))
+static const unsigned char *FindZeroZeroAVX2(const unsigned char *p, const unsigned char *end, unsigned char xx) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i last = _mm256_set1_epi8((char) xx);
+    while (end - p >= 32 + 2) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) p);
+        __m256i b = _mm256_loadu_si256((const __m256i *) (p + 1));
+        __m256i c = _mm256_loadu_si256((const __m256i *) (p + 2));
+        __m256i m = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(a, zero), _mm256_cmpeq_epi8(b, zero)),
+                                     _mm256_cmpeq_epi8(c, last));
+        unsigned mask = (unsigned) _mm256_movemask_epi8(m);
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+    return FindZeroZeroSSE2(p, end, xx);
+}
+#endif
+
+typedef const unsigned char *(*FindZeroZeroFunc)(const unsigned char *p, const unsigned char *end, unsigned char xx);
+
+// 运行时根据 CPU 选择实现。可以用环境变量 H264_SIMD=scalar/sse2/avx2 强制指定（用于对比测试）
+static FindZeroZeroFunc SelectFindZeroZero() {
+    const char *force = getenv("H264_SIMD");
+#ifdef H264_X86_SIMD
+    if (force == NULL || strcmp(force, "avx2") == 0) {
+        if (__builtin_cpu_supports("avx2")) {
+            return FindZeroZeroAVX2;
+        }
+    }
+    if (force == NULL || strcmp(force, "scalar") != 0) {
+        return FindZeroZeroSSE2;
+    }
+#endif
+    (void) force;
+    return FindZeroZeroScalar;
+}
+
+static FindZeroZeroFunc FindZeroZero = SelectFindZeroZero();
+
+/**
+ * Find the first 00 00 01 in [p, end).
+ * @return Pointer to the first zero byte of the start code, or end if not found.
+ */
+const unsigned char *FindStartCode(const unsigned char *p, const unsigned char *end) {
+    return FindZeroZero(p, end, 0x01);
+}
+
+/**
+ * 从 pos 开始在内存中定位下一个NALU，切分规则与 GetAnnexbNALU 完全一致：
+ * 如果下一个 00 00 01 前面还有一个 00，则它属于下一个NALU的4字节起始码。
+ * @param nal_start   NALU 起始位置（不含起始码）
+ * @param nal_end     NALU 结束位置（不含下一个起始码）
+ * @param prefix_len  起始码长度，3 或者 4
+ * @return 1 找到了NALU；0 没有更多的NALU
+ */
+int ScanAnnexbNALU(const unsigned char *data, size_t size, size_t pos,
+                   size_t *nal_start, size_t *nal_end, int *prefix_len) {
+    const unsigned char *end = data + size;
+    const unsigned char *sc = FindStartCode(data + pos, end);
+    if (sc == end) {
+        return 0;
+    }
+    *prefix_len = (sc > data + pos && sc[-1] == 0) ? 4 : 3;
+    *nal_start = (size_t) (sc + 3 - data);
+
+    const unsigned char *next = FindStartCode(sc + 3, end);
+    if (next == end) {
+        // 最后一个NALU一直延伸到文件末尾
+        *nal_end = size;
+    } else {
+        // 00 00 00 01 的第一个 00 属于下一个起始码
+        *nal_end = (size_t) (next - data) - (next[-1] == 0 ? 1 : 0);
+    }
+    return 1;
+}
+
+/* NALU 类型对应的字符串 */
+static const char *NaluTypeString(int nal_unit_type) {
+    switch (nal_unit_type) {
+        case NALU_TYPE_SLICE:
+            return "SLICE";
+        case NALU_TYPE_DPA:
+            return "DPA";
+        case NALU_TYPE_DPB:
+            return "DPB";
+        case NALU_TYPE_DPC:
+            return "DPC";
+        case NALU_TYPE_IDR:
+            return "IDR";
+        case NALU_TYPE_SEI:
+            return "SEI";
+        case NALU_TYPE_SPS:
+            return "SPS";
+        case NALU_TYPE_PPS:
+            return "PPS";
+        case NALU_TYPE_AUD:
+            return "AUD";
+        case NALU_TYPE_EOSEQ:
+            return "EOSEQ";
+        case NALU_TYPE_EOSTREAM:
+            return "EOSTREAM";
+        case NALU_TYPE_FILL:
+            return "FILL";
+        default:
+            return "";
+    }
+}
+
+/* nal_ref_idc（已经右移5位）对应的字符串 */
+static const char *NaluIdcString(int idc) {
+    switch (idc) {
+        case NALU_PRIORITY_DISPOSABLE:
+            return "DISPOS";
+        case NALU_PRIRITY_LOW:
+            return "LOW";
+        case NALU_PRIORITY_HIGH:
+            return "HIGH";
+        case NALU_PRIORITY_HIGHEST:
+            return "HIGHEST";
+        default:
+            return "";
+    }
+}
+
+/* ====================== 零拷贝的 NALU 迭代器 ======================
+ * GetAnnexbNALU 每次调用都要 calloc 一块 max_size 大小的临时缓冲区，再 memcpy 到 NALU_t::buf，
+ * 并且超过 max_size 的NALU（例如4K的IDR帧）会放不下。
+ * NALU_VIEW 只记录NALU在输入缓冲区中的位置，数据本身直接指向共享的输入缓冲区（一般是映射的文件），
+ * 迭代过程中没有任何堆内存分配，也没有长度限制。
+ */
+
+typedef struct {
+    size_t offset;                //! NALU 在输入缓冲区中的偏移（不包括起始码）
+    size_t length;                //! NALU 的长度（不包括起始码）
+    int startcodeprefix_len;      //! 起始码前缀的长度，3 或者 4
+    unsigned char header;         //! NALU 的第一个字节（禁止位：1位，优先级：2位，类型：5位）
+} NALU_VIEW;
+
+typedef struct {
+    const unsigned char *data;    //! 共享的输入缓冲区
+    size_t size;                  //! 输入缓冲区大小
+    size_t pos;                   //! 下一次查找的起始位置
+} NALU_ITER;
+
+#define NALU_VIEW_TYPE(v)   ((v)->header & 0x1f)           // nal_unit_type
+#define NALU_VIEW_IDC(v)    (((v)->header & 0x60) >> 5)    // nal_ref_idc（已右移）
+#define NALU_VIEW_POS(v)    ((v)->offset - (v)->startcodeprefix_len)   // 起始码所在位置
+
+void NaluIterInit(NALU_ITER *it, const unsigned char *data, size_t size) {
+    it->data = data;
+    it->size = size;
+    it->pos = 0;
+}
+
+/**
+ * Get next NALU view.
+ * @param it      Iterator.
+ * @param view    Output view, points into it->data.
+ * @return 1 if a NALU was returned, 0 at the end of the buffer.
+ */
+int NaluIterNext(NALU_ITER *it, NALU_VIEW *view) {
+    size_t nal_start, nal_end;
+    int prefix_len;
+    if (!ScanAnnexbNALU(it->data, it->size, it->pos, &nal_start, &nal_end, &prefix_len)) {
+        it->pos = it->size;
         return 0;
     }
-    // 判断起始码 是否是  3字节  0x000001?
-    info2 = FindStartCode2(Buf);
-    if (info2 != 1) {  // 如果不是3字节， 就再从文件中读取一个字节
-        if (1 != fread(Buf + 3, 1, 1, h264bitstream)) {
-            free(Buf);
+    view->offset = nal_start;
+    view->length = nal_end - nal_start;
+    view->startcodeprefix_len = prefix_len;
+    view->header = view->length > 0 ? it->data[nal_start] : 0;
+    it->pos = nal_end;
+    return 1;
+}
+
+/* ====================== 流式（管道/标准输入）解析 ======================
+ * 原来的 GetAnnexbNALU 依赖 fseek 回退，不能用于管道或者编码器的实时输出。
+ * H264_STREAM_PARSER 使用一块固定大小的缓冲区：调用者可以按任意大小写入数据，然后读出完整的NALU，
+ * 整个过程不需要 seek，内存占用与码流长度无关。
+ * 如果一个NALU比缓冲区还大，会被拆成多个片段（NALU_FRAGMENT_FIRST/LAST）依次读出。
+ */
+
+#ifndef H264_STREAM_BUFFER_SIZE
+#define H264_STREAM_BUFFER_SIZE     (4 << 20)
+#endif
+
+#define NALU_FRAGMENT_FIRST         0x01    // NALU 的第一段
+#define NALU_FRAGMENT_LAST          0x02    // NALU 的最后一段；完整的NALU两个标志都有
+
+typedef struct {
+    const unsigned char *data;    //! NALU 数据（或者其中的一段），在下一次 H264StreamWrite 之前有效
+    size_t length;                //! data 的长度
+    unsigned long long offset;    //! data 在整个码流中的位置
+    int startcodeprefix_len;      //! 起始码前缀的长度，3 或者 4
+    int flags;                    //! NALU_FRAGMENT_*
+} H264_STREAM_NALU;
+
+typedef struct {
+    unsigned char *buf;
+    size_t capacity;
+    size_t begin;                 //! 还不能丢弃的数据的开始位置
+    size_t end;                   //! 有效数据的结束位置
+    size_t scan;                  //! 下一次查找起始码的位置
+    size_t nal_start;             //! 当前NALU（还没有读出的部分）的开始位置
+    int in_nalu;                  //! 已经找到当前NALU的起始码
+    int prefix_len;
+    int fragmented;               //! 当前NALU已经读出过一段
+    int eof;                      //! 输入已经结束
+    unsigned long long consumed;  //! 已经从缓冲区移出的字节数
+} H264_STREAM_PARSER;
+
+/**
+ * Init the streaming parser.
+ * @param capacity    Buffer size, 0 means H264_STREAM_BUFFER_SIZE.
+ * @return 0 on success, -1 on failure.
+ */
+int H264StreamInit(H264_STREAM_PARSER *sp, size_t capacity) {
+    memset(sp, 0, sizeof(H264_STREAM_PARSER));
+    // 至少要能放下一个起始码和片段切分时保留的字节
+    sp->capacity = capacity > 16 ? capacity : (capacity == 0 ? H264_STREAM_BUFFER_SIZE : 16);
+    sp->buf = (unsigned char *) malloc(sp->capacity);
+    return sp->buf ? 0 : -1;
+}
+
+void H264StreamClose(H264_STREAM_PARSER *sp) {
+    free(sp->buf);
+    memset(sp, 0, sizeof(H264_STREAM_PARSER));
+}
+
+/**
+ * Write bytes into the parser.
+ * @return Number of bytes accepted (may be less than len when the buffer is full,
+ *         read NALUs with H264StreamRead and write the rest again).
+ */
+size_t H264StreamWrite(H264_STREAM_PARSER *sp, const unsigned char *data, size_t len) {
+    if (sp->end == sp->capacity && sp->begin > 0) {
+        // 缓冲区写满了：把还没有处理完的数据移到最前面
+        size_t shift = sp->begin;
+        memmove(sp->buf, sp->buf + shift, sp->end - shift);
+        sp->end -= shift;
+        sp->scan -= shift;
+        sp->nal_start = sp->nal_start > shift ? sp->nal_start - shift : 0;
+        sp->begin = 0;
+        sp->consumed += shift;
+    }
+    size_t n = sp->capacity - sp->end;
+    if (n > len) {
+        n = len;
+    }
+    memcpy(sp->buf + sp->end, data, n);
+    sp->end += n;
+    return n;
+}
+
+/**
+ * Mark the end of the input, the last NALU can be read after this.
+ */
+void H264StreamEnd(H264_STREAM_PARSER *sp) {
+    sp->eof = 1;
+}
+
+static void StreamEmit(H264_STREAM_PARSER *sp, H264_STREAM_NALU *nalu, size_t end, int last) {
+    nalu->data = sp->buf + sp->nal_start;
+    nalu->length = end - sp->nal_start;
+    nalu->offset = sp->consumed + sp->nal_start;
+    nalu->startcodeprefix_len = sp->prefix_len;
+    nalu->flags = (sp->fragmented ? 0 : NALU_FRAGMENT_FIRST) | (last ? NALU_FRAGMENT_LAST : 0);
+    sp->fragmented = !last;
+}
+
+/**
+ * Read the next NALU (or NALU fragment) from the parser.
+ * @return 1 if nalu was filled, 0 if more input is needed (or the stream has ended).
+ */
+int H264StreamRead(H264_STREAM_PARSER *sp, H264_STREAM_NALU *nalu) {
+    const unsigned char *end = sp->buf + sp->end;
+    while (1) {
+        const unsigned char *sc = FindStartCode(sp->buf + sp->scan, end);
+        if (sc != end) {
+            size_t pos = (size_t) (sc - sp->buf);
+            // 00 00 01 前面的 00 属于4字节起始码
+            int four = pos > sp->begin && sp->buf[pos - 1] == 0;
+            sp->scan = pos + 3;
+            if (!sp->in_nalu) {
+                // 第一个起始码之前的数据直接丢弃
+                sp->in_nalu = 1;
+                sp->prefix_len = four ? 4 : 3;
+                sp->nal_start = pos + 3;
+                sp->begin = pos - (four ? 1 : 0);
+                continue;
+            }
+            size_t nal_end = pos - (four ? 1 : 0);
+            StreamEmit(sp, nalu, nal_end, 1);
+            sp->prefix_len = four ? 4 : 3;
+            sp->nal_start = pos + 3;
+            sp->begin = nal_end;
+            return 1;
+        }
+
+        // 没有找到起始码：最后两个字节可能是下一个起始码的开头，下次从这里继续找
+        if (sp->end >= 2 && sp->end - 2 > sp->scan) {
+            sp->scan = sp->end - 2;
+        }
+        if (!sp->in_nalu) {
+            // 还没有找到第一个起始码，只需要保留最后3个字节
+            if (sp->end >= 3 && sp->end - 3 > sp->begin) {
+                sp->begin = sp->end - 3;
+            }
             return 0;
         }
-        // 判断是否为4字节
-        info3 = FindStartCode3(Buf);
-        if (info3 != 1) { // 如果不是4字节，出现异常情况，结束程序
-            free(Buf);
+        if (sp->eof) {
+            // 最后一个NALU一直延伸到码流末尾
+            StreamEmit(sp, nalu, sp->end, 1);
+            sp->in_nalu = 0;
+            sp->begin = sp->scan = sp->nal_start = sp->end;
+            return 1;
+        }
+        if (sp->begin == 0 && sp->end == sp->capacity) {
+            // 一个NALU把缓冲区占满了：先读出一段。保留最后4个字节，它们可能是下一个起始码的一部分
+            size_t keep = sp->end - 4;
+            if (keep <= sp->nal_start) {
+                return 0;
+            }
+            StreamEmit(sp, nalu, keep, 0);
+            sp->nal_start = keep;
+            sp->begin = keep;
+            return 1;
+        }
+        return 0;
+    }
+}
+
+// GetAnnexbNALU 使用的流式解析器，以及从 h264bitstream 读到、还没有写进解析器的数据
+static H264_STREAM_PARSER *h264stream = NULL;
+static unsigned char h264chunk[64 * 1024];
+static size_t h264chunk_pos = 0, h264chunk_len = 0;
+
+/**
+ * Read the next NALU from h264bitstream (works on pipes, no fseek).
+ * NALU data larger than nalu->max_size is truncated to max_size, nalu->len is still the real length.
+ * @return Bytes of this NALU in the stream (start code included), 0 at the end of the stream, -1 on error.
+ */
+int GetAnnexbNALU(NALU_t *nalu) {
+    H264_STREAM_NALU part;
+    size_t total = 0;
+
+    if (h264stream == NULL) {
+        h264stream = (H264_STREAM_PARSER *) malloc(sizeof(H264_STREAM_PARSER));
+        if (h264stream == NULL || H264StreamInit(h264stream, 0) != 0) {
+            printf("GetAnnexbNALU: Could not allocate stream parser\n");
+            free(h264stream);
+            h264stream = NULL;
             return -1;
-        } else {
-            pos = 4;
-            nalu->startcodeprefix_len = 4;
         }
-    } else {
-        nalu->startcodeprefix_len = 3;
-        pos = 3;
-    }
-    StartCodeFound = 0;
-    info2 = 0;
-    info3 = 0;
-    // 寻找下一个起始码
-    while (!StartCodeFound) {
-        // 指针到达文件末尾， 不需要再找了
-        if (feof(h264bitstream)) {
-            nalu->len = (pos - 1) - nalu->startcodeprefix_len;
-            memcpy(nalu->buf, &Buf[nalu->startcodeprefix_len], nalu->len);
-            // 抛开起始码的第一个字节
-            nalu->forbidden_bit = nalu->buf[0] & 0x80; //1 bit
-            nalu->nal_reference_idc = nalu->buf[0] & 0x60; // 2 bit
-            nalu->nal_unit_type = (nalu->buf[0]) & 0x1f;// 5 bit
-            free(Buf);
-            return pos - 1;
-        }
-        // fgetc 读取一个无符号字符并将文件指针向前推进   （如果读取完最后一个字符，pos依然会自增，因此要表示实际pos的值需要 -1）
-        Buf[pos++] = fgetc(h264bitstream);
-        info3 = FindStartCode3(&Buf[pos - 4]);
-        if (info3 != 1)
-            info2 = FindStartCode2(&Buf[pos - 3]);
-        StartCodeFound = (info2 == 1 || info3 == 1);
-    }
-
-    // 在这里，我们找到了另一个启动代码（并且读取启动代码字节的长度超过我们应该有的长度。因此，返回文件）
-    // 此时，找到了下一个起始码， 需要减去起始码的长度，才是一个NALU该有的长度， 保存此值
-    rewind = (info3 == 1) ? -4 : -3;
-
-    // 将文件指针移动到下一个起始码之前 （这才是一个NALU）
-    if (0 != fseek(h264bitstream, rewind, SEEK_CUR)) {
-        free(Buf);
-        printf("GetAnnexbNALU: Cannot fseek in the bit stream file");
-    }
-
-    // Here the Start code, the complete NALU, and the next start code is in the Buf.
-    // The size of Buf is pos, pos+rewind are the number of bytes excluding the next
-    // start code, and (pos+rewind)-startcodeprefix_len is the size of the NALU excluding the start code
-    // 此处的开始代码、完整的 NALU 和下一个启动代码位于 Buf 中。
-    // Buf 的大小是 pos，pos+rewind 是不包括下一个启动代码的字节数，
-    // （pos+rewind）-startcodeprefix_len 是不包括起始码的 NALU 的大小
-    nalu->len = (pos + rewind) - nalu->startcodeprefix_len;
-    memcpy(nalu->buf, &Buf[nalu->startcodeprefix_len], nalu->len);//
-    nalu->forbidden_bit = nalu->buf[0] & 0x80; //1 bit
-    nalu->nal_reference_idc = nalu->buf[0] & 0x60; // 2 bit
-    nalu->nal_unit_type = (nalu->buf[0]) & 0x1f;// 5 bit
-    free(Buf);
-
-    return (pos + rewind);
+        h264chunk_pos = h264chunk_len = 0;
+    }
+
+    while (1) {
+        if (H264StreamRead(h264stream, &part)) {
+            // 拷贝到 nalu->buf 中，超出 max_size 的部分不再拷贝
+            if (total < nalu->max_size) {
+                size_t n = part.length < nalu->max_size - total ? part.length : nalu->max_size - total;
+                memcpy(nalu->buf + total, part.data, n);
+            }
+            total += part.length;
+            if (part.flags & NALU_FRAGMENT_LAST) {
+                break;
+            }
+            continue;
+        }
+        if (h264stream->eof) {
+            H264StreamClose(h264stream);
+            free(h264stream);
+            h264stream = NULL;
+            return 0;
+        }
+        if (h264chunk_pos == h264chunk_len) {
+            h264chunk_pos = 0;
+            h264chunk_len = fread(h264chunk, 1, sizeof(h264chunk), h264bitstream);
+            if (h264chunk_len == 0) {
+                H264StreamEnd(h264stream);
+                continue;
+            }
+        }
+        h264chunk_pos += H264StreamWrite(h264stream, h264chunk + h264chunk_pos, h264chunk_len - h264chunk_pos);
+    }
+
+    nalu->startcodeprefix_len = part.startcodeprefix_len;
+    nalu->len = (unsigned) total;
+    nalu->forbidden_bit = total > 0 ? nalu->buf[0] & 0x80 : 0; //1 bit
+    nalu->nal_reference_idc = total > 0 ? nalu->buf[0] & 0x60 : 0; // 2 bit
+    nalu->nal_unit_type = total > 0 ? (nalu->buf[0]) & 0x1f : 0;// 5 bit
+    return (int) (total + part.startcodeprefix_len);
 }
 
+/* ====================== RBSP 提取、指数哥伦布解码、参数集与片头解析 ======================
+ * NALU 中的数据是 EBSP，编码器在 00 00 后面插入了 0x03（防竞争字节），解析语法元素前要先去掉，得到 RBSP。
+ * SPS/PPS/片头中大部分语法元素都是 ue(v)/se(v) 指数哥伦布编码。
+ * 片头中需要的字段（slice_type、frame_num、POC）都在最前面，所以片只需要转换前面很少的字节。
+ */
+
+#define H264_MAX_SPS                32
+#define H264_MAX_PPS                256
+#define H264_SLICE_RBSP_SIZE        64      // 片头解析只需要转换片的前64个字节
+#define H264_PARAM_RBSP_SIZE        4096    // SPS/PPS 最多转换4096个字节
+
+typedef enum {
+    SLICE_TYPE_P = 0,
+    SLICE_TYPE_B = 1,
+    SLICE_TYPE_I = 2,
+    SLICE_TYPE_SP = 3,
+    SLICE_TYPE_SI = 4,
+} SliceType;
+
 /**
- * Analysis H.264 Bitstream
- * @param url    Location of input H.264 bitstream file.
+ * Convert EBSP to RBSP (remove emulation prevention bytes).
+ * @param src        EBSP data.
+ * @param src_len    Size of src.
+ * @param dst        Output RBSP data.
+ * @param dst_size   Size of dst. Conversion stops when dst is full.
+ * @return Size of RBSP data written to dst.
  */
-int simplest_h264_parser(char *url) {
+size_t EbspToRbsp(const unsigned char *src, size_t src_len, unsigned char *dst, size_t dst_size) {
+    const unsigned char *p = src, *end = src + src_len;
+    size_t out = 0;
+    while (p < end && out < dst_size) {
+        // 找到下一个 00 00 03，把它前面的数据（包括 00 00）整块拷贝过去，然后跳过 03
+        const unsigned char *q = FindZeroZero(p, end, 0x03);
+        size_t n = (q == end) ? (size_t) (end - p) : (size_t) (q + 2 - p);
+        if (n > dst_size - out) {
+            n = dst_size - out;
+        }
+        memcpy(dst + out, p, n);
+        out += n;
+        p = (q == end) ? end : q + 3;
+    }
+    return out;
+}
 
-    NALU_t *n;
-    //  缓冲区大小  字节
-    int buffersize = 100000;
+typedef struct {
+    const unsigned char *data;
+    size_t size;                  //! 数据大小（字节）
+    size_t pos;                   //! 当前位置（比特）
+} BIT_READER;
 
-    //FILE *myout=fopen("output_log.txt","wb+");
-    // 打开一个标准输出流
-    FILE *myout = stdout;
+static void BitReaderInit(BIT_READER *br, const unsigned char *data, size_t size) {
+    br->data = data;
+    br->size = size;
+    br->pos = 0;
+}
 
-    h264bitstream = fopen(url, "rb+");
-    if (h264bitstream == NULL) {
-        printf("Open file error\n");
-        return 0;
+// 取出从当前字节开始的64个比特（大端序），超出数据末尾的部分补0
+static unsigned long long BitReaderLoad64(const BIT_READER *br) {
+    size_t byte = br->pos >> 3;
+    unsigned long long v = 0;
+    if (byte + 8 <= br->size) {
+#if defined(__GNUC__)
+        memcpy(&v, br->data + byte, 8);
+        return __builtin_bswap64(v);
+#else
+        for (int i = 0; i < 8; i++) v = (v << 8) | br->data[byte + i];
+        return v;
+#endif
+    }
+    for (int i = 0; i < 8; i++) {
+        v = (v << 8) | (byte + i < br->size ? br->data[byte + i] : 0);
     }
-    // 分配内存并初始化
-    n = (NALU_t *) calloc(1, sizeof(NALU_t));
-    if (n == NULL) {
-        printf("Alloc NALU Error\n");
+    return v;
+}
+
+// 当前比特位置开始的比特，有效长度至少为57位
+static unsigned long long BitReaderPeek(const BIT_READER *br) {
+    return BitReaderLoad64(br) << (br->pos & 7);
+}
+
+// 读 n 个比特，n <= 32  -> u(n)
+static unsigned ReadBits(BIT_READER *br, int n) {
+    if (n == 0) {
         return 0;
     }
+    unsigned v = (unsigned) (BitReaderPeek(br) >> (64 - n));
+    br->pos += n;
+    return v;
+}
+
+static unsigned ReadBit(BIT_READER *br) {
+    return ReadBits(br, 1);
+}
 
-    n->max_size = buffersize;
-    n->buf = (char *) calloc(buffersize, sizeof(char));
-    if (n->buf == NULL) {
-        free(n);
-        printf("AllocNALU: n->buf");
+// ue(v)：前导0的个数为 n，则值为 2^n - 1 + 后面n个比特的值
+// 用 clz 一次数出前导0，不需要逐位循环
+static unsigned ReadUE(BIT_READER *br) {
+    unsigned long long v = BitReaderPeek(br);
+    if (v == 0) {
+        // 数据错误或者超出了末尾
+        br->pos = br->size * 8 + 1;
+        return 0;
+    }
+    int n = __builtin_clzll(v);
+    if (n > 28) {
+        // 57个比特放不下，这种情况只会出现在错误的数据中
+        br->pos = br->size * 8 + 1;
         return 0;
     }
+    br->pos += 2 * n + 1;
+    return (unsigned) ((v >> (63 - 2 * n)) - 1);
+}
 
-    int data_offset = 0;
-    int nal_num = 0;
-    printf("-----+-------- NALU Table ------+---------+\n");
-    printf(" NUM |    POS  |    IDC |  TYPE |   LEN   |\n");
-    printf("-----+---------+--------+-------+---------+\n");
-
-    while (!feof(h264bitstream)) {
-        int data_lenth;
-        data_lenth = GetAnnexbNALU(n);
-        char type_str[20] = {0};
-        switch (n->nal_unit_type) {
-            case NALU_TYPE_SLICE:
-                sprintf(type_str, "SLICE");
-                break;
-            case NALU_TYPE_DPA:
-                sprintf(type_str, "DPA");
-                break;
-            case NALU_TYPE_DPB:
-                sprintf(type_str, "DPB");
-                break;
-            case NALU_TYPE_DPC:
-                sprintf(type_str, "DPC");
-                break;
-            case NALU_TYPE_IDR:
-                sprintf(type_str, "IDR");
-                break;
-            case NALU_TYPE_SEI:
-                sprintf(type_str, "SEI");
-                break;
-            case NALU_TYPE_SPS:
-                sprintf(type_str, "SPS");
-                break;
-            case NALU_TYPE_PPS:
-                sprintf(type_str, "PPS");
-                break;
-            case NALU_TYPE_AUD:
-                sprintf(type_str, "AUD");
-                break;
-            case NALU_TYPE_EOSEQ:
-                sprintf(type_str, "EOSEQ");
-                break;
-            case NALU_TYPE_EOSTREAM:
-                sprintf(type_str, "EOSTREAM");
-                break;
-            case NALU_TYPE_FILL:
-                sprintf(type_str, "FILL");
-                break;
+// se(v)：k -> (-1)^(k+1) * Ceil(k/2)
+static int ReadSE(BIT_READER *br) {
+    unsigned k = ReadUE(br);
+    return (k & 1) ? (int) ((k + 1) >> 1) : -(int) (k >> 1);
+}
+
+static int BitReaderError(const BIT_READER *br) {
+    return br->pos > br->size * 8;
+}
+
+typedef struct {
+    int valid;
+    int profile_idc;
+    int constraint_flags;         //! constraint_set0_flag ~ constraint_set5_flag
+    int level_idc;
+    int seq_parameter_set_id;
+    int chroma_format_idc;
+    int separate_colour_plane_flag;
+    int bit_depth_luma;
+    int bit_depth_chroma;
+    int log2_max_frame_num;
+    int pic_order_cnt_type;
+    int log2_max_pic_order_cnt_lsb;
+    int delta_pic_order_always_zero_flag;
+    int offset_for_non_ref_pic;
+    int offset_for_top_to_bottom_field;
+    int num_ref_frames_in_pic_order_cnt_cycle;
+    int offset_for_ref_frame[256];
+    int max_num_ref_frames;
+    int frame_mbs_only_flag;
+    int width;                    //! 裁剪后的宽度
+    int height;                   //! 裁剪后的高度
+    int timing_info_present_flag;
+    unsigned num_units_in_tick;
+    unsigned time_scale;
+    int fixed_frame_rate_flag;
+} H264_SPS;
+
+typedef struct {
+    int valid;
+    int pic_parameter_set_id;
+    int seq_parameter_set_id;
+    int entropy_coding_mode_flag; //! 0：CAVLC，1：CABAC
+    int bottom_field_pic_order_in_frame_present_flag;
+    int num_slice_groups;
+    int num_ref_idx_l0_default_active;
+    int num_ref_idx_l1_default_active;
+    int weighted_pred_flag;
+    int weighted_bipred_idc;
+    int pic_init_qp;
+    int deblocking_filter_control_present_flag;
+    int redundant_pic_cnt_present_flag;
+} H264_PPS;
+
+typedef struct {
+    int nal_unit_type;
+    int nal_ref_idc;
+    int first_mb_in_slice;
+    int slice_type;               //! 0~9，对5取余后为 SliceType
+    int pic_parameter_set_id;
+    int frame_num;
+    int field_pic_flag;
+    int bottom_field_flag;
+    int idr_pic_id;
+    int pic_order_cnt_lsb;
+    int delta_pic_order_cnt_bottom;
+    int delta_pic_order_cnt[2];
+    int poc;                      //! 计算出的图像顺序号（Picture Order Count）
+} H264_SLICE_HEADER;
+
+typedef struct {
+    H264_SPS sps[H264_MAX_SPS];
+    H264_PPS pps[H264_MAX_PPS];
+    const H264_SPS *active_sps;   //! 最近一个片使用的 SPS
+    // POC 计算需要的上一个参考图像的状态（8.2.1）
+    int prev_poc_msb;
+    int prev_poc_lsb;
+    int prev_frame_num_offset;
+    int prev_frame_num;
+    int last_param_id;            //! 最近解析的 SPS/PPS 的 id
+    unsigned char rbsp[H264_PARAM_RBSP_SIZE];
+} H264_PARSER_CTX;
+
+static void SkipScalingList(BIT_READER *br, int size) {
+    int last_scale = 8, next_scale = 8;
+    for (int j = 0; j < size && next_scale != 0; j++) {
+        next_scale = (last_scale + ReadSE(br) + 256) % 256;
+        if (next_scale != 0) {
+            last_scale = next_scale;
         }
-        char idc_str[20] = {0};
-        switch (n->nal_reference_idc >> 5) {
-            case NALU_PRIORITY_DISPOSABLE:
-                sprintf(idc_str, "DISPOS");
-                break;
-            case NALU_PRIRITY_LOW:
-                sprintf(idc_str, "LOW");
-                break;
-            case NALU_PRIORITY_HIGH:
-                sprintf(idc_str, "HIGH");
-                break;
-            case NALU_PRIORITY_HIGHEST:
-                sprintf(idc_str, "HIGHEST");
-                break;
+    }
+}
+
+// 只解析到 timing_info，后面的 HRD/码流限制参数用不到
+static void ParseVUI(BIT_READER *br, H264_SPS *sps) {
+    if (ReadBit(br)) {                          // aspect_ratio_info_present_flag
+        if (ReadBits(br, 8) == 255) {           // aspect_ratio_idc == Extended_SAR
+            ReadBits(br, 16);                   // sar_width
+            ReadBits(br, 16);                   // sar_height
         }
+    }
+    if (ReadBit(br)) {                          // overscan_info_present_flag
+        ReadBit(br);                            // overscan_appropriate_flag
+    }
+    if (ReadBit(br)) {                          // video_signal_type_present_flag
+        ReadBits(br, 4);                        // video_format, video_full_range_flag
+        if (ReadBit(br)) {                      // colour_description_present_flag
+            ReadBits(br, 24);
+        }
+    }
+    if (ReadBit(br)) {                          // chroma_loc_info_present_flag
+        ReadUE(br);
+        ReadUE(br);
+    }
+    sps->timing_info_present_flag = ReadBit(br);
+    if (sps->timing_info_present_flag) {
+        sps->num_units_in_tick = ReadBits(br, 32);
+        sps->time_scale = ReadBits(br, 32);
+        sps->fixed_frame_rate_flag = ReadBit(br);
+    }
+}
 
-        fprintf(myout, "%5d| %8d| %7s| %6s| %8d|\n", nal_num, data_offset, idc_str, type_str, n->len);
+/**
+ * Parse SPS.
+ * @param rbsp    RBSP data after the NALU header byte.
+ * @return 0 on success, -1 on error.
+ */
+int ParseSPS(const unsigned char *rbsp, size_t len, H264_SPS *sps) {
+    BIT_READER br;
+    BitReaderInit(&br, rbsp, len);
+    memset(sps, 0, sizeof(H264_SPS));
 
-        data_offset = data_offset + data_lenth;
-        nal_num++;
+    sps->profile_idc = ReadBits(&br, 8);
+    sps->constraint_flags = ReadBits(&br, 8);
+    sps->level_idc = ReadBits(&br, 8);
+    sps->seq_parameter_set_id = ReadUE(&br);
+    if (sps->seq_parameter_set_id >= H264_MAX_SPS) {
+        return -1;
+    }
+    sps->chroma_format_idc = 1;
+    sps->bit_depth_luma = 8;
+    sps->bit_depth_chroma = 8;
+    switch (sps->profile_idc) {
+        case 100: case 110: case 122: case 244: case 44:
+        case 83: case 86: case 118: case 128: case 138: case 139: case 134: case 135:
+            sps->chroma_format_idc = ReadUE(&br);
+            if (sps->chroma_format_idc == 3) {
+                sps->separate_colour_plane_flag = ReadBit(&br);
+            }
+            sps->bit_depth_luma = ReadUE(&br) + 8;
+            sps->bit_depth_chroma = ReadUE(&br) + 8;
+            ReadBit(&br);                       // qpprime_y_zero_transform_bypass_flag
+            if (ReadBit(&br)) {                 // seq_scaling_matrix_present_flag
+                for (int i = 0; i < (sps->chroma_format_idc != 3 ? 8 : 12); i++) {
+                    if (ReadBit(&br)) {
+                        SkipScalingList(&br, i < 6 ? 16 : 64);
+                    }
+                }
+            }
+            break;
+        default:
+            break;
+    }
+    sps->log2_max_frame_num = ReadUE(&br) + 4;
+    sps->pic_order_cnt_type = ReadUE(&br);
+    if (sps->pic_order_cnt_type == 0) {
+        sps->log2_max_pic_order_cnt_lsb = ReadUE(&br) + 4;
+    } else if (sps->pic_order_cnt_type == 1) {
+        sps->delta_pic_order_always_zero_flag = ReadBit(&br);
+        sps->offset_for_non_ref_pic = ReadSE(&br);
+        sps->offset_for_top_to_bottom_field = ReadSE(&br);
+        sps->num_ref_frames_in_pic_order_cnt_cycle = ReadUE(&br);
+        if (sps->num_ref_frames_in_pic_order_cnt_cycle > 255) {
+            return -1;
+        }
+        for (int i = 0; i < sps->num_ref_frames_in_pic_order_cnt_cycle; i++) {
+            sps->offset_for_ref_frame[i] = ReadSE(&br);
+        }
+    }
+    sps->max_num_ref_frames = ReadUE(&br);
+    ReadBit(&br);                               // gaps_in_frame_num_value_allowed_flag
+    int pic_width_in_mbs = ReadUE(&br) + 1;
+    int pic_height_in_map_units = ReadUE(&br) + 1;
+    sps->frame_mbs_only_flag = ReadBit(&br);
+    if (!sps->frame_mbs_only_flag) {
+        ReadBit(&br);                           // mb_adaptive_frame_field_flag
     }
+    ReadBit(&br);                               // direct_8x8_inference_flag
 
-    //Free
-    if (n) {
-        if (n->buf) {
-            free(n->buf);
-            n->buf = NULL;
+    sps->width = pic_width_in_mbs * 16;
+    sps->height = (2 - sps->frame_mbs_only_flag) * pic_height_in_map_units * 16;
+    if (ReadBit(&br)) {                         // frame_cropping_flag
+        int left = ReadUE(&br), right = ReadUE(&br), top = ReadUE(&br), bottom = ReadUE(&br);
+        // 裁剪单位与色度格式有关（7.4.2.1.1）
+        int crop_x = 1, crop_y = 2 - sps->frame_mbs_only_flag;
+        if (sps->chroma_format_idc != 0 && !sps->separate_colour_plane_flag) {
+            crop_x = sps->chroma_format_idc == 3 ? 1 : 2;
+            crop_y *= sps->chroma_format_idc == 1 ? 2 : 1;
         }
-        free(n);
+        sps->width -= (left + right) * crop_x;
+        sps->height -= (top + bottom) * crop_y;
     }
+    if (ReadBit(&br)) {                         // vui_parameters_present_flag
+        ParseVUI(&br, sps);
+    }
+    if (BitReaderError(&br)) {
+        return -1;
+    }
+    sps->valid = 1;
     return 0;
 }
 
+/**
+ * Parse PPS.
+ * @param rbsp    RBSP data after the NALU header byte.
+ * @return 0 on success, -1 on error.
+ */
+int ParsePPS(const unsigned char *rbsp, size_t len, H264_PPS *pps) {
+    BIT_READER br;
+    BitReaderInit(&br, rbsp, len);
+    memset(pps, 0, sizeof(H264_PPS));
 
-int main(int argc, char *argv[]) {
-    simplest_h264_parser("sintel.h264");
+    pps->pic_parameter_set_id = ReadUE(&br);
+    pps->seq_parameter_set_id = ReadUE(&br);
+    if (pps->pic_parameter_set_id >= H264_MAX_PPS || pps->seq_parameter_set_id >= H264_MAX_SPS) {
+        return -1;
+    }
+    pps->entropy_coding_mode_flag = ReadBit(&br);
+    pps->bottom_field_pic_order_in_frame_present_flag = ReadBit(&br);
+    pps->num_slice_groups = ReadUE(&br) + 1;
+    if (pps->num_slice_groups > 1) {
+        int slice_group_map_type = ReadUE(&br);
+        if (slice_group_map_type == 0) {
+            for (int i = 0; i < pps->num_slice_groups; i++) {
+                ReadUE(&br);                    // run_length_minus1
+            }
+        } else if (slice_group_map_type == 2) {
+            for (int i = 0; i < pps->num_slice_groups - 1; i++) {
+                ReadUE(&br);                    // top_left
+                ReadUE(&br);                    // bottom_right
+            }
+        } else if (slice_group_map_type >= 3 && slice_group_map_type <= 5) {
+            ReadBit(&br);                       // slice_group_change_direction_flag
+            ReadUE(&br);                        // slice_group_change_rate_minus1
+        } else if (slice_group_map_type == 6) {
+            int pic_size_in_map_units = ReadUE(&br) + 1;
+            int bits = 0;
+            while ((1 << bits) < pps->num_slice_groups) {
+                bits++;
+            }
+            for (int i = 0; i < pic_size_in_map_units; i++) {
+                ReadBits(&br, bits);            // slice_group_id
+            }
+        }
+    }
+    pps->num_ref_idx_l0_default_active = ReadUE(&br) + 1;
+    pps->num_ref_idx_l1_default_active = ReadUE(&br) + 1;
+    pps->weighted_pred_flag = ReadBit(&br);
+    pps->weighted_bipred_idc = ReadBits(&br, 2);
+    pps->pic_init_qp = ReadSE(&br) + 26;
+    ReadSE(&br);                                // pic_init_qs_minus26
+    ReadSE(&br);                                // chroma_qp_index_offset
+    pps->deblocking_filter_control_present_flag = ReadBit(&br);
+    ReadBit(&br);                               // constrained_intra_pred_flag
+    pps->redundant_pic_cnt_present_flag = ReadBit(&br);
+    if (BitReaderError(&br)) {
+        return -1;
+    }
+    pps->valid = 1;
+    return 0;
+}
+
+// 计算 POC（8.2.1）。没有处理 memory_management_control_operation 等于5的情况（它在片头很后面的位置）
+static void ComputePOC(H264_PARSER_CTX *ctx, const H264_SPS *sps, H264_SLICE_HEADER *sh) {
+    int idr = sh->nal_unit_type == NALU_TYPE_IDR;
+    int max_frame_num = 1 << sps->log2_max_frame_num;
+    int top = 0, bottom = 0;
+
+    if (sps->pic_order_cnt_type == 0) {
+        int max_poc_lsb = 1 << sps->log2_max_pic_order_cnt_lsb;
+        if (idr) {
+            ctx->prev_poc_msb = 0;
+            ctx->prev_poc_lsb = 0;
+        }
+        int poc_msb;
+        int lsb = sh->pic_order_cnt_lsb;
+        if (lsb < ctx->prev_poc_lsb && ctx->prev_poc_lsb - lsb >= max_poc_lsb / 2) {
+            poc_msb = ctx->prev_poc_msb + max_poc_lsb;
+        } else if (lsb > ctx->prev_poc_lsb && lsb - ctx->prev_poc_lsb > max_poc_lsb / 2) {
+            poc_msb = ctx->prev_poc_msb - max_poc_lsb;
+        } else {
+            poc_msb = ctx->prev_poc_msb;
+        }
+        top = poc_msb + lsb;
+        bottom = sh->field_pic_flag ? poc_msb + lsb : top + sh->delta_pic_order_cnt_bottom;
+        // 只有参考图像才会更新 prevPicOrderCntMsb/Lsb
+        if (sh->nal_ref_idc != 0) {
+            ctx->prev_poc_msb = poc_msb;
+            ctx->prev_poc_lsb = lsb;
+        }
+    } else {
+        int frame_num_offset;
+        if (idr) {
+            frame_num_offset = 0;
+        } else if (ctx->prev_frame_num > sh->frame_num) {
+            frame_num_offset = ctx->prev_frame_num_offset + max_frame_num;
+        } else {
+            frame_num_offset = ctx->prev_frame_num_offset;
+        }
+
+        if (sps->pic_order_cnt_type == 1) {
+            int abs_frame_num = sps->num_ref_frames_in_pic_order_cnt_cycle != 0 ? frame_num_offset + sh->frame_num : 0;
+            if (sh->nal_ref_idc == 0 && abs_frame_num > 0) {
+                abs_frame_num--;
+            }
+            int expected = 0;
+            if (abs_frame_num > 0) {
+                int delta_per_cycle = 0;
+                for (int i = 0; i < sps->num_ref_frames_in_pic_order_cnt_cycle; i++) {
+                    delta_per_cycle += sps->offset_for_ref_frame[i];
+                }
+                int cycle_cnt = (abs_frame_num - 1) / sps->num_ref_frames_in_pic_order_cnt_cycle;
+                int in_cycle = (abs_frame_num - 1) % sps->num_ref_frames_in_pic_order_cnt_cycle;
+                expected = cycle_cnt * delta_per_cycle;
+                for (int i = 0; i <= in_cycle; i++) {
+                    expected += sps->offset_for_ref_frame[i];
+                }
+            }
+            if (sh->nal_ref_idc == 0) {
+                expected += sps->offset_for_non_ref_pic;
+            }
+            if (!sh->field_pic_flag) {
+                top = expected + sh->delta_pic_order_cnt[0];
+                bottom = top + sps->offset_for_top_to_bottom_field + sh->delta_pic_order_cnt[1];
+            } else if (!sh->bottom_field_flag) {
+                top = bottom = expected + sh->delta_pic_order_cnt[0];
+            } else {
+                top = bottom = expected + sps->offset_for_top_to_bottom_field + sh->delta_pic_order_cnt[0];
+            }
+        } else {
+            int temp = idr ? 0 : (sh->nal_ref_idc == 0 ? 2 * (frame_num_offset + sh->frame_num) - 1
+                                                      : 2 * (frame_num_offset + sh->frame_num));
+            top = bottom = temp;
+        }
+        ctx->prev_frame_num_offset = frame_num_offset;
+        ctx->prev_frame_num = sh->frame_num;
+    }
+
+    if (!sh->field_pic_flag) {
+        sh->poc = top < bottom ? top : bottom;
+    } else {
+        sh->poc = sh->bottom_field_flag ? bottom : top;
+    }
+}
+
+/**
+ * Parse slice header up to the POC related syntax elements.
+ * @param rbsp    RBSP data after the NALU header byte.
+ * @return 0 on success, -1 on error (unknown PPS/SPS or broken data).
+ */
+int ParseSliceHeader(H264_PARSER_CTX *ctx, const unsigned char *rbsp, size_t len, H264_SLICE_HEADER *sh) {
+    BIT_READER br;
+    BitReaderInit(&br, rbsp, len);
+
+    sh->first_mb_in_slice = ReadUE(&br);
+    sh->slice_type = ReadUE(&br);
+    sh->pic_parameter_set_id = ReadUE(&br);
+    if (sh->slice_type > 9 || sh->pic_parameter_set_id >= H264_MAX_PPS) {
+        return -1;
+    }
+    const H264_PPS *pps = &ctx->pps[sh->pic_parameter_set_id];
+    if (!pps->valid) {
+        return -1;
+    }
+    const H264_SPS *sps = &ctx->sps[pps->seq_parameter_set_id];
+    if (!sps->valid) {
+        return -1;
+    }
+    if (sps->separate_colour_plane_flag) {
+        ReadBits(&br, 2);                       // colour_plane_id
+    }
+    sh->frame_num = ReadBits(&br, sps->log2_max_frame_num);
+    sh->field_pic_flag = 0;
+    sh->bottom_field_flag = 0;
+    if (!sps->frame_mbs_only_flag) {
+        sh->field_pic_flag = ReadBit(&br);
+        if (sh->field_pic_flag) {
+            sh->bottom_field_flag = ReadBit(&br);
+        }
+    }
+    sh->idr_pic_id = sh->nal_unit_type == NALU_TYPE_IDR ? (int) ReadUE(&br) : 0;
+    sh->pic_order_cnt_lsb = 0;
+    sh->delta_pic_order_cnt_bottom = 0;
+    sh->delta_pic_order_cnt[0] = sh->delta_pic_order_cnt[1] = 0;
+    if (sps->pic_order_cnt_type == 0) {
+        sh->pic_order_cnt_lsb = ReadBits(&br, sps->log2_max_pic_order_cnt_lsb);
+        if (pps->bottom_field_pic_order_in_frame_present_flag && !sh->field_pic_flag) {
+            sh->delta_pic_order_cnt_bottom = ReadSE(&br);
+        }
+    } else if (sps->pic_order_cnt_type == 1 && !sps->delta_pic_order_always_zero_flag) {
+        sh->delta_pic_order_cnt[0] = ReadSE(&br);
+        if (pps->bottom_field_pic_order_in_frame_present_flag && !sh->field_pic_flag) {
+            sh->delta_pic_order_cnt[1] = ReadSE(&br);
+        }
+    }
+    if (BitReaderError(&br)) {
+        return -1;
+    }
+    ctx->active_sps = sps;
+    ComputePOC(ctx, sps, sh);
+    return 0;
+}
+
+/**
+ * Parse a NALU: SPS/PPS are stored in ctx, slice headers are parsed into sh.
+ * @param nal    NALU data (starting with the NALU header byte).
+ * @return 1 if sh was filled (slice), 0 for other NALUs, -1 on error.
+ */
+int H264ParseNalu(H264_PARSER_CTX *ctx, const unsigned char *nal, size_t len, H264_SLICE_HEADER *sh) {
+    if (len < 2) {
+        return 0;
+    }
+    int nal_unit_type = nal[0] & 0x1f;
+    switch (nal_unit_type) {
+        case NALU_TYPE_SPS: {
+            H264_SPS sps;
+            size_t n = EbspToRbsp(nal + 1, len - 1, ctx->rbsp, H264_PARAM_RBSP_SIZE);
+            if (ParseSPS(ctx->rbsp, n, &sps) != 0) {
+                return -1;
+            }
+            ctx->sps[sps.seq_parameter_set_id] = sps;
+            ctx->last_param_id = sps.seq_parameter_set_id;
+            return 0;
+        }
+        case NALU_TYPE_PPS: {
+            H264_PPS pps;
+            size_t n = EbspToRbsp(nal + 1, len - 1, ctx->rbsp, H264_PARAM_RBSP_SIZE);
+            if (ParsePPS(ctx->rbsp, n, &pps) != 0) {
+                return -1;
+            }
+            ctx->pps[pps.pic_parameter_set_id] = pps;
+            ctx->last_param_id = pps.pic_parameter_set_id;
+            return 0;
+        }
+        case NALU_TYPE_SLICE:
+        case NALU_TYPE_IDR: {
+            size_t n = EbspToRbsp(nal + 1, len - 1, ctx->rbsp, H264_SLICE_RBSP_SIZE);
+            sh->nal_unit_type = nal_unit_type;
+            sh->nal_ref_idc = (nal[0] & 0x60) >> 5;
+            return ParseSliceHeader(ctx, ctx->rbsp, n, sh) == 0 ? 1 : -1;
+        }
+        default:
+            return 0;
+    }
+}
+
+static const char *SliceTypeString(int slice_type) {
+    switch (slice_type % 5) {
+        case SLICE_TYPE_P:
+            return "P";
+        case SLICE_TYPE_B:
+            return "B";
+        case SLICE_TYPE_I:
+            return "I";
+        case SLICE_TYPE_SP:
+            return "SP";
+        case SLICE_TYPE_SI:
+            return "SI";
+        default:
+            return "";
+    }
+}
+
+static const char *ProfileString(int profile_idc) {
+    switch (profile_idc) {
+        case 66:
+            return "Baseline";
+        case 77:
+            return "Main";
+        case 88:
+            return "Extended";
+        case 100:
+            return "High";
+        case 110:
+            return "High10";
+        case 122:
+            return "High422";
+        case 244:
+            return "High444";
+        case 44:
+            return "CAVLC444";
+        default:
+            return "Unknown";
+    }
+}
+
+// 解析NALU并生成 NALU Table 中 INFO 一列的内容
+static void FormatNaluInfo(H264_PARSER_CTX *ctx, const unsigned char *nal, size_t len, char *info, size_t info_size) {
+    H264_SLICE_HEADER sh;
+    info[0] = 0;
+    int ret = H264ParseNalu(ctx, nal, len, &sh);
+    if (ret < 0) {
+        snprintf(info, info_size, "parse error");
+    } else if (ret == 1) {
+        snprintf(info, info_size, "%s frame_num=%d poc=%d", SliceTypeString(sh.slice_type), sh.frame_num, sh.poc);
+    } else if ((nal[0] & 0x1f) == NALU_TYPE_SPS) {
+        const H264_SPS *sps = &ctx->sps[ctx->last_param_id];
+        snprintf(info, info_size, "%s@L%d.%d %dx%d", ProfileString(sps->profile_idc),
+                 sps->level_idc / 10, sps->level_idc % 10, sps->width, sps->height);
+    } else if ((nal[0] & 0x1f) == NALU_TYPE_PPS) {
+        const H264_PPS *pps = &ctx->pps[ctx->last_param_id];
+        snprintf(info, info_size, "pps_id=%d sps_id=%d %s", pps->pic_parameter_set_id, pps->seq_parameter_set_id,
+                 pps->entropy_coding_mode_flag ? "CABAC" : "CAVLC");
+    }
+}
+
+static void PrintNaluTableHeader(FILE *myout) {
+    fprintf(myout, "-----+-------- NALU Table ------+---------+---------------------\n");
+    fprintf(myout, " NUM |    POS  |    IDC |  TYPE |   LEN   | INFO\n");
+    fprintf(myout, "-----+---------+--------+-------+---------+---------------------\n");
+}
+
+// INFO 列由 FormatNaluInfo 生成：SPS 显示档次/级别/分辨率，PPS 显示熵编码方式，片显示 I/P/B 类型、frame_num 和 POC
+static void PrintNaluTableRow(FILE *myout, int nal_num, const NALU_VIEW *nalu, const char *info) {
+    fprintf(myout, "%5d| %8llu| %7s| %6s| %8llu| %s\n", nal_num, (unsigned long long) NALU_VIEW_POS(nalu),
+            NaluIdcString(NALU_VIEW_IDC(nalu)), NaluTypeString(NALU_VIEW_TYPE(nalu)),
+            (unsigned long long) nalu->length, info);
+}
+
+/**
+ * Analysis H.264 Bitstream
+ * @param url    Location of input H.264 bitstream file.
+ */
+int simplest_h264_parser(char *url) {
+
+    //FILE *myout=fopen("output_log.txt","wb+");
+    // 打开一个标准输出流
+    FILE *myout = stdout;
+
+    // 将整个文件映射到内存，之后所有的NALU都直接指向这块内存
+    H264_MAP map;
+    if (MapH264File(url, &map) != 0) {
+        printf("Open file error\n");
+        return 0;
+    }
+
+    H264_PARSER_CTX *ctx = (H264_PARSER_CTX *) calloc(1, sizeof(H264_PARSER_CTX));
+    if (ctx == NULL) {
+        printf("Alloc parser context error\n");
+        UnmapH264File(&map);
+        return 0;
+    }
+
+    NALU_ITER it;
+    NALU_VIEW nalu;
+    int nal_num = 0;
+    char info[64];
+    PrintNaluTableHeader(myout);
+
+    NaluIterInit(&it, map.data, map.size);
+    while (NaluIterNext(&it, &nalu)) {
+        FormatNaluInfo(ctx, map.data + nalu.offset, nalu.length, info, sizeof(info));
+        PrintNaluTableRow(myout, nal_num, &nalu, info);
+        nal_num++;
+    }
+
+    free(ctx);
+    UnmapH264File(&map);
+    return 0;
+}
+
+
+/**
+ * Analysis H.264 Bitstream from a pipe or file without seeking.
+ * 输出与 simplest_h264_parser 相同的 NALU Table
+ * @param url    Location of input H.264 bitstream file, "-" means stdin.
+ */
+int simplest_h264_parser_stream(char *url) {
+    FILE *myout = stdout;
+
+    FILE *ifile = strcmp(url, "-") == 0 ? stdin : fopen(url, "rb");
+    if (ifile == NULL) {
+        printf("Open file error\n");
+        return 0;
+    }
+    H264_STREAM_PARSER sp;
+    H264_PARSER_CTX *ctx = (H264_PARSER_CTX *) calloc(1, sizeof(H264_PARSER_CTX));
+    if (ctx == NULL || H264StreamInit(&sp, 0) != 0) {
+        printf("Alloc parser context error\n");
+        free(ctx);
+        if (ifile != stdin) fclose(ifile);
+        return 0;
+    }
+
+    unsigned char chunk[64 * 1024];
+    H264_STREAM_NALU part;
+    NALU_VIEW nalu;
+    int nal_num = 0;
+    char info[64] = {0};
+    PrintNaluTableHeader(myout);
+
+    while (1) {
+        size_t n = fread(chunk, 1, sizeof(chunk), ifile);
+        if (n == 0) {
+            H264StreamEnd(&sp);
+        }
+        size_t done = 0;
+        do {
+            done += H264StreamWrite(&sp, chunk + done, n - done);
+            while (H264StreamRead(&sp, &part)) {
+                // 大的NALU会分成几段读出：在第一段解析头部信息，在最后一段输出
+                if (part.flags & NALU_FRAGMENT_FIRST) {
+                    nalu.offset = (size_t) part.offset;
+                    nalu.length = 0;
+                    nalu.startcodeprefix_len = part.startcodeprefix_len;
+                    nalu.header = part.length > 0 ? part.data[0] : 0;
+                    FormatNaluInfo(ctx, part.data, part.length, info, sizeof(info));
+                }
+                nalu.length += part.length;
+                if (part.flags & NALU_FRAGMENT_LAST) {
+                    PrintNaluTableRow(myout, nal_num, &nalu, info);
+                    nal_num++;
+                }
+            }
+        } while (done < n);
+        if (n == 0) {
+            break;
+        }
+    }
+
+    H264StreamClose(&sp);
+    free(ctx);
+    if (ifile != stdin) {
+        fclose(ifile);
+    }
+    return 0;
+}
+
+
+/* ====================== 多线程分块建立 NALU 索引 ======================
+ * 把输入分成 N 段，每个线程只负责查找“第一个字节落在自己这一段内”的起始码，
+ * 查找时向后多看2个字节，这样跨越分段边界的起始码也能被找到，并且只会被一个线程找到。
+ * 所有起始码位置按顺序拼接起来以后，再按照与 ScanAnnexbNALU 相同的规则切分NALU，
+ * 因此得到的索引与串行扫描的结果完全一致。
+ */
+
+typedef struct {
+    NALU_VIEW *entries;           //! 所有NALU
+    size_t count;                 //! NALU 个数
+    size_t capacity;              //! entries 的容量
+} NALU_INDEX;
+
+void FreeNaluIndex(NALU_INDEX *index) {
+    free(index->entries);
+    memset(index, 0, sizeof(NALU_INDEX));
+}
+
+int NaluIndexAppend(NALU_INDEX *index, const NALU_VIEW *view) {
+    if (index->count == index->capacity) {
+        size_t capacity = index->capacity ? index->capacity * 2 : 1024;
+        NALU_VIEW *entries = (NALU_VIEW *) realloc(index->entries, capacity * sizeof(NALU_VIEW));
+        if (entries == NULL) {
+            return -1;
+        }
+        index->entries = entries;
+        index->capacity = capacity;
+    }
+    index->entries[index->count++] = *view;
+    return 0;
+}
+
+/**
+ * Build NALU index serially.
+ * @return 0 on success, -1 on allocation failure.
+ */
+int BuildNaluIndex(const unsigned char *data, size_t size, NALU_INDEX *index) {
+    NALU_ITER it;
+    NALU_VIEW view;
+    memset(index, 0, sizeof(NALU_INDEX));
+    NaluIterInit(&it, data, size);
+    while (NaluIterNext(&it, &view)) {
+        if (NaluIndexAppend(index, &view) != 0) {
+            FreeNaluIndex(index);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    size_t begin;                 //! 本段的起始位置
+    size_t end;                   //! 本段的结束位置（起始码的第一个字节必须小于它）
+    size_t *codes;                //! 找到的起始码位置（00 00 01 中第一个 00 的位置）
+    size_t count;
+    size_t capacity;
+    int error;
+} START_CODE_CHUNK;
+
+static void ScanStartCodeChunk(const unsigned char *data, size_t size, START_CODE_CHUNK *chunk) {
+    // 多看2个字节，保证跨越边界的 00 00 01 能被找到
+    const unsigned char *end = data + (chunk->end + 2 < size ? chunk->end + 2 : size);
+    const unsigned char *p = data + chunk->begin;
+    while ((p = FindStartCode(p, end)) != end) {
+        if (p >= data + chunk->end) {
+            break;
+        }
+        if (chunk->count == chunk->capacity) {
+            size_t capacity = chunk->capacity ? chunk->capacity * 2 : 256;
+            size_t *codes = (size_t *) realloc(chunk->codes, capacity * sizeof(size_t));
+            if (codes == NULL) {
+                chunk->error = 1;
+                return;
+            }
+            chunk->codes = codes;
+            chunk->capacity = capacity;
+        }
+        chunk->codes[chunk->count++] = (size_t) (p - data);
+        // 起始码之间不会互相重叠，直接跳过3个字节
+        p += 3;
+    }
+}
+
+/**
+ * Build NALU index with several threads. The result is identical to BuildNaluIndex.
+ * @param nthreads    Number of threads (byte ranges).
+ * @return 0 on success, -1 on failure.
+ */
+int BuildNaluIndexParallel(const unsigned char *data, size_t size, int nthreads, NALU_INDEX *index) {
+    if (nthreads <= 1 || size < (size_t) nthreads) {
+        return BuildNaluIndex(data, size, index);
+    }
+    memset(index, 0, sizeof(NALU_INDEX));
+
+    START_CODE_CHUNK *chunks = (START_CODE_CHUNK *) calloc(nthreads, sizeof(START_CODE_CHUNK));
+    std::thread *threads = new std::thread[nthreads];
+    if (chunks == NULL) {
+        delete[] threads;
+        return -1;
+    }
+    size_t step = size / nthreads;
+    for (int i = 0; i < nthreads; i++) {
+        chunks[i].begin = step * i;
+        chunks[i].end = (i == nthreads - 1) ? size : step * (i + 1);
+        threads[i] = std::thread(ScanStartCodeChunk, data, size, &chunks[i]);
+    }
+    int ret = 0;
+    for (int i = 0; i < nthreads; i++) {
+        threads[i].join();
+        if (chunks[i].error) {
+            ret = -1;
+        }
+    }
+    delete[] threads;
+
+    // 按顺序拼接各段的起始码，切分规则与 ScanAnnexbNALU 相同
+    int have_prev = 0;
+    NALU_VIEW view;
+    for (int i = 0; i < nthreads && ret == 0; i++) {
+        for (size_t k = 0; k < chunks[i].count && ret == 0; k++) {
+            size_t sc = chunks[i].codes[k];
+            int four = sc > 0 && data[sc - 1] == 0;
+            if (have_prev) {
+                view.length = sc - (four ? 1 : 0) - view.offset;
+                view.header = view.length > 0 ? data[view.offset] : 0;
+                ret = NaluIndexAppend(index, &view);
+            }
+            view.offset = sc + 3;
+            view.startcodeprefix_len = four ? 4 : 3;
+            have_prev = 1;
+        }
+    }
+    if (have_prev && ret == 0) {
+        // 最后一个NALU一直延伸到文件末尾
+        view.length = size - view.offset;
+        view.header = view.length > 0 ? data[view.offset] : 0;
+        ret = NaluIndexAppend(index, &view);
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        free(chunks[i].codes);
+    }
+    free(chunks);
+    if (ret != 0) {
+        FreeNaluIndex(index);
+    }
+    return ret;
+}
+
+// 每个CPU核心一个线程，但每个线程至少处理 4MB，小文件没必要开很多线程
+static int DefaultIndexThreads(size_t size) {
+    size_t max_threads = size / (4 << 20) + 1;
+    int nthreads = (int) std::thread::hardware_concurrency();
+    if (nthreads <= 0) {
+        nthreads = 1;
+    }
+    if ((size_t) nthreads > max_threads) {
+        nthreads = (int) max_threads;
+    }
+    return nthreads;
+}
+
+/**
+ * Analysis H.264 Bitstream with a multi-threaded indexer.
+ * 输出与 simplest_h264_parser 相同的 NALU Table
+ * @param url         Location of input H.264 bitstream file.
+ * @param nthreads    Number of threads, 0 means one per CPU core.
+ */
+int simplest_h264_parser_parallel(char *url, int nthreads) {
+    FILE *myout = stdout;
+
+    H264_MAP map;
+    if (MapH264File(url, &map) != 0) {
+        printf("Open file error\n");
+        return 0;
+    }
+    if (nthreads <= 0) {
+        nthreads = DefaultIndexThreads(map.size);
+    }
+
+    NALU_INDEX index;
+    if (BuildNaluIndexParallel(map.data, map.size, nthreads, &index) != 0) {
+        printf("Build NALU index error\n");
+        UnmapH264File(&map);
+        return 0;
+    }
+
+    // 参数集和 POC 与NALU的顺序有关，所以片头解析仍然按顺序进行
+    H264_PARSER_CTX *ctx = (H264_PARSER_CTX *) calloc(1, sizeof(H264_PARSER_CTX));
+    if (ctx == NULL) {
+        printf("Alloc parser context error\n");
+        FreeNaluIndex(&index);
+        UnmapH264File(&map);
+        return 0;
+    }
+    char info[64];
+    PrintNaluTableHeader(myout);
+    for (size_t i = 0; i < index.count; i++) {
+        FormatNaluInfo(ctx, map.data + index.entries[i].offset, index.entries[i].length, info, sizeof(info));
+        PrintNaluTableRow(myout, (int) i, &index.entries[i], info);
+    }
+
+    free(ctx);
+    FreeNaluIndex(&index);
+    UnmapH264File(&map);
+    return 0;
+}
+
+
+/* ====================== NALU/GOP 索引文件（sidecar） ======================
+ * 每次查询都要从头扫描整个码流。这里把扫描结果保存到 <url>.idx 中，之后直接读取索引：
+ *
+ *   Header (56 bytes, little-endian)
+ *     magic "NIDX" | version(4) | file_size(8) | file_mtime(8) | frame_count(4) | reserved(4)
+ *     nalu_count(8) | idr_count(8) | tail_hash(8)
+ *   NALU entry (16 bytes) * nalu_count
+ *     offset(8) | length(4) | nal_unit_type(1) | nal_reference_idc(1) | startcodeprefix_len(1) | flags(1)
+ *   IDR entry (8 bytes) * idr_count
+ *     frame(4) | nalu(4)
+ *
+ * tail_hash 是建立索引时文件最后 H264_SIDECAR_TAIL_SIZE 字节的 FNV-1a 哈希。
+ * 文件大小、修改时间和 tail_hash 都与索引中记录的一致时索引有效（修改时间只精确到秒，同一秒内改写的文件靠哈希区分）；
+ * 如果文件变大了，并且原来的末尾哈希不变，说明码流只是在末尾追加了数据，
+ * 只需要从最后一个NALU开始重新扫描（最后一个NALU可能被追加的数据延长了）。其他情况重新建立索引。
+ */
+
+#define H264_SIDECAR_MAGIC          "NIDX"
+#define H264_SIDECAR_VERSION        2
+#define H264_SIDECAR_HEADER_SIZE    56
+#define H264_SIDECAR_TAIL_SIZE      (64 << 10)
+#define H264_SIDECAR_ENTRY_SIZE     16
+#define H264_SIDECAR_IDR_SIZE       8
+
+#define NALU_FLAG_FIRST_SLICE       0x01    // first_mb_in_slice == 0，也就是一帧的第一个片
+
+typedef struct {
+    unsigned long long offset;    //! NALU 在文件中的偏移（不包括起始码）
+    unsigned length;              //! NALU 的长度（不包括起始码）
+    unsigned char nal_unit_type;
+    unsigned char nal_reference_idc;
+    unsigned char startcodeprefix_len;
+    unsigned char flags;          //! NALU_FLAG_*
+} NALU_INDEX_ENTRY;
+
+typedef struct {
+    unsigned frame;               //! IDR 帧的帧号（从0开始计数）
+    unsigned nalu;                //! IDR 所在访问单元的第一个NALU（包括前面的 SPS/PPS/SEI/AUD）的序号
+} IDR_INDEX_ENTRY;
+
+typedef struct {
+    unsigned long long file_size; //! 建立索引时的文件大小
+    long long file_mtime;         //! 建立索引时的文件修改时间
+    unsigned long long tail_hash; //! 建立索引时文件末尾的哈希
+    unsigned frame_count;         //! 总帧数
+    NALU_INDEX_ENTRY *nalus;
+    size_t nalu_count, nalu_capacity;
+    IDR_INDEX_ENTRY *idrs;
+    size_t idr_count, idr_capacity;
+    size_t au_start;              //! 当前访问单元的第一个NALU（用于确定 IDR 前面的参数集）
+} H264_SIDECAR;
+
+static void PutLE32(unsigned char *p, unsigned v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static void PutLE64(unsigned char *p, unsigned long long v) {
+    PutLE32(p, (unsigned) (v & 0xffffffff));
+    PutLE32(p + 4, (unsigned) (v >> 32));
+}
+
+static unsigned GetLE32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned) p[3] << 24);
+}
+
+static unsigned long long GetLE64(const unsigned char *p) {
+    return GetLE32(p) | ((unsigned long long) GetLE32(p + 4) << 32);
+}
+
+void FreeH264Sidecar(H264_SIDECAR *sc) {
+    free(sc->nalus);
+    free(sc->idrs);
+    memset(sc, 0, sizeof(H264_SIDECAR));
+}
+
+static int IsVclNalu(int nal_unit_type) {
+    return nal_unit_type >= NALU_TYPE_SLICE && nal_unit_type <= NALU_TYPE_IDR;
+}
+
+// 追加一个NALU，同时更新帧号和 IDR 表
+static int SidecarAppend(H264_SIDECAR *sc, const NALU_INDEX_ENTRY *entry) {
+    if (sc->nalu_count == sc->nalu_capacity) {
+        size_t capacity = sc->nalu_capacity ? sc->nalu_capacity * 2 : 1024;
+        NALU_INDEX_ENTRY *nalus = (NALU_INDEX_ENTRY *) realloc(sc->nalus, capacity * sizeof(NALU_INDEX_ENTRY));
+        if (nalus == NULL) {
+            return -1;
+        }
+        sc->nalus = nalus;
+        sc->nalu_capacity = capacity;
+    }
+    size_t idx = sc->nalu_count;
+    sc->nalus[sc->nalu_count++] = *entry;
+
+    if (!IsVclNalu(entry->nal_unit_type)) {
+        return 0;
+    }
+    if (entry->flags & NALU_FLAG_FIRST_SLICE) {
+        if (entry->nal_unit_type == NALU_TYPE_IDR) {
+            if (sc->idr_count == sc->idr_capacity) {
+                size_t capacity = sc->idr_capacity ? sc->idr_capacity * 2 : 64;
+                IDR_INDEX_ENTRY *idrs = (IDR_INDEX_ENTRY *) realloc(sc->idrs, capacity * sizeof(IDR_INDEX_ENTRY));
+                if (idrs == NULL) {
+                    return -1;
+                }
+                sc->idrs = idrs;
+                sc->idr_capacity = capacity;
+            }
+            sc->idrs[sc->idr_count].frame = sc->frame_count;
+            sc->idrs[sc->idr_count].nalu = (unsigned) sc->au_start;
+            sc->idr_count++;
+        }
+        sc->frame_count++;
+    }
+    // 片之后的非VCL NALU 属于下一个访问单元
+    sc->au_start = idx + 1;
+    return 0;
+}
+
+// 去掉最后一个NALU（追加数据以后它可能变长了，需要重新扫描）
+static void SidecarDropLast(H264_SIDECAR *sc) {
+    if (sc->nalu_count == 0) {
+        return;
+    }
+    const NALU_INDEX_ENTRY *last = &sc->nalus[--sc->nalu_count];
+    if (IsVclNalu(last->nal_unit_type) && (last->flags & NALU_FLAG_FIRST_SLICE)) {
+        sc->frame_count--;
+        while (sc->idr_count > 0 && sc->idrs[sc->idr_count - 1].frame >= sc->frame_count) {
+            sc->idr_count--;
+        }
+    }
+    // 重新确定当前访问单元的起点：最后一个片之后的第一个NALU
+    size_t i = sc->nalu_count;
+    while (i > 0 && !IsVclNalu(sc->nalus[i - 1].nal_unit_type)) {
+        i--;
+    }
+    sc->au_start = i;
+}
+
+// 从 pos 开始扫描（pos 必须是某个起始码的位置），把NALU追加到索引中
+static int SidecarScan(H264_SIDECAR *sc, const unsigned char *data, size_t size, size_t pos) {
+    NALU_ITER it;
+    NALU_VIEW view;
+    NaluIterInit(&it, data, size);
+    it.pos = pos;
+    while (NaluIterNext(&it, &view)) {
+        NALU_INDEX_ENTRY entry;
+        entry.offset = view.offset;
+        entry.length = (unsigned) view.length;
+        entry.nal_unit_type = NALU_VIEW_TYPE(&view);
+        entry.nal_reference_idc = NALU_VIEW_IDC(&view);
+        entry.startcodeprefix_len = (unsigned char) view.startcodeprefix_len;
+        entry.flags = 0;
+        // first_mb_in_slice 是片头的第一个 ue(v)，等于0时编码为一个比特 '1'
+        if (IsVclNalu(entry.nal_unit_type) && view.length > 1 && (data[view.offset + 1] & 0x80)) {
+            entry.flags |= NALU_FLAG_FIRST_SLICE;
+        }
+        if (SidecarAppend(sc, &entry) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// 大小为 end 的文件末尾参与哈希的数据的起始位置
+#define SIDECAR_TAIL_START(end)     ((end) > H264_SIDECAR_TAIL_SIZE ? (end) - H264_SIDECAR_TAIL_SIZE : 0)
+
+// FNV-1a 哈希
+static unsigned long long SidecarHash(const unsigned char *p, size_t len) {
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// 映射到内存的整个文件中 [SIDECAR_TAIL_START(end), end) 的哈希
+static unsigned long long SidecarTailHash(const unsigned char *data, unsigned long long end) {
+    unsigned long long start = SIDECAR_TAIL_START(end);
+    return SidecarHash(data + start, (size_t) (end - start));
+}
+
+// 只读出文件末尾计算哈希，索引有效时不需要映射整个文件
+static int ReadSidecarTailHash(const char *url, unsigned long long end, unsigned long long *hash) {
+    static unsigned char buf[H264_SIDECAR_TAIL_SIZE];
+    unsigned long long start = SIDECAR_TAIL_START(end);
+    size_t len = (size_t) (end - start);
+#ifndef _WIN32
+    int fd = open(url, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    int ok = pread(fd, buf, len, (off_t) start) == (ssize_t) len;
+    close(fd);
+#else
+    int fd = _open(url, _O_RDONLY | _O_BINARY);
+    if (fd < 0) {
+        return -1;
+    }
+    _lseeki64(fd, (long long) start, SEEK_SET);
+    int ok = _read(fd, buf, (unsigned) len) == (int) len;
+    _close(fd);
+#endif
+    if (!ok) {
+        return -1;
+    }
+    *hash = SidecarHash(buf, len);
+    return 0;
+}
+
+static int LoadH264Sidecar(const char *path, H264_SIDECAR *sc) {
+    memset(sc, 0, sizeof(H264_SIDECAR));
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return -1;
+    }
+    unsigned char header[H264_SIDECAR_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header) ||
+        memcmp(header, H264_SIDECAR_MAGIC, 4) != 0 || GetLE32(header + 4) != H264_SIDECAR_VERSION) {
+        fclose(fp);
+        return -1;
+    }
+    sc->file_size = GetLE64(header + 8);
+    sc->file_mtime = (long long) GetLE64(header + 16);
+    sc->frame_count = GetLE32(header + 24);
+    size_t nalu_count = (size_t) GetLE64(header + 32);
+    size_t idr_count = (size_t) GetLE64(header + 40);
+    sc->tail_hash = GetLE64(header + 48);
+
+    size_t bytes = nalu_count * H264_SIDECAR_ENTRY_SIZE + idr_count * H264_SIDECAR_IDR_SIZE;
+    unsigned char *buf = (unsigned char *) malloc(bytes > 0 ? bytes : 1);
+    sc->nalus = (NALU_INDEX_ENTRY *) malloc((nalu_count > 0 ? nalu_count : 1) * sizeof(NALU_INDEX_ENTRY));
+    sc->idrs = (IDR_INDEX_ENTRY *) malloc((idr_count > 0 ? idr_count : 1) * sizeof(IDR_INDEX_ENTRY));
+    if (buf == NULL || sc->nalus == NULL || sc->idrs == NULL || fread(buf, 1, bytes, fp) != bytes) {
+        free(buf);
+        fclose(fp);
+        FreeH264Sidecar(sc);
+        return -1;
+    }
+    fclose(fp);
+
+    const unsigned char *p = buf;
+    for (size_t i = 0; i < nalu_count; i++, p += H264_SIDECAR_ENTRY_SIZE) {
+        sc->nalus[i].offset = GetLE64(p);
+        sc->nalus[i].length = GetLE32(p + 8);
+        sc->nalus[i].nal_unit_type = p[12];
+        sc->nalus[i].nal_reference_idc = p[13];
+        sc->nalus[i].startcodeprefix_len = p[14];
+        sc->nalus[i].flags = p[15];
+    }
+    for (size_t i = 0; i < idr_count; i++, p += H264_SIDECAR_IDR_SIZE) {
+        sc->idrs[i].frame = GetLE32(p);
+        sc->idrs[i].nalu = GetLE32(p + 4);
+    }
+    free(buf);
+    sc->nalu_count = sc->nalu_capacity = nalu_count;
+    sc->idr_count = sc->idr_capacity = idr_count;
+
+    size_t i = sc->nalu_count;
+    while (i > 0 && !IsVclNalu(sc->nalus[i - 1].nal_unit_type)) {
+        i--;
+    }
+    sc->au_start = i;
+    return 0;
+}
+
+static int SaveH264Sidecar(const char *path, const H264_SIDECAR *sc) {
+    // 先写到临时文件再改名，避免写到一半的索引被别人读到
+    char tmp_path[1040];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *fp = fopen(tmp_path, "wb");
+    if (fp == NULL) {
+        return -1;
+    }
+    unsigned char header[H264_SIDECAR_HEADER_SIZE] = {0};
+    memcpy(header, H264_SIDECAR_MAGIC, 4);
+    PutLE32(header + 4, H264_SIDECAR_VERSION);
+    PutLE64(header + 8, sc->file_size);
+    PutLE64(header + 16, (unsigned long long) sc->file_mtime);
+    PutLE32(header + 24, sc->frame_count);
+    PutLE64(header + 32, sc->nalu_count);
+    PutLE64(header + 40, sc->idr_count);
+    PutLE64(header + 48, sc->tail_hash);
+    int ok = fwrite(header, 1, sizeof(header), fp) == sizeof(header);
+
+    unsigned char rec[H264_SIDECAR_ENTRY_SIZE];
+    for (size_t i = 0; ok && i < sc->nalu_count; i++) {
+        PutLE64(rec, sc->nalus[i].offset);
+        PutLE32(rec + 8, sc->nalus[i].length);
+        rec[12] = sc->nalus[i].nal_unit_type;
+        rec[13] = sc->nalus[i].nal_reference_idc;
+        rec[14] = sc->nalus[i].startcodeprefix_len;
+        rec[15] = sc->nalus[i].flags;
+        ok = fwrite(rec, 1, sizeof(rec), fp) == sizeof(rec);
+    }
+    for (size_t i = 0; ok && i < sc->idr_count; i++) {
+        PutLE32(rec, sc->idrs[i].frame);
+        PutLE32(rec + 4, sc->idrs[i].nalu);
+        ok = fwrite(rec, 1, H264_SIDECAR_IDR_SIZE, fp) == H264_SIDECAR_IDR_SIZE;
+    }
+    if (fclose(fp) != 0 || !ok) {
+        remove(tmp_path);
+        return -1;
+    }
+    return rename(tmp_path, path);
+}
+
+/**
+ * Open (load, update or build) the sidecar index of an H.264 file.
+ * @param url       Location of input H.264 bitstream file. The index is stored in <url>.idx.
+ * @param sc        Output index.
+ * @param status    Optional, set to "loaded", "appended" or "rebuilt".
+ * @return 0 on success, -1 on failure.
+ */
+int OpenH264Sidecar(const char *url, H264_SIDECAR *sc, const char **status) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s.idx", url);
+
+    struct stat st;
+    if (stat(url, &st) != 0) {
+        return -1;
+    }
+    unsigned long long file_size = (unsigned long long) st.st_size;
+    long long file_mtime = (long long) st.st_mtime;
+
+    int have_index = LoadH264Sidecar(path, sc) == 0;
+    unsigned long long tail_hash;
+    if (have_index && sc->file_size == file_size && sc->file_mtime == file_mtime &&
+        ReadSidecarTailHash(url, file_size, &tail_hash) == 0 && tail_hash == sc->tail_hash) {
+        if (status) *status = "loaded";
+        return 0;
+    }
+
+    H264_MAP map;
+    if (MapH264File(url, &map) != 0) {
+        FreeH264Sidecar(sc);
+        return -1;
+    }
+    int ret = 0, appended = 0;
+    // 只是在末尾追加了数据：原来的文件末尾没有变，最后一个NALU的起始码还在原来的位置
+    if (have_index && sc->nalu_count > 0 && map.size > sc->file_size &&
+        SidecarTailHash(map.data, sc->file_size) == sc->tail_hash) {
+        const NALU_INDEX_ENTRY *last = &sc->nalus[sc->nalu_count - 1];
+        size_t pos = (size_t) (last->offset - last->startcodeprefix_len);
+        if (last->offset + last->length == sc->file_size && last->offset >= 3 &&
+            memcmp(map.data + last->offset - 3, "\x00\x00\x01", 3) == 0) {
+            SidecarDropLast(sc);
+            ret = SidecarScan(sc, map.data, map.size, pos);
+            appended = 1;
+        }
+    }
+    if (!appended) {
+        FreeH264Sidecar(sc);
+        ret = SidecarScan(sc, map.data, map.size, 0);
+    }
+    if (status) *status = appended ? "appended" : "rebuilt";
+
+    // 索引覆盖的是映射到的数据，大小以映射为准
+    sc->tail_hash = SidecarTailHash(map.data, map.size);
+    file_size = map.size;
+    UnmapH264File(&map);
+    if (ret != 0) {
+        FreeH264Sidecar(sc);
+        return -1;
+    }
+    sc->file_size = file_size;
+    sc->file_mtime = file_mtime;
+    if (SaveH264Sidecar(path, sc) != 0) {
+        printf("Write index file error: %s\n", path);
+    }
+    return 0;
+}
+
+/**
+ * Find the nearest IDR at or before the given frame.
+ * @param frame      Frame number (0 based, in decoding order).
+ * @param offset     Output, file offset of the IDR access unit (SPS/PPS/SEI in front of the IDR included).
+ * @param idr_frame  Output, frame number of that IDR.
+ * @return 0 on success, -1 if there is no IDR at or before the frame.
+ */
+int H264SidecarSeek(const H264_SIDECAR *sc, unsigned frame, unsigned long long *offset, unsigned *idr_frame) {
+    // 二分查找最后一个 frame 不大于目标帧的 IDR
+    size_t lo = 0, hi = sc->idr_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (sc->idrs[mid].frame <= frame) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return -1;
+    }
+    const IDR_INDEX_ENTRY *idr = &sc->idrs[lo - 1];
+    const NALU_INDEX_ENTRY *first = &sc->nalus[idr->nalu];
+    *offset = first->offset - first->startcodeprefix_len;
+    *idr_frame = idr->frame;
+    return 0;
+}
+
+/**
+ * Seek to the nearest IDR of a frame using the sidecar index.
+ * @param url      Location of input H.264 bitstream file.
+ * @param frame    Frame number.
+ */
+int simplest_h264_seek(char *url, unsigned frame) {
+    FILE *myout = stdout;
+    H264_SIDECAR sc;
+    const char *status = "";
+
+    if (OpenH264Sidecar(url, &sc, &status) != 0) {
+        printf("Open file error\n");
+        return -1;
+    }
+    fprintf(myout, "Index %s: %llu NALUs, %u frames, %llu IDRs\n", status,
+            (unsigned long long) sc.nalu_count, sc.frame_count, (unsigned long long) sc.idr_count);
+
+    unsigned long long offset;
+    unsigned idr_frame;
+    if (H264SidecarSeek(&sc, frame, &offset, &idr_frame) == 0) {
+        fprintf(myout, "Frame %u -> IDR frame %u at offset %llu\n", frame, idr_frame, offset);
+    } else {
+        fprintf(myout, "Frame %u: no IDR before it\n", frame);
+    }
+    FreeH264Sidecar(&sc);
+    return 0;
+}
+
+
+/* ====================== 访问单元（AU）与 GOP 组装 ======================
+ * 把NALU按 7.4.1.2.3 的规则组成访问单元（一帧），再以 IDR 为界把帧组成 GOP。
+ * 每个 GOP 结束时立即通过回调输出统计信息，不需要等整个码流扫描完。
+ */
+
+#define GOP_MAX_WINDOW      1024    // 滑动窗口最多包含的帧数
+
+typedef enum {
+    FRAME_TYPE_I = 0,
+    FRAME_TYPE_P = 1,
+    FRAME_TYPE_B = 2,
+} FrameType;
+
+typedef struct {
+    int index;                          //! GOP 序号
+    unsigned start_frame;               //! GOP 第一帧的帧号
+    unsigned frames;                    //! 帧数（也就是 IDR 间隔，单位：帧）
+    int starts_with_idr;                //! 码流开头的帧不一定是 IDR
+    double duration;                    //! 时长（秒）
+    unsigned type_frames[3];            //! I/P/B 帧数
+    unsigned long long type_bytes[3];   //! I/P/B 帧的字节数
+    double avg_bitrate;                 //! 平均码率（bps）
+    double peak_bitrate;                //! 滑动窗口内的最大码率（bps）
+} H264_GOP_STAT;
+
+typedef void (*GOP_STAT_CALLBACK)(void *opaque, const H264_GOP_STAT *stat);
+
+typedef struct {
+    H264_PARSER_CTX *ctx;
+    GOP_STAT_CALLBACK callback;
+    void *opaque;
+    double fps;                         //! 帧率，0 表示从 SPS 的 timing_info 中获取
+    // 当前访问单元
+    int au_has_vcl;
+    int au_type;
+    int au_idr;
+    unsigned long long au_bytes;
+    H264_SLICE_HEADER au_sh;            //! 当前访问单元第一个片的片头
+    // 当前 GOP
+    H264_GOP_STAT gop;
+    unsigned frame_count;
+    // 码率滑动窗口
+    unsigned window_size;
+    unsigned window_fill;
+    unsigned window_pos;
+    unsigned long long window_sum;
+    unsigned long long window[GOP_MAX_WINDOW];
+} H264_GOP_ASSEMBLER;
+
+/**
+ * Init the AU/GOP assembler.
+ * @param ctx         Parser context used to parse SPS/PPS/slice headers.
+ * @param fps         Frame rate, 0 means taken from SPS VUI (25 if not present).
+ * @param callback    Called once per finished GOP.
+ */
+void GopAssemblerInit(H264_GOP_ASSEMBLER *ga, H264_PARSER_CTX *ctx, double fps,
+                      GOP_STAT_CALLBACK callback, void *opaque) {
+    memset(ga, 0, sizeof(H264_GOP_ASSEMBLER));
+    ga->ctx = ctx;
+    ga->fps = fps;
+    ga->callback = callback;
+    ga->opaque = opaque;
+}
+
+// 判断一个片是否属于新的图像（7.4.1.2.4）
+static int IsNewPicture(const H264_SLICE_HEADER *prev, const H264_SLICE_HEADER *sh) {
+    return sh->first_mb_in_slice == 0 ||
+           sh->frame_num != prev->frame_num ||
+           sh->pic_parameter_set_id != prev->pic_parameter_set_id ||
+           sh->field_pic_flag != prev->field_pic_flag ||
+           sh->bottom_field_flag != prev->bottom_field_flag ||
+           (sh->nal_ref_idc == 0) != (prev->nal_ref_idc == 0) ||
+           sh->pic_order_cnt_lsb != prev->pic_order_cnt_lsb ||
+           sh->delta_pic_order_cnt_bottom != prev->delta_pic_order_cnt_bottom ||
+           sh->delta_pic_order_cnt[0] != prev->delta_pic_order_cnt[0] ||
+           sh->delta_pic_order_cnt[1] != prev->delta_pic_order_cnt[1] ||
+           (sh->nal_unit_type == NALU_TYPE_IDR) != (prev->nal_unit_type == NALU_TYPE_IDR) ||
+           (sh->nal_unit_type == NALU_TYPE_IDR && sh->idr_pic_id != prev->idr_pic_id);
+}
+
+static int SliceFrameType(int slice_type) {
+    switch (slice_type % 5) {
+        case SLICE_TYPE_B:
+            return FRAME_TYPE_B;
+        case SLICE_TYPE_P:
+        case SLICE_TYPE_SP:
+            return FRAME_TYPE_P;
+        default:
+            return FRAME_TYPE_I;
+    }
+}
+
+static double GopAssemblerFps(const H264_GOP_ASSEMBLER *ga) {
+    if (ga->fps > 0) {
+        return ga->fps;
+    }
+    const H264_SPS *sps = ga->ctx->active_sps;
+    if (sps != NULL && sps->timing_info_present_flag && sps->num_units_in_tick > 0) {
+        // 一帧有两个场，所以要除以2
+        return (double) sps->time_scale / (2.0 * sps->num_units_in_tick);
+    }
+    return 25.0;
+}
+
+static void EmitGop(H264_GOP_ASSEMBLER *ga) {
+    H264_GOP_STAT *gop = &ga->gop;
+    if (gop->frames == 0) {
+        return;
+    }
+    double fps = GopAssemblerFps(ga);
+    unsigned long long bytes = gop->type_bytes[0] + gop->type_bytes[1] + gop->type_bytes[2];
+    gop->duration = gop->frames / fps;
+    gop->avg_bitrate = bytes * 8.0 / gop->duration;
+    // GOP 比窗口还短，窗口一次都没有填满的时候，峰值就是平均值
+    if (gop->peak_bitrate < gop->avg_bitrate && ga->window_fill < ga->window_size) {
+        gop->peak_bitrate = gop->avg_bitrate;
+    }
+    if (ga->callback) {
+        ga->callback(ga->opaque, gop);
+    }
+    int index = gop->index + 1;
+    memset(gop, 0, sizeof(H264_GOP_STAT));
+    gop->index = index;
+    gop->start_frame = ga->frame_count;
+}
+
+// 一个访问单元结束：把这一帧加到 GOP 和码率窗口中
+static void CloseAccessUnit(H264_GOP_ASSEMBLER *ga) {
+    if (ga->au_has_vcl) {
+        if (ga->au_idr) {
+            EmitGop(ga);
+            ga->gop.starts_with_idr = 1;
+        }
+        ga->gop.frames++;
+        ga->gop.type_frames[ga->au_type]++;
+        ga->gop.type_bytes[ga->au_type] += ga->au_bytes;
+        ga->frame_count++;
+
+        // 窗口长度为1秒
+        if (ga->window_size == 0) {
+            double fps = GopAssemblerFps(ga);
+            ga->window_size = fps < 1 ? 1 : (fps > GOP_MAX_WINDOW ? GOP_MAX_WINDOW : (unsigned) (fps + 0.5));
+        }
+        if (ga->window_fill == ga->window_size) {
+            ga->window_sum -= ga->window[ga->window_pos];
+        } else {
+            ga->window_fill++;
+        }
+        ga->window[ga->window_pos] = ga->au_bytes;
+        ga->window_sum += ga->au_bytes;
+        ga->window_pos = (ga->window_pos + 1) % ga->window_size;
+        if (ga->window_fill == ga->window_size) {
+            double bitrate = ga->window_sum * 8.0 * GopAssemblerFps(ga) / ga->window_size;
+            if (bitrate > ga->gop.peak_bitrate) {
+                ga->gop.peak_bitrate = bitrate;
+            }
+        }
+    }
+    ga->au_has_vcl = 0;
+    ga->au_idr = 0;
+    ga->au_type = FRAME_TYPE_I;
+    ga->au_bytes = 0;
+}
+
+/**
+ * Push one NALU into the assembler.
+ * @param nal           NALU data (starting with the NALU header byte).
+ * @param len           NALU length.
+ * @param prefix_len    Start code length, counted in the frame size.
+ */
+void GopAssemblerPush(H264_GOP_ASSEMBLER *ga, const unsigned char *nal, size_t len, int prefix_len) {
+    if (len == 0) {
+        ga->au_bytes += prefix_len;
+        return;
+    }
+    int nal_unit_type = nal[0] & 0x1f;
+    H264_SLICE_HEADER sh;
+    int ret = H264ParseNalu(ga->ctx, nal, len, &sh);
+
+    if (IsVclNalu(nal_unit_type)) {
+        if (ret == 1) {
+            if (ga->au_has_vcl && IsNewPicture(&ga->au_sh, &sh)) {
+                CloseAccessUnit(ga);
+            }
+            if (!ga->au_has_vcl) {
+                ga->au_sh = sh;
+            }
+            int type = SliceFrameType(sh.slice_type);
+            if (type > ga->au_type || !ga->au_has_vcl) {
+                ga->au_type = type;
+            }
+        }
+        ga->au_has_vcl = 1;
+        ga->au_idr |= nal_unit_type == NALU_TYPE_IDR;
+    } else if ((nal_unit_type >= NALU_TYPE_SEI && nal_unit_type <= NALU_TYPE_AUD) ||
+               (nal_unit_type >= 14 && nal_unit_type <= 18)) {
+        // SEI/SPS/PPS/AUD 出现在片之后，说明新的访问单元开始了
+        if (ga->au_has_vcl) {
+            CloseAccessUnit(ga);
+        }
+    }
+    ga->au_bytes += len + prefix_len;
+}
+
+/**
+ * Flush the last access unit and GOP at the end of the stream.
+ */
+void GopAssemblerFlush(H264_GOP_ASSEMBLER *ga) {
+    CloseAccessUnit(ga);
+    EmitGop(ga);
+}
+
+static void PrintGopStat(void *opaque, const H264_GOP_STAT *gop) {
+    FILE *myout = (FILE *) opaque;
+    fprintf(myout, "%5d| %6u| %6u| %7.2fs| %4u/%9llu| %4u/%9llu| %4u/%9llu| %9.1f| %9.1f|%s\n",
+            gop->index, gop->start_frame, gop->frames, gop->duration,
+            gop->type_frames[FRAME_TYPE_I], gop->type_bytes[FRAME_TYPE_I],
+            gop->type_frames[FRAME_TYPE_P], gop->type_bytes[FRAME_TYPE_P],
+            gop->type_frames[FRAME_TYPE_B], gop->type_bytes[FRAME_TYPE_B],
+            gop->avg_bitrate / 1000, gop->peak_bitrate / 1000, gop->starts_with_idr ? "" : " (open)");
+}
+
+/**
+ * Analysis GOP structure of H.264 Bitstream
+ * @param url    Location of input H.264 bitstream file.
+ * @param fps    Frame rate, 0 means taken from SPS VUI (25 if not present).
+ */
+int simplest_h264_gop_parser(char *url, double fps) {
+    FILE *myout = stdout;
+
+    H264_MAP map;
+    if (MapH264File(url, &map) != 0) {
+        printf("Open file error\n");
+        return 0;
+    }
+    H264_PARSER_CTX *ctx = (H264_PARSER_CTX *) calloc(1, sizeof(H264_PARSER_CTX));
+    H264_GOP_ASSEMBLER *ga = (H264_GOP_ASSEMBLER *) malloc(sizeof(H264_GOP_ASSEMBLER));
+    if (ctx == NULL || ga == NULL) {
+        printf("Alloc parser context error\n");
+        free(ctx);
+        free(ga);
+        UnmapH264File(&map);
+        return 0;
+    }
+    GopAssemblerInit(ga, ctx, fps, PrintGopStat, myout);
+
+    fprintf(myout, "-----+-------+-------+---------+---------------+---------------+---------------+----------+----------+\n");
+    fprintf(myout, " GOP | START | FRAMES| INTERVAL|   I num/bytes |   P num/bytes |   B num/bytes | AVG kbps | PEAK kbps|\n");
+    fprintf(myout, "-----+-------+-------+---------+---------------+---------------+---------------+----------+----------+\n");
+
+    NALU_ITER it;
+    NALU_VIEW nalu;
+    NaluIterInit(&it, map.data, map.size);
+    while (NaluIterNext(&it, &nalu)) {
+        GopAssemblerPush(ga, map.data + nalu.offset, nalu.length, nalu.startcodeprefix_len);
+    }
+    GopAssemblerFlush(ga);
+
+    free(ga);
+    free(ctx);
+    UnmapH264File(&map);
+    return 0;
+}
+
+
+/* ====================== Annex B ⇄ AVCC 转换 ======================
+ * Annex B：每个NALU前面是 00 00 01 / 00 00 00 01 起始码（h264 裸流）。
+ * AVCC：每个NALU前面是4字节的大端长度，SPS/PPS 放在单独的 AVCDecoderConfigurationRecord（avcC）中（FLV/MP4）。
+ *
+ * 输入文件以可写的私有映射（写时复制）打开，4字节的起始码与4字节的长度大小相同，直接在映射中原地改写，
+ * 连续的NALU会合并成一整块；3字节起始码的NALU则把长度放在单独的小缓冲区里。
+ * 所有数据块最后通过 writev 一次写出多段，数据本身不经过任何拷贝。
+ */
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define H264_IOV_BATCH      (IOV_MAX < 1024 ? IOV_MAX : 1024)
+#define AVCC_MAX_SPS        31      // numOfSequenceParameterSets 只有5位
+#define AVCC_MAX_PPS        255     // numOfPictureParameterSets 8位
+
+typedef struct {
+    int fd;
+    struct iovec iov[H264_IOV_BATCH];
+    int count;
+    unsigned char prefix[H264_IOV_BATCH][4];    //! 单独写出的长度/起始码（每个 iov 最多用一个）
+    int prefix_count;
+    int error;
+    unsigned long long bytes;                   //! 已经写出的字节数
+} IOV_WRITER;
+
+static void IovWriterInit(IOV_WRITER *w, int fd) {
+    w->fd = fd;
+    w->count = 0;
+    w->prefix_count = 0;
+    w->error = 0;
+    w->bytes = 0;
+}
+
+static int IovWriterFlush(IOV_WRITER *w) {
+    struct iovec *iov = w->iov;
+    int count = w->count;
+    while (count > 0 && !w->error) {
+        long n = writev(w->fd, iov, count);
+        if (n < 0) {
+            w->error = 1;
+            break;
+        }
+        w->bytes += n;
+        // 只写出了一部分：跳过已经写完的段，继续写剩下的
+        while (count > 0 && (size_t) n >= iov->iov_len) {
+            n -= (long) iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    w->count = 0;
+    w->prefix_count = 0;
+    return w->error ? -1 : 0;
+}
+
+// 添加一段数据；与上一段在内存中相邻时直接合并
+static void IovWriterAdd(IOV_WRITER *w, const void *data, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    if (w->count > 0) {
+        struct iovec *last = &w->iov[w->count - 1];
+        if ((const char *) last->iov_base + last->iov_len == (const char *) data) {
+            last->iov_len += len;
+            return;
+        }
+    }
+    if (w->count == H264_IOV_BATCH) {
+        IovWriterFlush(w);
+    }
+    w->iov[w->count].iov_base = (void *) data;
+    w->iov[w->count].iov_len = len;
+    w->count++;
+}
+
+// 添加一个4字节的前缀（长度或者起始码），前缀存放在 writer 自己的缓冲区中
+static void IovWriterAddPrefix(IOV_WRITER *w, const unsigned char prefix[4]) {
+    // 保证前缀和后面的数据在同一批中写出之前，前缀缓冲区不会被覆盖
+    if (w->count >= H264_IOV_BATCH - 1 || w->prefix_count == H264_IOV_BATCH) {
+        IovWriterFlush(w);
+    }
+    unsigned char *p = w->prefix[w->prefix_count++];
+    memcpy(p, prefix, 4);
+    w->iov[w->count].iov_base = p;
+    w->iov[w->count].iov_len = 4;
+    w->count++;
+}
+
+static void PutBE32(unsigned char *p, unsigned v) {
+    p[0] = (v >> 24) & 0xff;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >> 8) & 0xff;
+    p[3] = v & 0xff;
+}
+
+typedef struct {
+    const unsigned char *sps[AVCC_MAX_SPS];
+    size_t sps_len[AVCC_MAX_SPS];
+    int sps_id[AVCC_MAX_SPS];     //! seq_parameter_set_id
+    int sps_count;
+    const unsigned char *pps[AVCC_MAX_PPS];
+    size_t pps_len[AVCC_MAX_PPS];
+    int pps_id[AVCC_MAX_PPS];     //! pic_parameter_set_id
+    int pps_count;
+    int length_size;              //! AVCC 中长度字段的字节数：1、2 或 4
+} AVCC_CONFIG;
+
+// 取出 SPS 的 seq_parameter_set_id 或 PPS 的 pic_parameter_set_id，出错返回 -1
+static int AvcCParamSetId(const unsigned char *nal, size_t len, int is_pps) {
+    unsigned char rbsp[16];
+    if (len < 2) {
+        return -1;
+    }
+    size_t n = EbspToRbsp(nal + 1, len - 1, rbsp, sizeof(rbsp));
+    BIT_READER br;
+    BitReaderInit(&br, rbsp, n);
+    if (!is_pps) {
+        ReadBits(&br, 24);      // profile_idc、constraint_set_flags、level_idc
+    }
+    unsigned id = ReadUE(&br);
+    if (BitReaderError(&br) || id >= (unsigned) (is_pps ? H264_MAX_PPS : H264_MAX_SPS)) {
+        return -1;
+    }
+    return (int) id;
+}
+
+/**
+ * Add an SPS or PPS to the avcC configuration, keyed by its id.
+ * 同样的参数集在码流中每个 IDR 前都会重复出现；id 相同的参数集只保留最新的一个（拼接、重新编码的码流会复用 id）。
+ * @param is_pps    0: SPS, 1: PPS.
+ * @return 0 on success, -1 if the id cannot be parsed or there are too many parameter sets.
+ */
+static int AvcCAddParamSet(AVCC_CONFIG *cfg, int is_pps, const unsigned char *nal, size_t len) {
+    const unsigned char **sets = is_pps ? cfg->pps : cfg->sps;
+    size_t *lens = is_pps ? cfg->pps_len : cfg->sps_len;
+    int *ids = is_pps ? cfg->pps_id : cfg->sps_id;
+    int *count = is_pps ? &cfg->pps_count : &cfg->sps_count;
+    int id = AvcCParamSetId(nal, len, is_pps);
+    if (id < 0) {
+        return -1;
+    }
+    for (int i = 0; i < *count; i++) {
+        if (ids[i] == id) {
+            sets[i] = nal;
+            lens[i] = len;
+            return 0;
+        }
+    }
+    if (*count == (is_pps ? AVCC_MAX_PPS : AVCC_MAX_SPS)) {
+        return -1;
+    }
+    sets[*count] = nal;
+    lens[*count] = len;
+    ids[*count] = id;
+    (*count)++;
+    return 0;
+}
+
+/**
+ * Build AVCDecoderConfigurationRecord (ISO/IEC 14496-15 5.2.4.1).
+ * @param out     Output buffer.
+ * @param size    Size of out.
+ * @return Size of the record, -1 on error.
+ */
+int BuildAvcCRecord(const AVCC_CONFIG *cfg, unsigned char *out, size_t size) {
+    if (cfg->sps_count == 0 || cfg->pps_count == 0 || cfg->sps_len[0] < 4 ||
+        cfg->sps_count > AVCC_MAX_SPS || cfg->pps_count > AVCC_MAX_PPS) {
+        return -1;
+    }
+    size_t need = 7 + 4;
+    for (int i = 0; i < cfg->sps_count; i++) need += 2 + cfg->sps_len[i];
+    for (int i = 0; i < cfg->pps_count; i++) need += 2 + cfg->pps_len[i];
+    if (need > size) {
+        return -1;
+    }
+    const unsigned char *sps = cfg->sps[0];
+    size_t n = 0;
+    out[n++] = 1;                               // configurationVersion
+    out[n++] = sps[1];                          // AVCProfileIndication
+    out[n++] = sps[2];                          // profile_compatibility
+    out[n++] = sps[3];                          // AVCLevelIndication
+    out[n++] = 0xfc | (cfg->length_size - 1);   // lengthSizeMinusOne
+    out[n++] = 0xe0 | cfg->sps_count;           // numOfSequenceParameterSets
+    for (int i = 0; i < cfg->sps_count; i++) {
+        out[n++] = (cfg->sps_len[i] >> 8) & 0xff;
+        out[n++] = cfg->sps_len[i] & 0xff;
+        memcpy(out + n, cfg->sps[i], cfg->sps_len[i]);
+        n += cfg->sps_len[i];
+    }
+    out[n++] = cfg->pps_count;                  // numOfPictureParameterSets
+    for (int i = 0; i < cfg->pps_count; i++) {
+        out[n++] = (cfg->pps_len[i] >> 8) & 0xff;
+        out[n++] = cfg->pps_len[i] & 0xff;
+        memcpy(out + n, cfg->pps[i], cfg->pps_len[i]);
+        n += cfg->pps_len[i];
+    }
+    // High 系列档次还要写出色度格式和位深
+    if (sps[1] == 100 || sps[1] == 110 || sps[1] == 122 || sps[1] == 144) {
+        H264_SPS info;
+        unsigned char rbsp[H264_PARAM_RBSP_SIZE];
+        size_t len = EbspToRbsp(sps + 1, cfg->sps_len[0] - 1, rbsp, sizeof(rbsp));
+        if (ParseSPS(rbsp, len, &info) != 0) {
+            return -1;
+        }
+        out[n++] = 0xfc | info.chroma_format_idc;
+        out[n++] = 0xf8 | (info.bit_depth_luma - 8);
+        out[n++] = 0xf8 | (info.bit_depth_chroma - 8);
+        out[n++] = 0;                           // numOfSequenceParameterSetExt
+    }
+    return (int) n;
+}
+
+/**
+ * Parse AVCDecoderConfigurationRecord. The parameter sets in cfg point into data.
+ * @return 0 on success, -1 on error.
+ */
+int ParseAvcCRecord(const unsigned char *data, size_t size, AVCC_CONFIG *cfg) {
+    memset(cfg, 0, sizeof(AVCC_CONFIG));
+    if (size < 7 || data[0] != 1) {
+        return -1;
+    }
+    cfg->length_size = (data[4] & 0x03) + 1;
+    if (cfg->length_size == 3) {
+        return -1;
+    }
+    size_t n = 5;
+    for (int pass = 0; pass < 2; pass++) {
+        if (n >= size) {
+            return -1;
+        }
+        int count = pass == 0 ? data[n++] & 0x1f : data[n++];
+        for (int i = 0; i < count; i++) {
+            if (n + 2 > size) {
+                return -1;
+            }
+            size_t len = (data[n] << 8) | data[n + 1];
+            n += 2;
+            if (n + len > size) {
+                return -1;
+            }
+            if (AvcCAddParamSet(cfg, pass, data + n, len) != 0) {
+                return -1;
+            }
+            n += len;
+        }
+    }
+    return 0;
+}
+
+static int WriteWholeFile(const char *path, const unsigned char *data, size_t size) {
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        return -1;
+    }
+    int ok = fwrite(data, 1, size, fp) == size;
+    return (fclose(fp) == 0 && ok) ? 0 : -1;
+}
+
+/**
+ * Convert Annex B to AVCC (4-byte length prefix).
+ * @param url              Input H.264 Annex B file.
+ * @param out_url          Output length-prefixed stream.
+ * @param avcc_url         Output AVCDecoderConfigurationRecord.
+ * @param keep_param_sets  1: keep SPS/PPS in the stream as well; 0: they only go into avcC.
+ * @return 0 on success, -1 on failure.
+ */
+int H264AnnexbToAvcc(const char *url, const char *out_url, const char *avcc_url, int keep_param_sets) {
+    H264_MAP map;
+    if (MapH264FileEx(url, &map, 1) != 0) {
+        printf("Open file error\n");
+        return -1;
+    }
+    int fd = open(out_url, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0) {
+        printf("Open output file error\n");
+        UnmapH264File(&map);
+        return -1;
+    }
+
+    static IOV_WRITER writer;
+    AVCC_CONFIG cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.length_size = 4;
+    int param_warned = 0;
+    IovWriterInit(&writer, fd);
+
+    NALU_ITER it;
+    NALU_VIEW nalu;
+    NaluIterInit(&it, map.data, map.size);
+    while (NaluIterNext(&it, &nalu)) {
+        unsigned char *nal = map.data + nalu.offset;
+        int type = NALU_VIEW_TYPE(&nalu);
+        if (nalu.length == 0) {
+            continue;
+        }
+        if ((type == NALU_TYPE_SPS || type == NALU_TYPE_PPS) &&
+            AvcCAddParamSet(&cfg, type == NALU_TYPE_PPS, nal, nalu.length) != 0 && !param_warned) {
+            printf("Warning: bad or too many %s, not put into avcC\n", type == NALU_TYPE_SPS ? "SPS" : "PPS");
+            param_warned = 1;
+        }
+        if (!keep_param_sets && (type == NALU_TYPE_SPS || type == NALU_TYPE_PPS)) {
+            continue;
+        }
+        if (nalu.startcodeprefix_len == 4) {
+            // 00 00 00 01 原地改写为4字节长度，和前面的NALU连成一块
+            PutBE32(nal - 4, (unsigned) nalu.length);
+            IovWriterAdd(&writer, nal - 4, nalu.length + 4);
+        } else {
+            unsigned char len[4];
+            PutBE32(len, (unsigned) nalu.length);
+            IovWriterAddPrefix(&writer, len);
+            IovWriterAdd(&writer, nal, nalu.length);
+        }
+    }
+    int ret = IovWriterFlush(&writer);
+    close(fd);
+
+    unsigned char record[4096];
+    int record_size = BuildAvcCRecord(&cfg, record, sizeof(record));
+    if (record_size < 0 || WriteWholeFile(avcc_url, record, record_size) != 0) {
+        printf("Write avcC error\n");
+        ret = -1;
+    }
+    UnmapH264File(&map);
+    return ret;
+}
+
+/**
+ * Convert AVCC (length-prefixed) to Annex B. SPS/PPS from avcC are inserted in front of
+ * every IDR that does not already carry them in band.
+ * @param url          Input length-prefixed stream.
+ * @param avcc_url     Input AVCDecoderConfigurationRecord.
+ * @param out_url      Output H.264 Annex B file.
+ * @return 0 on success, -1 on failure.
+ */
+int H264AvccToAnnexb(const char *url, const char *avcc_url, const char *out_url) {
+    static const unsigned char start_code[4] = {0, 0, 0, 1};
+    H264_MAP map, record;
+    AVCC_CONFIG cfg;
+    if (MapH264File(avcc_url, &record) != 0 || ParseAvcCRecord(record.data, record.size, &cfg) != 0) {
+        printf("Read avcC error\n");
+        UnmapH264File(&record);
+        return -1;
+    }
+    if (MapH264FileEx(url, &map, 1) != 0) {
+        printf("Open file error\n");
+        UnmapH264File(&record);
+        return -1;
+    }
+    int fd = open(out_url, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0) {
+        printf("Open output file error\n");
+        UnmapH264File(&map);
+        UnmapH264File(&record);
+        return -1;
+    }
+
+    // SPS/PPS 带上起始码，预先拼成一块，每次插入只需要一个 iov
+    size_t param_size = 0;
+    for (int i = 0; i < cfg.sps_count; i++) param_size += 4 + cfg.sps_len[i];
+    for (int i = 0; i < cfg.pps_count; i++) param_size += 4 + cfg.pps_len[i];
+    unsigned char *params = (unsigned char *) malloc(param_size > 0 ? param_size : 1);
+    if (params == NULL) {
+        close(fd);
+        UnmapH264File(&map);
+        UnmapH264File(&record);
+        return -1;
+    }
+    size_t n = 0;
+    for (int i = 0; i < cfg.sps_count; i++) {
+        memcpy(params + n, start_code, 4);
+        memcpy(params + n + 4, cfg.sps[i], cfg.sps_len[i]);
+        n += 4 + cfg.sps_len[i];
+    }
+    for (int i = 0; i < cfg.pps_count; i++) {
+        memcpy(params + n, start_code, 4);
+        memcpy(params + n + 4, cfg.pps[i], cfg.pps_len[i]);
+        n += 4 + cfg.pps_len[i];
+    }
+
+    static IOV_WRITER writer;
+    IovWriterInit(&writer, fd);
+    int ret = 0;
+    int param_sets_in_band = 0;     // 当前访问单元中已经有 SPS 了
+    size_t pos = 0;
+    while (pos + cfg.length_size <= map.size) {
+        unsigned char *p = map.data + pos;
+        size_t len = 0;
+        for (int i = 0; i < cfg.length_size; i++) {
+            len = (len << 8) | p[i];
+        }
+        unsigned char *nal = p + cfg.length_size;
+        if (len > map.size - pos - cfg.length_size) {
+            printf("Truncated NALU at %llu\n", (unsigned long long) pos);
+            ret = -1;
+            break;
+        }
+        pos += cfg.length_size + len;
+        if (len == 0) {
+            continue;
+        }
+        int type = nal[0] & 0x1f;
+        if (type == NALU_TYPE_SPS) {
+            param_sets_in_band = 1;
+        } else if (type == NALU_TYPE_IDR && !param_sets_in_band && len > 1 && (nal[1] & 0x80)) {
+            // IDR 的第一个片（first_mb_in_slice == 0）前面插入参数集
+            IovWriterAdd(&writer, params, param_size);
+        }
+        if (IsVclNalu(type)) {
+            param_sets_in_band = 0;
+        }
+        if (cfg.length_size == 4) {
+            // 4字节长度原地改写为 00 00 00 01
+            memcpy(p, start_code, 4);
+            IovWriterAdd(&writer, p, len + 4);
+        } else {
+            IovWriterAddPrefix(&writer, start_code);
+            IovWriterAdd(&writer, nal, len);
+        }
+    }
+    if (IovWriterFlush(&writer) != 0) {
+        ret = -1;
+    }
+    close(fd);
+    free(params);
+    UnmapH264File(&map);
+    UnmapH264File(&record);
+    return ret;
+}
+
+
+/* ====================== 按 IDR 快速切分码流 ======================
+ * 利用 NALU/IDR 索引（sidecar）确定切分点，每一段都从一个 IDR 访问单元开始，不需要解码。
+ * 如果切分点前面没有 SPS/PPS，就把最近的 SPS/PPS 重新写到这一段的开头。
+ * 数据通过 copy_file_range/sendfile 在内核中直接从输入文件拷贝到输出文件，不经过用户空间。
+ */
+
+// 把 in_fd 中 [offset, offset + len) 的数据追加到 out_fd
+static int CopyFileRange(int in_fd, unsigned long long offset, int out_fd, unsigned long long len) {
+#ifdef __linux__
+    // 优先使用 copy_file_range（同一个文件系统上甚至可以不拷贝数据），不支持时退回到 sendfile
+    off_t off = (off_t) offset;
+    int use_sendfile = 0;
+    while (len > 0) {
+        ssize_t n;
+        size_t chunk = len > (1ULL << 30) ? (size_t) (1ULL << 30) : (size_t) len;
+        if (!use_sendfile) {
+            n = copy_file_range(in_fd, &off, out_fd, NULL, chunk, 0);
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+                use_sendfile = 1;
+                continue;
+            }
+        } else {
+            n = sendfile(out_fd, in_fd, &off, chunk);
+        }
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        len -= n;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    offset = (unsigned long long) off;
+#endif
+    // 通用版本：经过用户空间的缓冲区
+    static unsigned char buf[1 << 16];
+    while (len > 0) {
+        size_t chunk = len > sizeof(buf) ? sizeof(buf) : (size_t) len;
+#ifndef _WIN32
+        ssize_t n = pread(in_fd, buf, chunk, (off_t) offset);
+#else
+        _lseeki64(in_fd, (long long) offset, SEEK_SET);
+        long n = _read(in_fd, buf, (unsigned) chunk);
+#endif
+        if (n <= 0 || write(out_fd, buf, n) != n) {
+            return -1;
+        }
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// 读出一个 SPS 并解析，用于获取帧率
+static int ReadSidecarSPS(int fd, const NALU_INDEX_ENTRY *entry, H264_SPS *sps) {
+    unsigned char ebsp[H264_PARAM_RBSP_SIZE], rbsp[H264_PARAM_RBSP_SIZE];
+    size_t len = entry->length < sizeof(ebsp) ? entry->length : sizeof(ebsp);
+#ifndef _WIN32
+    if (len < 2 || pread(fd, ebsp, len, (off_t) entry->offset) != (ssize_t) len) {
+        return -1;
+    }
+#else
+    _lseeki64(fd, (long long) entry->offset, SEEK_SET);
+    if (len < 2 || _read(fd, ebsp, (unsigned) len) != (int) len) {
+        return -1;
+    }
+#endif
+    size_t n = EbspToRbsp(ebsp + 1, len - 1, rbsp, sizeof(rbsp));
+    return ParseSPS(rbsp, n, sps);
+}
+
+/**
+ * Split H.264 Bitstream at IDR boundaries.
+ * @param url        Location of input H.264 bitstream file.
+ * @param prefix     Output file name prefix, pieces are written to <prefix>_NNN.h264.
+ * @param seconds    Minimal length of each piece in seconds (used when frames is 0).
+ * @param frames     Minimal length of each piece in frames.
+ */
+int simplest_h264_split(char *url, const char *prefix, double seconds, unsigned frames) {
+    FILE *myout = stdout;
+    H264_SIDECAR sc;
+    if (OpenH264Sidecar(url, &sc, NULL) != 0) {
+        printf("Open file error\n");
+        return -1;
+    }
+    int in_fd = open(url, O_RDONLY | O_BINARY);
+    if (in_fd < 0 || sc.idr_count == 0) {
+        printf(in_fd < 0 ? "Open file error\n" : "No IDR in stream\n");
+        if (in_fd >= 0) close(in_fd);
+        FreeH264Sidecar(&sc);
+        return -1;
+    }
+
+    // 帧率取自第一个 SPS 的 timing_info，没有的话按25帧/秒
+    double fps = 25.0;
+    for (size_t i = 0; i < sc.nalu_count; i++) {
+        if (sc.nalus[i].nal_unit_type == NALU_TYPE_SPS) {
+            H264_SPS sps;
+            if (ReadSidecarSPS(in_fd, &sc.nalus[i], &sps) == 0 && sps.timing_info_present_flag &&
+                sps.num_units_in_tick > 0) {
+                fps = (double) sps.time_scale / (2.0 * sps.num_units_in_tick);
+            }
+            break;
+        }
+    }
+    if (frames == 0) {
+        frames = (unsigned) (seconds * fps + 0.5);
+        if (frames == 0) {
+            frames = 1;
+        }
+    }
+
+    fprintf(myout, "-----+--------+--------+----------+----------+\n");
+    fprintf(myout, " NUM |  FRAME | FRAMES |    POS   |   SIZE   |\n");
+    fprintf(myout, "-----+--------+--------+----------+----------+\n");
+
+    int ret = 0;
+    int piece = 0;
+    size_t idr = 0;
+    // 第一段从文件开头开始，之后每一段都从一个 IDR 访问单元开始
+    unsigned start_frame = 0;
+    size_t start_nalu = 0;
+    size_t last_sps = (size_t) -1, last_pps = (size_t) -1;
+    size_t scanned = 0;         // 已经检查过是否为 SPS/PPS 的 NALU 数
+    while (start_nalu < sc.nalu_count && ret == 0) {
+        // 找到下一个切分点：第一个距离本段开头不少于 frames 帧的 IDR
+        while (idr < sc.idr_count && sc.idrs[idr].frame < start_frame + frames) {
+            idr++;
+        }
+        size_t end_nalu = idr < sc.idr_count ? sc.idrs[idr].nalu : sc.nalu_count;
+        unsigned end_frame = idr < sc.idr_count ? sc.idrs[idr].frame : sc.frame_count;
+        const NALU_INDEX_ENTRY *first = &sc.nalus[start_nalu];
+        const NALU_INDEX_ENTRY *last = &sc.nalus[end_nalu - 1];
+        unsigned long long begin = first->offset - first->startcodeprefix_len;
+        unsigned long long end = last->offset + last->length;
+
+        // 本段开头（到第一个片为止）是否已经带有 SPS/PPS
+        int has_sps = 0, has_pps = 0;
+        for (size_t i = start_nalu; i < end_nalu && !IsVclNalu(sc.nalus[i].nal_unit_type); i++) {
+            has_sps |= sc.nalus[i].nal_unit_type == NALU_TYPE_SPS;
+            has_pps |= sc.nalus[i].nal_unit_type == NALU_TYPE_PPS;
+        }
+
+        char path[1024];
+        snprintf(path, sizeof(path), "%s_%03d.h264", prefix, piece);
+        int out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+        if (out_fd < 0) {
+            printf("Open output file error: %s\n", path);
+            ret = -1;
+            break;
+        }
+        unsigned long long size = 0;
+        const size_t inject[2] = {has_sps ? (size_t) -1 : last_sps, has_pps ? (size_t) -1 : last_pps};
+        for (int k = 0; k < 2 && ret == 0; k++) {
+            if (inject[k] != (size_t) -1) {
+                const NALU_INDEX_ENTRY *e = &sc.nalus[inject[k]];
+                unsigned long long len = e->length + e->startcodeprefix_len;
+                ret = CopyFileRange(in_fd, e->offset - e->startcodeprefix_len, out_fd, len);
+                size += len;
+            }
+        }
+        if (ret == 0) {
+            ret = CopyFileRange(in_fd, begin, out_fd, end - begin);
+            size += end - begin;
+        }
+        close(out_fd);
+        fprintf(myout, "%5d| %7u| %7u| %9llu| %9llu|\n", piece, start_frame, end_frame - start_frame, begin, size);
+
+        // 记录到下一段开头为止最近的 SPS/PPS
+        for (; scanned < end_nalu; scanned++) {
+            if (sc.nalus[scanned].nal_unit_type == NALU_TYPE_SPS) last_sps = scanned;
+            if (sc.nalus[scanned].nal_unit_type == NALU_TYPE_PPS) last_pps = scanned;
+        }
+        start_nalu = end_nalu;
+        start_frame = end_frame;
+        piece++;
+    }
+
+    close(in_fd);
+    FreeH264Sidecar(&sc);
+    return ret;
+}
+
+
+int main(int argc, char *argv[]) {
+    // 用法：h264 [-threads N | -seek FRAME | -gop | -stream] [file.h264]
+    //       h264 -toavcc in.h264 out.avc out.avcC
+    //       h264 -toannexb in.avc in.avcC out.h264
+    //       h264 -split SECONDS | -splitframes N  [file.h264] [prefix]
+    // -stream 模式下 file 为 "-" 时从标准输入读取
+    if (argc > 2 && (strcmp(argv[1], "-split") == 0 || strcmp(argv[1], "-splitframes") == 0)) {
+        int by_frames = strcmp(argv[1], "-splitframes") == 0;
+        return simplest_h264_split(argc > 3 ? argv[3] : (char *) "sintel.h264", argc > 4 ? argv[4] : "output",
+                                   by_frames ? 0 : atof(argv[2]), by_frames ? (unsigned) atoi(argv[2]) : 0) == 0 ? 0 : 1;
+    }
+    if (argc > 4 && strcmp(argv[1], "-toavcc") == 0) {
+        return H264AnnexbToAvcc(argv[2], argv[3], argv[4], 0) == 0 ? 0 : 1;
+    }
+    if (argc > 4 && strcmp(argv[1], "-toannexb") == 0) {
+        return H264AvccToAnnexb(argv[2], argv[3], argv[4]) == 0 ? 0 : 1;
+    }
+    if (argc > 1 && strcmp(argv[1], "-stream") == 0) {
+        simplest_h264_parser_stream(argc > 2 ? argv[2] : (char *) "-");
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "-gop") == 0) {
+        simplest_h264_gop_parser(argc > 2 ? argv[2] : (char *) "sintel.h264", 0);
+        return 0;
+    }
+    if (argc > 2 && strcmp(argv[1], "-seek") == 0) {
+        simplest_h264_seek(argc > 3 ? argv[3] : (char *) "sintel.h264", (unsigned) atoi(argv[2]));
+        return 0;
+    }
+    if (argc > 2 && strcmp(argv[1], "-threads") == 0) {
+        simplest_h264_parser_parallel(argc > 3 ? argv[3] : (char *) "sintel.h264", atoi(argv[2]));
+        return 0;
+    }
+    simplest_h264_parser(argc > 1 ? argv[1] : (char *) "sintel.h264");
 }
\ No newline at end of file
@@ -26,10 +26,31 @@
  *
  */
 #include <stdio.h>
-#include <winsock2.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <iostream>
 
+#ifdef _WIN32
+#include <winsock2.h>
+
 #pragma comment(lib, "ws2_32.lib")
+#else
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stddef.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
+#endif
 
 #pragma pack(1)
 
@@ -78,11 +99,224 @@ void print_rtp_header(RTP_FIXED_HEADER *header) {
     printf("payload: %u\n", header->payload);
     printf("marker: %u\n", header->marker);
     printf("seq_no: %u\n", ntohs(header->seq_no)); // 注意网络字节序转换
-    printf("timestamp: %lu\n", ntohl(header->timestamp)); // 注意网络字节序转换
-    printf("ssrc: %lu\n", ntohl(header->ssrc)); // 注意网络字节序转换
+    printf("timestamp: %lu\n", (unsigned long) ntohl(header->timestamp)); // 注意网络字节序转换
+    printf("ssrc: %lu\n", (unsigned long) ntohl(header->ssrc)); // 注意网络字节序转换
+}
+
+
+/* ====================== 丢包统计 ======================
+ * RTP：按序列号统计丢失、晚到/重复的包，用内核给出的到达时间计算到达间隔抖动（RFC 3550 A.8，按 90kHz 时钟）
+ * MPEG-TS：每个 PID 的 continuity_counter 不连续的次数
+ * 内核：SO_RXQ_OVFL 给出的因为接收缓冲区满而丢掉的包数
+ */
+
+#define RTP_CLOCK_RATE      90000
+#define MPEGTS_PID_COUNT    8192
+
+typedef struct {
+    unsigned long long packets;
+    unsigned long long bytes;
+    unsigned long long rtp_lost;        //! 序列号缺失的包数（之后晚到的包会减回来）
+    unsigned long long rtp_reordered;   //! 晚到或者重复的包数
+    unsigned long long ts_cc_errors;    //! MPEG-TS 连续性计数错误
+    unsigned long long truncated;       //! 比接收缓冲区大、被截断的包
+    unsigned long long kernel_drops;    //! 内核丢掉的包（SO_RXQ_OVFL）
+    // 当前 RTP 流的状态
+    unsigned ssrc;
+    int have_seq;
+    unsigned short max_seq;             //! 收到的最大序列号
+    int have_transit;
+    double transit;                     //! 上一个包的 到达时间 - RTP 时间戳
+    double jitter;                      //! 到达间隔抖动（RTP 时间戳单位）
+    unsigned char cc[MPEGTS_PID_COUNT]; //! 每个 PID 上一个 continuity_counter，0xff 表示还没有出现
+} UDP_STREAM_STATS;
+
+static void UdpStatsInit(UDP_STREAM_STATS *st) {
+    memset(st, 0, sizeof(UDP_STREAM_STATS));
+    memset(st->cc, 0xff, sizeof(st->cc));
+}
+
+static void UdpStatsRtp(UDP_STREAM_STATS *st, unsigned ssrc, unsigned short seq, unsigned timestamp,
+                        const struct timespec *arrival) {
+    if (!st->have_seq || ssrc != st->ssrc) {
+        // 新的流：重新开始统计序列号、抖动和连续性计数
+        st->ssrc = ssrc;
+        st->have_seq = 1;
+        st->max_seq = seq;
+        st->have_transit = 0;
+        st->jitter = 0;
+        memset(st->cc, 0xff, sizeof(st->cc));
+    } else {
+        unsigned short delta = (unsigned short) (seq - st->max_seq);
+        if (delta == 0) {
+            st->rtp_reordered++;
+        } else if (delta < 0x8000) {
+            st->rtp_lost += delta - 1;
+            st->max_seq = seq;
+        } else {
+            // 比最大序列号小：晚到的包，之前已经算成丢失了
+            st->rtp_reordered++;
+            if (st->rtp_lost > 0) {
+                st->rtp_lost--;
+            }
+        }
+    }
+    if (arrival != NULL) {
+        double now = arrival->tv_sec * (double) RTP_CLOCK_RATE + arrival->tv_nsec * (RTP_CLOCK_RATE / 1e9);
+        double transit = now - timestamp;
+        double d = transit - st->transit;
+        d = d < 0 ? -d : d;
+        // RTP 时间戳回绕时跳过这一次
+        if (st->have_transit && d < 2147483648.0) {
+            st->jitter += (d - st->jitter) / 16;
+        }
+        st->transit = transit;
+        st->have_transit = 1;
+    }
 }
 
+static void UdpStatsMpegts(UDP_STREAM_STATS *st, const unsigned char *p, int size) {
+    if (size < 4) {
+        return;
+    }
+    int pid = ((p[1] & 0x1f) << 8) | p[2];
+    int afc = (p[3] >> 4) & 0x03;
+    int cc = p[3] & 0x0f;
+    // 空包、只有自适应字段的包 continuity_counter 不增加
+    if (pid == 0x1fff || !(afc & 0x01)) {
+        return;
+    }
+    unsigned char last = st->cc[pid];
+    st->cc[pid] = (unsigned char) cc;
+    // discontinuity_indicator 置位时允许不连续
+    if (afc == 3 && size >= 6 && p[4] > 0 && (p[5] & 0x80)) {
+        return;
+    }
+    // 同一个包允许重复一次
+    if (last != 0xff && cc != ((last + 1) & 0x0f) && cc != last) {
+        st->ts_cc_errors++;
+    }
+}
 
+static void PrintUdpStats(FILE *myout, const UDP_STREAM_STATS *st) {
+    fprintf(myout, "[Stats] pkts %llu| bytes %llu| lost %llu| reordered %llu| cc errors %llu| kernel drops %llu|"
+                   " truncated %llu| jitter %.3f ms|\n",
+            st->packets, st->bytes, st->rtp_lost, st->rtp_reordered, st->ts_cc_errors, st->kernel_drops,
+            st->truncated, st->jitter * 1000 / RTP_CLOCK_RATE);
+}
+
+// 把 st 的计数累加到 total 上，抖动取最大的那一路
+static void UdpStatsAdd(UDP_STREAM_STATS *total, const UDP_STREAM_STATS *st) {
+    total->packets += st->packets;
+    total->bytes += st->bytes;
+    total->rtp_lost += st->rtp_lost;
+    total->rtp_reordered += st->rtp_reordered;
+    total->ts_cc_errors += st->ts_cc_errors;
+    total->truncated += st->truncated;
+    total->kernel_drops += st->kernel_drops;
+    if (st->jitter > total->jitter) {
+        total->jitter = st->jitter;
+    }
+}
+
+/**
+ * Parse one UDP datagram (RTP or raw MPEG-TS) and dump its payload.
+ * @param myout      Where the packet list goes, NULL to only collect statistics.
+ * @param fp1        Where the payload is dumped, NULL to drop it.
+ * @param arrival    Kernel receive time, NULL if not available.
+ */
+static void ParseUdpPacket(FILE *myout, FILE *fp1, char *recvData, int pktsize, int cnt, int parse_rtp, int parse_mpegts,
+                           UDP_STREAM_STATS *stats, const struct timespec *arrival)
+{
+    stats->packets++;
+    stats->bytes+=pktsize;
+    //printf("Addr:%s\r\n",inet_ntoa(remoteAddr.sin_addr));
+    //printf("packet size:%d\r\n",pktsize);
+    //Parse RTP
+    if(parse_rtp!=0){
+        char payload_str[10]={0};
+        RTP_FIXED_HEADER rtp_header;
+        int rtp_header_size=sizeof(RTP_FIXED_HEADER);
+        if(pktsize<rtp_header_size){
+            return;
+        }
+        //RTP Header
+        memcpy((void *)&rtp_header,recvData,rtp_header_size);
+        //RFC3551
+        char payload=rtp_header.payload;
+
+        switch(payload){
+            case 0:
+            case 1:
+            case 2:
+            case 3:
+            case 4:
+            case 5:
+            case 6:
+            case 7:
+            case 8:
+            case 9:
+            case 10:
+            case 11:
+            case 12:
+            case 13:
+            case 14:
+            case 15:
+            case 16:
+            case 17:
+            case 18: sprintf(payload_str,"Audio");break;
+            case 31: sprintf(payload_str,"H.261");break;
+            case 32: sprintf(payload_str,"MPV");break;
+            case 33: sprintf(payload_str,"MP2T");break;
+            case 34: sprintf(payload_str,"H.263");break;
+            case 96: sprintf(payload_str,"H.264");break;
+            default:sprintf(payload_str,"other");break;
+        }
+
+        // BE --> LE
+        unsigned int timestamp=ntohl(rtp_header.timestamp);     // 时间戳
+        unsigned int seq_no=ntohs(rtp_header.seq_no);           // RTP数据包的序列号
+
+        UdpStatsRtp(stats,ntohl(rtp_header.ssrc),seq_no,timestamp,arrival);
+        if(myout!=NULL){
+            fprintf(myout,"[RTP Pkt] %5d| %5s| %10u| %5d| %5d|\n",cnt,payload_str,timestamp,seq_no,pktsize);
+        }
+
+        //RTP Data
+        char *rtp_data=recvData+rtp_header_size;        // 指针移动到 recvData缓冲区的有点载荷数据起始位置
+        int rtp_data_size=pktsize-rtp_header_size;      // 有效载荷数据长度
+        if(fp1!=NULL){
+            fwrite(rtp_data,rtp_data_size,1,fp1);       // 将有效载荷数据写入输出文件
+        }
+
+        //Parse MPEGTS
+        if(parse_mpegts!=0&&payload==33){
+            MPEGTS_FIXED_HEADER mpegts_header;
+            // 每个MPEG-TS数据包的大小通常为188字节
+            for(int i=0;i<rtp_data_size;i=i+188){
+                // 判断每个MPEG-TS数据包的第一个字节是否是同步字节  0x47
+                if(rtp_data[i]!=0x47) {
+                    break;
+                }
+                //MPEGTS Header
+                memcpy((void *)&mpegts_header,rtp_data+i,sizeof(MPEGTS_FIXED_HEADER));
+                UdpStatsMpegts(stats,(unsigned char *)rtp_data+i,rtp_data_size-i);
+//                        fprintf(myout,"   [MPEGTS Pkt]\n");
+            }
+        }
+
+    }else{
+        // parse mpegts
+        if(myout!=NULL){
+            fprintf(myout,"[UDP Pkt] %5d| %5d|\n",cnt,pktsize);
+        }
+        if(fp1!=NULL){
+            fwrite(recvData,pktsize,1,fp1);
+        }
+    }
+}
+
+#ifdef _WIN32
 int simplest_udp_parser(int port)
 {
     // WSADATA 是一个结构体，它被用来存储 WSAStartup 函数调用后返回的 Windows Socket 实现的信息。
@@ -137,6 +371,8 @@ int simplest_udp_parser(int port)
     printf("Listening on port %d\n",port);
 
     char recvData[10000];
+    static UDP_STREAM_STATS stats;
+    UdpStatsInit(&stats);
 
     // 设置超时
     struct timeval timeout;
@@ -159,90 +395,548 @@ int simplest_udp_parser(int port)
          */
         int pktsize = recvfrom(serSocket, recvData, 10000, 0, (sockaddr *)&remoteAddr, &nAddrLen);
         if (pktsize > 0){
-            //printf("Addr:%s\r\n",inet_ntoa(remoteAddr.sin_addr));
-            //printf("packet size:%d\r\n",pktsize);
-            //Parse RTP
-            if(parse_rtp!=0){
-                char payload_str[10]={0};
-                RTP_FIXED_HEADER rtp_header;
-                int rtp_header_size=sizeof(RTP_FIXED_HEADER);
-                //RTP Header
-                memcpy((void *)&rtp_header,recvData,rtp_header_size);
-                //RFC3551
-                char payload=rtp_header.payload;
-
-                switch(payload){
-                    case 0:
-                    case 1:
-                    case 2:
-                    case 3:
-                    case 4:
-                    case 5:
-                    case 6:
-                    case 7:
-                    case 8:
-                    case 9:
-                    case 10:
-                    case 11:
-                    case 12:
-                    case 13:
-                    case 14:
-                    case 15:
-                    case 16:
-                    case 17:
-                    case 18: sprintf(payload_str,"Audio");break;
-                    case 31: sprintf(payload_str,"H.261");break;
-                    case 32: sprintf(payload_str,"MPV");break;
-                    case 33: sprintf(payload_str,"MP2T");break;
-                    case 34: sprintf(payload_str,"H.263");break;
-                    case 96: sprintf(payload_str,"H.264");break;
-                    default:sprintf(payload_str,"other");break;
-                }
-
-                // BE --> LE
-                unsigned int timestamp=ntohl(rtp_header.timestamp);     // 时间戳
-                unsigned int seq_no=ntohs(rtp_header.seq_no);           // RTP数据包的序列号
-
-                fprintf(myout,"[RTP Pkt] %5d| %5s| %10u| %5d| %5d|\n",cnt,payload_str,timestamp,seq_no,pktsize);
-
-                //RTP Data
-                char *rtp_data=recvData+rtp_header_size;        // 指针移动到 recvData缓冲区的有点载荷数据起始位置
-                int rtp_data_size=pktsize-rtp_header_size;      // 有效载荷数据长度
-                fwrite(rtp_data,rtp_data_size,1,fp1);           // 将有效载荷数据写入输出文件
-
-                //Parse MPEGTS
-                if(parse_mpegts!=0&&payload==33){
-                    MPEGTS_FIXED_HEADER mpegts_header;
-                    // 每个MPEG-TS数据包的大小通常为188字节
-                    for(int i=0;i<rtp_data_size;i=i+188){
-                        // 判断每个MPEG-TS数据包的第一个字节是否是同步字节  0x47
-                        if(rtp_data[i]!=0x47) {
-                            break;
-                        }
-                        //MPEGTS Header
-                        memcpy((void *)&mpegts_header,rtp_data+i,sizeof(MPEGTS_FIXED_HEADER));
-//                        fprintf(myout,"   [MPEGTS Pkt]\n");
-                    }
-                }
-
-            }else{
-                // parse mpegts
-                fprintf(myout,"[UDP Pkt] %5d| %5d|\n",cnt,pktsize);
-                fwrite(recvData,pktsize,1,fp1);
-            }
-
+            ParseUdpPacket(myout, fp1, recvData, pktsize, cnt, parse_rtp, parse_mpegts, &stats, NULL);
             cnt++;
         } else { printf("time out\n"); break;}
     }
+    PrintUdpStats(myout, &stats);
     closesocket(serSocket);
     WSACleanup();
     fclose(fp1);
 
     return 0;
 }
+#else
+/* ====================== POSIX：recvmmsg 批量接收 ======================
+ * 每次 recvmmsg 最多收 UDP_BATCH_SIZE 个包，包的数据放在预先分配好的一整块内存（slab）里，
+ * 接收过程中不再分配内存。接收缓冲区尽量设置得很大，突发的流量先堆在内核里；
+ * 每个包带有内核的接收时间（SO_TIMESTAMPNS）和累计的丢包数（SO_RXQ_OVFL）。
+ */
+
+#define UDP_MAX_PACKET      10000       // 与 Winsock 版本的 recvData 一样大
+#define UDP_BATCH_SIZE      64          // 一次 recvmmsg 最多收的包数
+#define UDP_RCVBUF_SIZE     (32 << 20)  // 希望的接收缓冲区大小
+#define UDP_CONTROL_SIZE    128         // 每个包的控制信息（时间戳、丢包数）
+
+#ifdef MSG_WAITFORONE
+typedef struct mmsghdr UDP_MMSGHDR;
+
+// MSG_WAITFORONE：等到第一个包以后，只取已经到达的包，不再等待
+static int UdpRecvBatch(int fd, UDP_MMSGHDR *msgs, unsigned int vlen) {
+    return recvmmsg(fd, msgs, vlen, MSG_WAITFORONE, NULL);
+}
+#else
+// 没有 recvmmsg 的系统：一次只收一个包
+typedef struct {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+} UDP_MMSGHDR;
+
+static int UdpRecvBatch(int fd, UDP_MMSGHDR *msgs, unsigned int vlen) {
+    ssize_t n = recvmsg(fd, &msgs[0].msg_hdr, 0);
+    if (n < 0) {
+        return -1;
+    }
+    msgs[0].msg_len = (unsigned int) n;
+    return 1;
+}
+#endif
+
+typedef struct {
+    char *data;                         //! UDP_BATCH_SIZE 个包，每个 UDP_MAX_PACKET 字节
+    char *control;                      //! 每个包 UDP_CONTROL_SIZE 字节的控制信息
+    UDP_MMSGHDR *msgs;
+    struct iovec *iov;
+    struct sockaddr_in *addr;
+} UDP_PACKET_SLAB;
+
+static void UdpSlabFree(UDP_PACKET_SLAB *slab) {
+    free(slab->data);
+    free(slab->control);
+    free(slab->msgs);
+    free(slab->iov);
+    free(slab->addr);
+    memset(slab, 0, sizeof(UDP_PACKET_SLAB));
+}
+
+/**
+ * Allocate the packet slab and the recvmmsg descriptors.
+ * @return 0 on success, -1 on failure.
+ */
+static int UdpSlabInit(UDP_PACKET_SLAB *slab) {
+    slab->data = (char *) malloc((size_t) UDP_BATCH_SIZE * UDP_MAX_PACKET);
+    slab->control = (char *) calloc(UDP_BATCH_SIZE, UDP_CONTROL_SIZE);
+    slab->msgs = (UDP_MMSGHDR *) calloc(UDP_BATCH_SIZE, sizeof(UDP_MMSGHDR));
+    slab->iov = (struct iovec *) calloc(UDP_BATCH_SIZE, sizeof(struct iovec));
+    slab->addr = (struct sockaddr_in *) calloc(UDP_BATCH_SIZE, sizeof(struct sockaddr_in));
+    if (!slab->data || !slab->control || !slab->msgs || !slab->iov || !slab->addr) {
+        UdpSlabFree(slab);
+        return -1;
+    }
+    for (int i = 0; i < UDP_BATCH_SIZE; i++) {
+        slab->iov[i].iov_base = slab->data + (size_t) i * UDP_MAX_PACKET;
+        slab->iov[i].iov_len = UDP_MAX_PACKET;
+        struct msghdr *hdr = &slab->msgs[i].msg_hdr;
+        hdr->msg_iov = &slab->iov[i];
+        hdr->msg_iovlen = 1;
+    }
+    return 0;
+}
+
+// recvmmsg 会修改 msg_namelen/msg_controllen/msg_flags，每次接收前重新设置
+static void UdpSlabReset(UDP_PACKET_SLAB *slab, int count) {
+    for (int i = 0; i < count; i++) {
+        struct msghdr *hdr = &slab->msgs[i].msg_hdr;
+        hdr->msg_name = &slab->addr[i];
+        hdr->msg_namelen = sizeof(struct sockaddr_in);
+        hdr->msg_control = slab->control + (size_t) i * UDP_CONTROL_SIZE;
+        hdr->msg_controllen = UDP_CONTROL_SIZE;
+        hdr->msg_flags = 0;
+    }
+}
+
+/**
+ * Open a UDP socket bound to port, with a large receive buffer and kernel timestamps.
+ * @param timeout_sec    recvmmsg gives up when nothing arrives for this long.
+ * @param reuseport      1: join the SO_REUSEPORT group of the port.
+ * @return Socket, -1 on failure.
+ */
+static int OpenUdpSocket(int port, int timeout_sec, int reuseport) {
+    int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (fd < 0) {
+        printf("socket error !");
+        return -1;
+    }
+    int on = 1;
+    if (reuseport) {
+#ifdef SO_REUSEPORT
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0)
+#endif
+        {
+            printf("SO_REUSEPORT not supported\n");
+            close(fd);
+            return -1;
+        }
+    }
+    int rcvbuf = UDP_RCVBUF_SIZE;
+#ifdef SO_RCVBUFFORCE
+    // SO_RCVBUFFORCE 可以超过 net.core.rmem_max，但需要 CAP_NET_ADMIN
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) != 0)
+#endif
+    {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    }
+#ifdef SO_TIMESTAMPNS
+    setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+#endif
+#ifdef SO_RXQ_OVFL
+    setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+#endif
+    struct timeval timeout;
+    timeout.tv_sec = timeout_sec;
+    timeout.tv_usec = 0;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+        printf("setsockopt failed\n");
+    }
+
+    struct sockaddr_in serAddr;
+    memset(&serAddr, 0, sizeof(serAddr));
+    serAddr.sin_family = AF_INET;
+    serAddr.sin_port = htons(port);
+    serAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(fd, (struct sockaddr *) &serAddr, sizeof(serAddr)) != 0) {
+        printf("bind error !");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// 取出控制信息里的内核接收时间和丢包计数；没有时间戳时返回 NULL
+static const struct timespec *UdpPacketInfo(struct msghdr *hdr, UDP_STREAM_STATS *stats, struct timespec *ts) {
+    const struct timespec *arrival = NULL;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(hdr); cm != NULL; cm = CMSG_NXTHDR(hdr, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET) {
+            continue;
+        }
+#ifdef SO_TIMESTAMPNS
+        if (cm->cmsg_type == SCM_TIMESTAMPNS) {
+            memcpy(ts, CMSG_DATA(cm), sizeof(struct timespec));
+            arrival = ts;
+        }
+#endif
+#ifdef SO_RXQ_OVFL
+        if (cm->cmsg_type == SO_RXQ_OVFL) {
+            // 这个 socket 从创建开始累计丢掉的包数
+            unsigned int drops;
+            memcpy(&drops, CMSG_DATA(cm), sizeof(drops));
+            stats->kernel_drops = drops;
+        }
+#endif
+    }
+    if (hdr->msg_flags & MSG_TRUNC) {
+        stats->truncated++;
+    }
+    return arrival;
+}
+
+/**
+ * Receive RTP/UDP packets in batches with recvmmsg.
+ * @param timeout_sec    Stop when nothing arrives for this long.
+ * @param quiet          1: do not list every packet, print statistics once a second instead.
+ */
+int simplest_udp_parser_batch(int port, int timeout_sec, int quiet)
+{
+    FILE *myout=stdout;
+    FILE *fp1=fopen("output_dump.ts","wb+");
+    if (fp1 == NULL) {
+        printf("Failed to open files!\n");
+        return -1;
+    }
+    setvbuf(fp1, NULL, _IOFBF, 1 << 20);
+
+    int fd = OpenUdpSocket(port, timeout_sec, 0);
+    UDP_PACKET_SLAB slab;
+    if (fd < 0 || UdpSlabInit(&slab) != 0) {
+        if (fd >= 0) close(fd);
+        fclose(fp1);
+        return -1;
+    }
+    int rcvbuf = 0;
+    socklen_t optlen = sizeof(rcvbuf);
+    getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &optlen);
+
+    //How to parse?
+    int parse_rtp=1;
+    int parse_mpegts=1;
+
+    printf("Listening on port %d (SO_RCVBUF %d bytes, batch %d)\n", port, rcvbuf, UDP_BATCH_SIZE);
+
+    static UDP_STREAM_STATS stats;
+    UdpStatsInit(&stats);
+    int cnt = 0;
+    time_t last_report = time(NULL);
+    while (1) {
+        UdpSlabReset(&slab, UDP_BATCH_SIZE);
+        int n = UdpRecvBatch(fd, slab.msgs, UDP_BATCH_SIZE);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                printf("time out\n");
+            } else {
+                printf("recvmmsg error: %s\n", strerror(errno));
+            }
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            struct timespec ts;
+            const struct timespec *arrival = UdpPacketInfo(&slab.msgs[i].msg_hdr, &stats, &ts);
+            ParseUdpPacket(quiet ? NULL : myout, fp1, (char *) slab.iov[i].iov_base, (int) slab.msgs[i].msg_len,
+                           cnt, parse_rtp, parse_mpegts, &stats, arrival);
+            cnt++;
+        }
+        if (quiet && time(NULL) != last_report) {
+            last_report = time(NULL);
+            PrintUdpStats(myout, &stats);
+            fflush(myout);
+        }
+    }
+    PrintUdpStats(myout, &stats);
+    close(fd);
+    UdpSlabFree(&slab);
+    fclose(fp1);
+    return 0;
+}
+
+int simplest_udp_parser(int port)
+{
+    return simplest_udp_parser_batch(port, 10000, 0);
+}
+
+/* ====================== POSIX：SO_REUSEPORT 多线程接收 ======================
+ * 每个工作线程有一个自己的 socket，都加入同一个端口的 SO_REUSEPORT 组。
+ * Linux 上给这个组挂一个经典 BPF 程序，按 RTP 头里的 SSRC 选 socket（SSRC % 线程数），
+ * 同一路流的包总是交给同一个线程，每路流的统计只被一个线程修改，收包时不需要加锁。
+ * 挂不上 BPF 的时候内核按源地址/端口的哈希分配，同一个发送端的流也总在同一个线程里。
+ * 工作线程每秒把统计复制一份发布出来，主线程每秒汇总并输出一次。
+ */
+
+// 包头结构体需要 pack(1)，下面含有 std::mutex 的结构体要恢复默认对齐
+#pragma pack()
+
+#define UDP_MAX_STREAMS     1024        // 每个线程最多跟踪的 SSRC 个数
+
+typedef struct {
+    int index;
+    int fd;
+    std::atomic<int> error;                     //! 工作线程出错时置1，主线程每秒检查
+    std::atomic<int> *stop;
+    UDP_STREAM_STATS sock;                      //! 内核丢包、截断和没有按 SSRC 建流的包
+    UDP_STREAM_STATS *streams[UDP_MAX_STREAMS]; //! 按 SSRC 区分的流，只有本线程访问
+    int stream_count;
+    UDP_STREAM_STATS *last;                     //! 上一个包所在的流
+    // 发布给主线程的统计，只在 lock 里访问
+    std::mutex lock;
+    UDP_STREAM_STATS published_sock;
+    UDP_STREAM_STATS *published[UDP_MAX_STREAMS];
+    int published_count;
+} UDP_INGEST_WORKER;
+
+// 发布的副本不需要 continuity_counter 表，只复制它前面的计数和状态
+#define UDP_STATS_PUBLISH_SIZE  offsetof(UDP_STREAM_STATS, cc)
+
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+/**
+ * Steer packets of the SO_REUSEPORT group by RTP SSRC: socket index = SSRC % nthreads.
+ * Sockets are numbered in the order they joined the group.
+ * @return 0 on success, -1 on failure.
+ */
+static int AttachSsrcSteering(int fd, int nthreads) {
+    struct sock_filter code[] = {
+        // 程序看到的数据从 UDP 负载开始，第 8~11 字节是 SSRC（按大端读取）
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 8),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (unsigned int) nthreads),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_fprog prog;
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0 ? 0 : -1;
+}
+#else
+static int AttachSsrcSteering(int fd, int nthreads) {
+    return -1;
+}
+#endif
+
+// 找到 SSRC 对应的流，第一次出现时创建；超过 UDP_MAX_STREAMS 时返回 NULL
+static UDP_STREAM_STATS *UdpWorkerStream(UDP_INGEST_WORKER *w, unsigned ssrc) {
+    if (w->last != NULL && w->last->ssrc == ssrc) {
+        return w->last;
+    }
+    for (int i = 0; i < w->stream_count; i++) {
+        if (w->streams[i]->ssrc == ssrc) {
+            w->last = w->streams[i];
+            return w->last;
+        }
+    }
+    if (w->stream_count == UDP_MAX_STREAMS) {
+        return NULL;
+    }
+    UDP_STREAM_STATS *st = (UDP_STREAM_STATS *) malloc(sizeof(UDP_STREAM_STATS));
+    if (st == NULL) {
+        return NULL;
+    }
+    UdpStatsInit(st);
+    st->ssrc = ssrc;
+    w->streams[w->stream_count++] = st;
+    w->last = st;
+    return st;
+}
+
+// 把本线程的统计复制给主线程；每秒一次，收包的时候不持有锁
+static void UdpWorkerPublish(UDP_INGEST_WORKER *w) {
+    std::lock_guard<std::mutex> guard(w->lock);
+    memcpy(&w->published_sock, &w->sock, UDP_STATS_PUBLISH_SIZE);
+    for (int i = 0; i < w->stream_count; i++) {
+        if (i == w->published_count) {
+            w->published[i] = (UDP_STREAM_STATS *) malloc(sizeof(UDP_STREAM_STATS));
+            if (w->published[i] == NULL) {
+                break;
+            }
+            w->published_count++;
+        }
+        memcpy(w->published[i], w->streams[i], UDP_STATS_PUBLISH_SIZE);
+    }
+}
+
+static void UdpIngestWorker(UDP_INGEST_WORKER *w) {
+    UDP_PACKET_SLAB slab;
+    if (UdpSlabInit(&slab) != 0) {
+        printf("Alloc packet slab error\n");
+        w->error.store(1);
+        return;
+    }
+    time_t last_publish = time(NULL);
+    while (!w->stop->load(std::memory_order_relaxed)) {
+        UdpSlabReset(&slab, UDP_BATCH_SIZE);
+        int n = UdpRecvBatch(w->fd, slab.msgs, UDP_BATCH_SIZE);
+        if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+            printf("recvmmsg error: %s\n", strerror(errno));
+            w->error.store(1);
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            struct timespec ts;
+            const struct timespec *arrival = UdpPacketInfo(&slab.msgs[i].msg_hdr, &w->sock, &ts);
+            const unsigned char *p = (const unsigned char *) slab.iov[i].iov_base;
+            int size = (int) slab.msgs[i].msg_len;
+            UDP_STREAM_STATS *st = NULL;
+            // 只有 RTP 版本2的包按 SSRC 建流；裸 MPEG-TS 等其他数据和超出 UDP_MAX_STREAMS 的流只计入 w->sock
+            if (size >= (int) sizeof(RTP_FIXED_HEADER) && (p[0] >> 6) == 2) {
+                st = UdpWorkerStream(w, ((unsigned) p[8] << 24) | (p[9] << 16) | (p[10] << 8) | p[11]);
+            }
+            if (st != NULL) {
+                ParseUdpPacket(NULL, NULL, (char *) p, size, 0, 1, 1, st, arrival);
+            } else {
+                ParseUdpPacket(NULL, NULL, (char *) p, size, 0, 0, 0, &w->sock, arrival);
+            }
+        }
+        if (time(NULL) != last_publish) {
+            last_publish = time(NULL);
+            UdpWorkerPublish(w);
+        }
+    }
+    UdpWorkerPublish(w);
+    UdpSlabFree(&slab);
+}
+
+// 汇总所有线程发布的统计；detail 为 1 时逐路输出每个 SSRC
+static void MergeUdpWorkers(FILE *myout, UDP_INGEST_WORKER *workers, int nthreads, UDP_STREAM_STATS *total, int detail) {
+    memset(total, 0, UDP_STATS_PUBLISH_SIZE);
+    for (int i = 0; i < nthreads; i++) {
+        UDP_INGEST_WORKER *w = &workers[i];
+        std::lock_guard<std::mutex> guard(w->lock);
+        UdpStatsAdd(total, &w->published_sock);
+        for (int j = 0; j < w->published_count; j++) {
+            const UDP_STREAM_STATS *st = w->published[j];
+            UdpStatsAdd(total, st);
+            if (detail) {
+                fprintf(myout, "[SSRC 0x%08x] worker %2d| pkts %llu| bytes %llu| lost %llu| reordered %llu|"
+                               " cc errors %llu| jitter %.3f ms|\n",
+                        st->ssrc, w->index, st->packets, st->bytes, st->rtp_lost, st->rtp_reordered,
+                        st->ts_cc_errors, st->jitter * 1000 / RTP_CLOCK_RATE);
+            }
+        }
+    }
+}
+
+/**
+ * Receive RTP packets on several threads, one SO_REUSEPORT socket per thread,
+ * with every SSRC handled by exactly one thread. Payloads are not dumped.
+ * @param timeout_sec    Stop when nothing arrives for this long.
+ * @param nthreads       Number of receive threads, 0 for one per CPU.
+ * @return 0 on success, -1 on failure.
+ */
+int simplest_udp_parser_reuseport(int port, int timeout_sec, int nthreads)
+{
+    FILE *myout=stdout;
+    if (nthreads <= 0) {
+        nthreads = (int) std::thread::hardware_concurrency();
+        if (nthreads <= 0) {
+            nthreads = 1;
+        }
+    }
+    std::atomic<int> stop(0);
+    UDP_INGEST_WORKER *workers = new UDP_INGEST_WORKER[nthreads]();
+    int opened = 0;
+    // 按顺序加入 SO_REUSEPORT 组，BPF 程序返回的下标就是这里的顺序
+    for (; opened < nthreads; opened++) {
+        UDP_INGEST_WORKER *w = &workers[opened];
+        w->index = opened;
+        w->stop = &stop;
+        UdpStatsInit(&w->sock);
+        // 1 秒超时：空闲的线程也能按时发布统计、看到退出标志
+        w->fd = OpenUdpSocket(port, 1, 1);
+        if (w->fd < 0) {
+            break;
+        }
+    }
+    if (opened < nthreads) {
+        for (int i = 0; i < opened; i++) {
+            close(workers[i].fd);
+        }
+        delete[] workers;
+        return -1;
+    }
+    int steered = AttachSsrcSteering(workers[0].fd, nthreads) == 0;
+    printf("Listening on port %d with %d threads, flows steered by %s\n", port, nthreads,
+           steered ? "SSRC" : "source address hash");
+
+    std::thread *threads = new std::thread[nthreads];
+    for (int i = 0; i < nthreads; i++) {
+        threads[i] = std::thread(UdpIngestWorker, &workers[i]);
+    }
+
+    static UDP_STREAM_STATS total;
+    unsigned long long last_packets = 0;
+    int idle = 0;
+    while (idle < timeout_sec) {
+        sleep(1);
+        MergeUdpWorkers(myout, workers, nthreads, &total, 0);
+        PrintUdpStats(myout, &total);
+        fflush(myout);
+        if (total.packets == last_packets) {
+            idle++;
+        } else {
+            idle = 0;
+            last_packets = total.packets;
+        }
+        int failed = 0;
+        for (int i = 0; i < nthreads; i++) {
+            failed += workers[i].error.load();
+        }
+        if (failed > 0) {
+            break;
+        }
+    }
+    if (idle >= timeout_sec) {
+        printf("time out\n");
+    }
+    stop.store(1);
+    int ret = 0;
+    for (int i = 0; i < nthreads; i++) {
+        threads[i].join();
+        if (workers[i].error.load()) {
+            ret = -1;
+        }
+    }
+    MergeUdpWorkers(myout, workers, nthreads, &total, 1);
+    PrintUdpStats(myout, &total);
+
+    for (int i = 0; i < nthreads; i++) {
+        close(workers[i].fd);
+        for (int j = 0; j < workers[i].stream_count; j++) {
+            free(workers[i].streams[j]);
+        }
+        for (int j = 0; j < workers[i].published_count; j++) {
+            free(workers[i].published[j]);
+        }
+    }
+    delete[] threads;
+    delete[] workers;
+    return ret;
+}
+#endif
 
 // 运行不了的话，就手动链接 lws2_32
 // gcc udp_rtp.cpp -o udp_rtp -lws2_32
+// POSIX：g++ udp_rtp.cpp -o udp_rtp -pthread
+// 用法：udp_rtp [port] [-q] [-t timeout_s] [-threads n]
+//       -q：不列出每个包，每秒输出一次统计；-t：多长时间没有收到数据就退出（只用于 POSIX）
+//       -threads：用 n 个线程接收（SO_REUSEPORT，按 SSRC 分配，只输出统计，只用于 POSIX），0 表示每个 CPU 一个
 int main(int argc, char *argv[]){
-    simplest_udp_parser(8880);
+    int port = 8880, quiet = 0, timeout_sec = 10000, nthreads = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-q") == 0) {
+            quiet = 1;
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            timeout_sec = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) {
+            nthreads = atoi(argv[++i]);
+        } else {
+            port = atoi(argv[i]);
+        }
+    }
+#ifdef _WIN32
+    simplest_udp_parser(port);
+#else
+    if (nthreads != 1) {
+        simplest_udp_parser_reuseport(port, timeout_sec, nthreads);
+    } else {
+        simplest_udp_parser_batch(port, timeout_sec, quiet);
+    }
+#endif
 }